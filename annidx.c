@@ -0,0 +1,562 @@
+/*
+ * Metaann
+ *
+ * Copyright (C) 2014 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Lazily loaded annotation files
+
+   Reading a whole annotation file into memory before the first screen is
+   drawn is wasteful for a long record, whose beat annotation file may hold
+   tens of millions of annotations, when only the screens around a few
+   alarms are ever shown.  If the annotation file is a local file in MIT
+   format, at least Wave.LazyAnnotations kilobytes long, it is instead
+   divided into blocks of ANX_BLOCK annotations, and annot.c reads only the
+   blocks that it needs for the screens that are drawn or prefetched, and
+   for searches (see ensure_annotations() in annot.c.)
+
+   The annotations are decoded directly from a memory map of the file.
+   Since the file stores the intervals between annotations, and changes of
+   chan and num, decoding a block requires the time, chan and num in effect
+   at its start; these are kept in an index.  The index also holds a copy
+   of every annotation that is not a beat label, or that has an aux string,
+   so that alarms can be listed without reading the file, as long as no
+   alarm can be a beat label without one (see select_record() in
+   metaann.c.)
+
+   The index is built the first time the file is read, by decoding the
+   whole file and checking each annotation against those returned by
+   getann(); if any differ (because the file is not in MIT format, is not
+   in time order, or its times must be converted), the file is read by
+   annot_init() as usual.  The index is saved in the directory given to
+   annidx_init(), which persists between sessions, and used again as long
+   as the annotation file has not changed (or, for a copy of a remote file,
+   as long as the server reports the same version.)  Since the index is
+   built only if no conversion is needed, its times are those stored in the
+   file; if the annotations are wanted in another time base (see
+   annidx_set_freq()), their times are converted as they are read. */
+
+#include <glib/gstdio.h>
+#include <wfdb/ecgmap.h>
+#include "wave.h"
+#include "gtkwave.h"
+#include "blockcache.h"
+
+#define ANX_BLOCK 4096		/* annotations per block */
+
+#define ANX_FILE_SUFFIX ".mai"
+#define ANX_FILE_MAGIC "MAIDX1"
+
+/* Pseudo-annotation codes used in MIT format annotation files */
+#define ANX_SKIP 59		/* the next two words are a time interval */
+#define ANX_NUM 60		/* data field is the new num */
+#define ANX_SUB 61		/* data field is the subtyp */
+#define ANX_CHN 62		/* data field is the new chan */
+#define ANX_AUX 63		/* data field is the length of the aux string */
+
+#define ANX_WORD(p) ((p)[0] | ((p)[1] << 8))
+
+struct anx_block {
+    gint64 offset;		/* byte offset of the block's first word */
+    gint64 base;		/* time preceding the first annotation */
+    gint64 first, last;		/* times of the first and last annotations */
+    gint32 chan, num;		/* chan and num at the start of the block */
+    gint32 count;		/* number of annotations */
+    gint32 pad;
+};
+
+struct anx_note {
+    gint64 time;
+    gint32 aux;			/* offset in anx_note_aux, or -1 */
+    char anntyp;
+    signed char subtyp;
+    unsigned char chan;
+    signed char num;
+};
+
+struct anx_file_header {
+    char magic[8];
+    gint64 file_size;
+    gint64 file_mtime;
+    double afreq;
+    gint32 block_size;
+    gint32 nblocks;
+    gint32 nnotes;
+    gint32 aux_size;
+};
+
+/* Decoder state (see decode_annotation()) */
+struct anx_state {
+    gint64 pos;			/* byte offset of the next word */
+    gint64 time;		/* time of the last annotation */
+    int chan, num;
+};
+
+static GMappedFile *anx_file;
+static const guchar *anx_data;
+static gint64 anx_length;
+
+static struct anx_block *anx_blocks;
+static long anx_nblocks;
+static struct anx_note *anx_notes;
+static long anx_nnotes, anx_notes_alloc;
+static GByteArray *anx_note_aux;
+
+/* Time base of the index, and that of the times returned */
+static double anx_freq, anx_afreq;
+
+static char *anx_dir;		/* where indexes are saved, or NULL */
+
+static long lazy_threshold(void)
+{
+    return (defaults_get_integer("wave.lazyannotations",
+				 "Wave.LazyAnnotations", 16384));
+}
+
+/* Convert time t from the time base of the index to that requested. */
+static gint64 anx_time(gint64 t)
+{
+    return (anx_afreq == anx_freq ? t : (gint64) (t * anx_afreq / anx_freq));
+}
+
+/* Decode the next annotation, beginning at s->pos, into *a; the aux string,
+   if any, is copied into aux (which must have room for 258 bytes.)
+   Returns 1 if an annotation was decoded, 0 at the end of the file, or -1 if
+   the file is not valid. */
+static int decode_annotation(struct anx_state *s, struct WFDB_ann *a,
+			     unsigned char *aux)
+{
+    const guchar *p;
+    unsigned int w, code, data;
+    gint32 interval;
+    int found = 0;
+
+    a->subtyp = 0;
+    a->aux = NULL;
+    while (s->pos + 2 <= anx_length) {
+	p = anx_data + s->pos;
+	w = ANX_WORD(p);
+	code = w >> 10;
+	data = w & 0x3ff;
+	if (w == 0 || (found && (code <= ACMAX || code == ANX_SKIP)))
+	    break;		/* end of file, or the next annotation */
+	s->pos += 2;
+	switch (code) {
+	  case ANX_SKIP:
+	    if (s->pos + 4 > anx_length)
+		return (-1);
+	    interval = (gint32) (((guint32) ANX_WORD(p + 2) << 16)
+				 | ANX_WORD(p + 4));
+	    s->time += interval;
+	    s->pos += 4;
+	    break;
+	  case ANX_NUM:
+	    s->num = (signed char) data;
+	    break;
+	  case ANX_SUB:
+	    a->subtyp = (signed char) data;
+	    break;
+	  case ANX_CHN:
+	    s->chan = (unsigned char) data;
+	    break;
+	  case ANX_AUX:
+	    if (s->pos + data > anx_length || data > 255)
+		return (-1);
+	    aux[0] = data;
+	    memcpy(aux + 1, p + 2, aux[0]);
+	    aux[aux[0] + 1] = 0;
+	    a->aux = aux;
+	    s->pos += (data + 1) & ~1;
+	    break;
+	  default:
+	    if (code > ACMAX)
+		return (-1);
+	    s->time += data;
+	    a->anntyp = code;
+	    found = 1;
+	    break;
+	}
+    }
+    if (!found)
+	return (0);
+    a->time = s->time;
+    a->chan = s->chan;
+    a->num = s->num;
+    return (1);
+}
+
+static int same_annotation(const struct WFDB_ann *a, const struct WFDB_ann *b)
+{
+    if (a->time != b->time || a->anntyp != b->anntyp
+	|| a->subtyp != b->subtyp || a->chan != b->chan || a->num != b->num)
+	return (0);
+    if (!a->aux || !b->aux)
+	return (!a->aux && !b->aux);
+    return (a->aux[0] == b->aux[0] && !memcmp(a->aux + 1, b->aux + 1,
+					      a->aux[0]));
+}
+
+static void add_note(const struct WFDB_ann *a)
+{
+    struct anx_note *n;
+
+    if (anx_nnotes >= anx_notes_alloc) {
+	anx_notes_alloc = anx_notes_alloc ? 2 * anx_notes_alloc : 256;
+	anx_notes = g_renew(struct anx_note, anx_notes, anx_notes_alloc);
+    }
+    n = &anx_notes[anx_nnotes++];
+    n->time = a->time;
+    n->anntyp = a->anntyp;
+    n->subtyp = a->subtyp;
+    n->chan = a->chan;
+    n->num = a->num;
+    if (a->aux) {
+	n->aux = anx_note_aux->len;
+	g_byte_array_append(anx_note_aux, a->aux, a->aux[0] + 2);
+    }
+    else
+	n->aux = -1;
+}
+
+/* Build the index by decoding the whole file, checking each annotation
+   against those read from input annotator 0.  Returns 1 on success. */
+static int build_index(void)
+{
+    struct anx_state s;
+    struct anx_block *b = NULL;
+    struct WFDB_ann a, g;
+    unsigned char aux[258];
+    WFDB_Time prev_time = 0;
+    long n = 0, nalloc = 0;
+    int r, prev_chan = 0;
+
+    memset(&s, 0, sizeof(s));
+    anx_nblocks = 0;
+    for (;;) {
+	if (n % ANX_BLOCK == 0) {
+	    if (anx_nblocks >= nalloc) {
+		nalloc = nalloc ? 2 * nalloc : 64;
+		anx_blocks = g_renew(struct anx_block, anx_blocks, nalloc);
+	    }
+	    b = &anx_blocks[anx_nblocks];
+	    memset(b, 0, sizeof(*b));
+	    b->offset = s.pos;
+	    b->base = s.time;
+	    b->chan = s.chan;
+	    b->num = s.num;
+	}
+	if ((r = decode_annotation(&s, &a, aux)) <= 0)
+	    break;
+
+	/* getann() does not return the time resolution note, if any (the
+	   block is then begun again after it.) */
+	if (n == 0 && a.time == 0 && a.anntyp == NOTE && a.aux
+	    && !strncmp((char *) a.aux + 1, "## time resolution", 18))
+	    continue;
+
+	if (getann(0, &g) != 0 || !same_annotation(&a, &g))
+	    return (0);
+	if (n > 0 && (a.time < prev_time
+		      || (a.time == prev_time && a.chan < prev_chan)))
+	    return (0);		/* not in time order */
+	prev_time = a.time;
+	prev_chan = a.chan;
+	if (b->count++ == 0) {
+	    b->first = a.time;
+	    anx_nblocks++;
+	}
+	b->last = a.time;
+	if (!isqrs(a.anntyp) || a.aux)
+	    add_note(&a);
+	n++;
+    }
+    return (r == 0 && getann(0, &g) != 0 && anx_nblocks > 0);
+}
+
+/* Find the name of the saved index for the annotation file fname, and the
+   size and modification time that the file must have for the index to be
+   used.  A file given by a relative path is a copy, made in this session,
+   of a file in one of the remote directories (the working directory is
+   the cache directory, which is cleared when the program starts), so its
+   index is named after the URL and version of the remote file, and its
+   modification time is ignored; the index of any other file is named after
+   its path.  Returns NULL if the index can't be saved. */
+static char *index_file_name(const char *fname, const GStatBuf *st,
+			     gint64 *size, gint64 *mtime)
+{
+    char *url, *version, *key, *hash, *name, *iname;
+
+    if (!anx_dir)
+	return (NULL);
+    if (g_path_is_absolute(fname)) {
+	key = g_strdup(fname);
+	*mtime = st->st_mtime;
+    }
+    else {
+	if (g_str_has_prefix(fname, "./"))
+	    fname += 2;
+	if (!(url = cache_find_url(fname)))
+	    return (NULL);
+	version = cache_url_version(url);
+	key = (version ? g_strconcat(url, "\n", version, NULL) : NULL);
+	g_free(version);
+	g_free(url);
+	if (!key)
+	    return (NULL);
+	*mtime = 0;
+    }
+    *size = st->st_size;
+
+    hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+    name = g_strconcat(hash, ANX_FILE_SUFFIX, NULL);
+    iname = g_build_filename(anx_dir, name, NULL);
+    g_free(name);
+    g_free(hash);
+    g_free(key);
+    return (iname);
+}
+
+static void save_index(const char *iname, gint64 size, gint64 mtime,
+		       double afreq)
+{
+    struct anx_file_header hdr;
+    FILE *f;
+    int ok;
+
+    g_mkdir_with_parents(anx_dir, 0700);
+    if ((f = g_fopen(iname, "wb")) == NULL)
+	return;
+
+    memset(&hdr, 0, sizeof(hdr));
+    strncpy(hdr.magic, ANX_FILE_MAGIC, sizeof(hdr.magic));
+    hdr.file_size = size;
+    hdr.file_mtime = mtime;
+    hdr.afreq = afreq;
+    hdr.block_size = ANX_BLOCK;
+    hdr.nblocks = anx_nblocks;
+    hdr.nnotes = anx_nnotes;
+    hdr.aux_size = anx_note_aux->len;
+    ok = (fwrite(&hdr, sizeof(hdr), 1, f) == 1
+	  && fwrite(anx_blocks, sizeof(struct anx_block), anx_nblocks, f)
+	     == (size_t) anx_nblocks
+	  && fwrite(anx_notes, sizeof(struct anx_note), anx_nnotes, f)
+	     == (size_t) anx_nnotes
+	  && fwrite(anx_note_aux->data, 1, anx_note_aux->len, f)
+	     == anx_note_aux->len);
+
+    if (fclose(f) != 0 || !ok) {
+	g_warning("Unable to write %s", iname);
+	g_unlink(iname);
+    }
+}
+
+/* Read the saved index, if it matches the annotation file.  Returns 1 on
+   success. */
+static int load_index(const char *iname, gint64 size, gint64 mtime)
+{
+    struct anx_file_header hdr;
+    FILE *f;
+    int ok;
+
+    if ((f = g_fopen(iname, "rb")) == NULL)
+	return (0);
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1
+	|| strncmp(hdr.magic, ANX_FILE_MAGIC, sizeof(hdr.magic))
+	|| hdr.file_size != size
+	|| hdr.file_mtime != mtime
+	|| hdr.afreq <= 0.
+	|| hdr.block_size != ANX_BLOCK
+	|| hdr.nblocks <= 0 || hdr.nnotes < 0 || hdr.aux_size < 0) {
+	fclose(f);
+	return (0);
+    }
+
+    anx_freq = hdr.afreq;
+    anx_nblocks = hdr.nblocks;
+    anx_blocks = g_renew(struct anx_block, anx_blocks, anx_nblocks);
+    anx_nnotes = anx_notes_alloc = hdr.nnotes;
+    anx_notes = g_renew(struct anx_note, anx_notes, anx_nnotes);
+    g_byte_array_set_size(anx_note_aux, hdr.aux_size);
+    ok = (fread(anx_blocks, sizeof(struct anx_block), anx_nblocks, f)
+	  == (size_t) anx_nblocks
+	  && fread(anx_notes, sizeof(struct anx_note), anx_nnotes, f)
+	     == (size_t) anx_nnotes
+	  && fread(anx_note_aux->data, 1, hdr.aux_size, f)
+	     == (size_t) hdr.aux_size);
+    fclose(f);
+    return (ok);
+}
+
+/* Discard the index and unmap the annotation file. */
+void annidx_close(void)
+{
+    if (anx_file)
+	g_mapped_file_unref(anx_file);
+    anx_file = NULL;
+    anx_data = NULL;
+    anx_length = 0;
+    anx_nblocks = anx_nnotes = 0;
+    if (anx_note_aux)
+	g_byte_array_set_size(anx_note_aux, 0);
+}
+
+/* Annidx_open() prepares to read the annotation file for record rec and
+   annotator ann lazily, if it is large enough.  The file must already be
+   open as input annotator 0, with times in units of 1/afreq seconds.  If
+   the index must be built, annotations are read from the annotator; if
+   the file can't be read lazily after all, it is opened again.  A saved
+   index is used whatever its time base, so that an index built for one
+   time base can be used for another.  Returns the number of blocks, or 0 if
+   the file should be read by getann() as usual. */
+long annidx_open(const char *rec, const char *ann, double afreq)
+{
+    WFDB_Anninfo ai;
+    GStatBuf st;
+    char *fname, *iname;
+    gint64 size, mtime;
+    long threshold = lazy_threshold();
+
+    annidx_close();
+    if (threshold <= 0 || !rec || !ann
+	|| !(fname = wfdbfile((char *) ann, (char *) rec))
+	|| strstr(fname, "://") || g_stat(fname, &st) != 0
+	|| !S_ISREG(st.st_mode) || st.st_size < threshold * 1024
+	|| !(anx_file = g_mapped_file_new(fname, FALSE, NULL)))
+	return (0);
+    anx_data = (const guchar *) g_mapped_file_get_contents(anx_file);
+    anx_length = g_mapped_file_get_length(anx_file);
+    if (!anx_note_aux)
+	anx_note_aux = g_byte_array_new();
+
+    anx_afreq = afreq;
+    iname = index_file_name(fname, &st, &size, &mtime);
+    if (iname && load_index(iname, size, mtime)) {
+	g_free(iname);
+	return (anx_nblocks);
+    }
+
+    anx_nblocks = anx_nnotes = 0;
+    g_byte_array_set_size(anx_note_aux, 0);
+    anx_freq = afreq;
+    if (build_index()) {
+	if (iname)
+	    save_index(iname, size, mtime, afreq);
+	g_free(iname);
+	return (anx_nblocks);
+    }
+    g_free(iname);
+
+    /* Start again from the beginning of the file. */
+    annidx_close();
+    ai.name = (char *) ann;
+    ai.stat = WFDB_READ;
+    if (annopen((char *) rec, &ai, 1) == 0)
+	setiafreq(0, afreq);
+    return (0);
+}
+
+/* Annidx_init() sets the directory in which indexes are saved between
+   sessions.  If it is not called, indexes are not saved. */
+void annidx_init(const char *dir)
+{
+    g_free(anx_dir);
+    anx_dir = g_strdup(dir);
+}
+
+/* From now on, give the times of annotations in units of 1/afreq
+   seconds. */
+void annidx_set_freq(double afreq)
+{
+    anx_afreq = afreq;
+}
+
+/* Return the number of annotations in block k. */
+long annidx_block_size(long k)
+{
+    return (anx_blocks[k].count);
+}
+
+/* Return the index of the first block containing any annotations at or
+   after time t (or the number of blocks, if there are none.) */
+long annidx_first_block(long t)
+{
+    long lo = 0, hi = anx_nblocks, mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo)/2;
+	if (anx_time(anx_blocks[mid].last) < t) lo = mid + 1;
+	else hi = mid;
+    }
+    return (lo);
+}
+
+/* Return the index of the last block containing any annotations at or
+   before time t (or -1, if there are none.) */
+long annidx_last_block(long t)
+{
+    long lo = 0, hi = anx_nblocks, mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo)/2;
+	if (anx_time(anx_blocks[mid].first) <= t) lo = mid + 1;
+	else hi = mid;
+    }
+    return (lo - 1);
+}
+
+/* Decode the annotations in block k, passing each to add().  Returns the
+   number of annotations added, or -1 if add() fails. */
+long annidx_read_block(long k, int (*add)(struct WFDB_ann *))
+{
+    struct anx_block *b = &anx_blocks[k];
+    struct anx_state s;
+    struct WFDB_ann a;
+    unsigned char aux[258];
+    long n;
+
+    s.pos = b->offset;
+    s.time = b->base;
+    s.chan = b->chan;
+    s.num = b->num;
+    for (n = 0; n < b->count && decode_annotation(&s, &a, aux) > 0; n++) {
+	a.time = anx_time(a.time);
+	if (!add(&a))
+	    return (-1);
+    }
+    return (n);
+}
+
+/* Return the number of annotations listed in the index (those that are not
+   beat labels, or have aux strings.) */
+long annidx_notes(void)
+{
+    return (anx_nnotes);
+}
+
+/* Copy the i-th listed annotation into *annot.  The aux string, if any,
+   remains in the index. */
+void annidx_get_note(long i, struct WFDB_ann *annot)
+{
+    struct anx_note *n = &anx_notes[i];
+
+    annot->time = anx_time(n->time);
+    annot->anntyp = n->anntyp;
+    annot->subtyp = n->subtyp;
+    annot->chan = n->chan;
+    annot->num = n->num;
+    annot->aux = (n->aux < 0 ? NULL : anx_note_aux->data + n->aux);
+}
@@ -25,6 +25,9 @@
 #include "gtkwave.h"
 #include <sys/time.h>
 #include <wfdb/ecgmap.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* The ANSI C function strstr is defined here for those systems which don't
    include it in their libraries.  This includes all older (pre-ANSI) C
@@ -71,44 +74,343 @@ void wave_draw_string(GdkDrawable *drawable, GdkGC *gc,
 		    wave_text_layout);
 }
 
-struct ap *get_ap()
+int annotations;	/* non-zero if there are annotations to be shown */
+time_t tupdate;		/* time of last update to annotation file */
+
+/* The annotation arrays (see wave.h) are reused from one record to the next,
+   and grown as needed.  ann_alloc is the number of elements allocated for
+   each array, aux_alloc and aux_used are the allocated and used sizes of
+   the aux string arena, and aux_str_alloc is the number of elements
+   allocated for ann_aux_offset.  ann_generation is incremented whenever the
+   annotations are reread. */
+static long ann_alloc, aux_alloc, aux_used, aux_str_alloc, ann_generation;
+
+/* Each distinct aux string is stored once.  aux_table is used to find
+   strings that have already been stored; its keys are string numbers plus
+   one. */
+static GHashTable *aux_table;
+
+static guint aux_hash(gconstpointer key)
 {
-    struct ap *a;
+    const unsigned char *p = ann_aux_arena
+	+ ann_aux_offset[GPOINTER_TO_INT(key) - 1];
+    int n = *p;
+    guint h = 5381 + n;
 
-    if ((a = (struct ap *)malloc(sizeof(struct ap))) == NULL) {
-/*
-#ifdef NOTICE
-	Xv_notice notice = xv_create((Frame)frame, NOTICE,
-				     XV_SHOW, TRUE,
-#else
-	(void)notice_prompt((Frame)frame, (Event *)NULL,
-#endif
-		      NOTICE_MESSAGE_STRINGS,
-		      "Error in allocating memory for annotations\n", 0,
-		      NOTICE_BUTTON_YES, "Continue", 0);
-#ifdef NOTICE
-	xv_destroy_safe(notice);
-#endif
-*/
+    while (n-- > 0)
+	h = h*33 + *++p;
+    return (h);
+}
+
+static gboolean aux_equal(gconstpointer key1, gconstpointer key2)
+{
+    const unsigned char *p1 = ann_aux_arena
+	+ ann_aux_offset[GPOINTER_TO_INT(key1) - 1];
+    const unsigned char *p2 = ann_aux_arena
+	+ ann_aux_offset[GPOINTER_TO_INT(key2) - 1];
+
+    return (*p1 == *p2 && memcmp(p1 + 1, p2 + 1, *p1) == 0);
+}
+
+#define GROW_ARRAY(a, n) ((tmp = realloc((a), (n)*sizeof(*(a)))) ? \
+			  ((a) = tmp, 1) : 0)
+
+/* Make room for at least n annotations, naux bytes of aux strings, and
+   nstr distinct aux strings.  Returns 0 if memory is exhausted. */
+static int reserve_annotations(long n, long naux, long nstr)
+{
+    void *tmp;
+    long nalloc;
+
+    if (n > ann_alloc) {
+	nalloc = (ann_alloc > 0) ? ann_alloc : 1024;
+	while (nalloc < n) nalloc *= 2;
+	if (!GROW_ARRAY(ann_time, nalloc) ||
+	    !GROW_ARRAY(ann_anntyp, nalloc) ||
+	    !GROW_ARRAY(ann_subtyp, nalloc) ||
+	    !GROW_ARRAY(ann_chan, nalloc) ||
+	    !GROW_ARRAY(ann_num, nalloc) ||
+	    !GROW_ARRAY(ann_aux, nalloc))
+	    return (0);
+	ann_alloc = nalloc;
+    }
+    if (naux > aux_alloc) {
+	nalloc = (aux_alloc > 0) ? aux_alloc : 4096;
+	while (nalloc < naux) nalloc *= 2;
+	if (!GROW_ARRAY(ann_aux_arena, nalloc))
+	    return (0);
+	aux_alloc = nalloc;
+    }
+    if (nstr > aux_str_alloc) {
+	nalloc = (aux_str_alloc > 0) ? aux_str_alloc : 256;
+	while (nalloc < nstr) nalloc *= 2;
+	if (!GROW_ARRAY(ann_aux_offset, nalloc))
+	    return (0);
+	aux_str_alloc = nalloc;
+    }
+    return (1);
+}
+
+/* Append an annotation (as returned by getann) to the arrays, copying its
+   aux string, if any, into the arena unless an identical string is already
+   there.  Returns 0 if memory is exhausted. */
+static int add_annotation(struct WFDB_ann *a)
+{
+    long naux = a->aux ? *(a->aux) + 2 : 0, id;
+    gpointer key, old;
+
+    if (!reserve_annotations(n_annots + 1, aux_used + naux,
+			     n_aux_strings + 1))
+	return (0);
+    ann_time[n_annots] = a->time;
+    ann_anntyp[n_annots] = a->anntyp;
+    ann_subtyp[n_annots] = a->subtyp;
+    ann_chan[n_annots] = a->chan;
+    ann_num[n_annots] = a->num;
+    if (a->aux) {
+	/* Copy the string to the end of the arena, and keep it there only if
+	   it has not been seen before. */
+	id = n_aux_strings;
+	ann_aux_offset[id] = aux_used;
+	memcpy(ann_aux_arena + aux_used, a->aux, naux - 1);
+	ann_aux_arena[aux_used + naux - 1] = 0;
+	key = GINT_TO_POINTER(id + 1);
+	if (aux_table == NULL)
+	    aux_table = g_hash_table_new(aux_hash, aux_equal);
+	if ((old = g_hash_table_lookup(aux_table, key)))
+	    id = GPOINTER_TO_INT(old) - 1;
+	else {
+	    g_hash_table_insert(aux_table, key, key);
+	    n_aux_strings++;
+	    aux_used += naux;
+	}
+	ann_aux[n_annots] = id;
+    }
+    else
+	ann_aux[n_annots] = -1;
+    n_annots++;
+    return (1);
+}
+
+static int compare_ann_order(const void *p1, const void *p2)
+{
+    long i1 = *(const long *)p1, i2 = *(const long *)p2;
+
+    if (ann_time[i1] != ann_time[i2])
+	return (ann_time[i1] < ann_time[i2] ? -1 : 1);
+    if (ann_chan[i1] != ann_chan[i2])
+	return (ann_chan[i1] < ann_chan[i2] ? -1 : 1);
+    return (i1 < i2 ? -1 : i1 > i2);
+}
+
+#define PERMUTE_ARRAY(a, type) do {				\
+	memcpy(tmp, (a), n_annots*sizeof(type));			\
+	for (i = 0; i < n_annots; i++)					\
+	    (a)[i] = ((type *) tmp)[order[i]];				\
+    } while (0)
+
+/* Annotation files are normally in time order, with simultaneous
+   annotations ordered by chan, but this is not guaranteed.  Sort the arrays
+   if necessary (keeping simultaneous annotations on the same signal in their
+   original order), so that they can be searched by locate_annotation(). */
+static void sort_annotations()
+{
+    long i, *order;
+    void *tmp;
+
+    for (i = 1; i < n_annots; i++)
+	if (ann_time[i] < ann_time[i-1] ||
+	    (ann_time[i] == ann_time[i-1] && ann_chan[i] < ann_chan[i-1]))
+	    break;
+    if (i >= n_annots)
+	return;		/* already in order */
+
+    if ((order = malloc(n_annots * sizeof(long))) == NULL ||
+	(tmp = malloc(n_annots * (sizeof(WFDB_Time) > sizeof(long) ?
+				      sizeof(WFDB_Time) : sizeof(long)))) == NULL) {
+	free(order);
 	g_warning("Error in allocating memory for annotations");
+	return;
     }
-    return (a);
+    for (i = 0; i < n_annots; i++)
+	order[i] = i;
+    qsort(order, n_annots, sizeof(long), compare_ann_order);
+
+    PERMUTE_ARRAY(ann_time, WFDB_Time);
+    PERMUTE_ARRAY(ann_anntyp, char);
+    PERMUTE_ARRAY(ann_subtyp, signed char);
+    PERMUTE_ARRAY(ann_chan, unsigned char);
+    PERMUTE_ARRAY(ann_num, signed char);
+    PERMUTE_ARRAY(ann_aux, long);
+    free(tmp);
+    free(order);
 }
 
-int annotations;	/* non-zero if there are annotations to be shown */
-time_t tupdate;		/* time of last update to annotation file */
+/* Annotations read by load_annotations() (below) are kept for the next call
+   to annot_init(), which can use them if the record and annotator match.
+   loaded_freq is the time base of those annotations, or zero if there are
+   none. */
+static char loaded_record[RNLMAX+1], loaded_annotator[ANLMAX+1];
+static double loaded_freq;
+
+/* If the annotation file is read lazily (see annidx.c), n_blocks is the
+   number of blocks in the file, and block_first[k] is the index of the first
+   annotation of block k in the arrays, or -1 if the block has not been read.
+   The blocks that have been read are kept in the arrays in order. */
+static long *block_first, n_blocks;
+
+/* Discard any annotations that were previously read (the memory is reused
+   for the new annotations.) */
+static void discard_annotations()
+{
+    n_annots = aux_used = n_aux_strings = 0;
+    if (aux_table) g_hash_table_remove_all(aux_table);
+    ann_generation++;
+    loaded_freq = 0.;
+    n_blocks = 0;
+    annidx_close();
+}
+
+#define ROTATE_ARRAY(a, type) do {					\
+	memcpy(tmp, (a) + n0, n*sizeof(type));				\
+	memmove((a) + pos + n, (a) + pos, (n0 - pos)*sizeof(type));	\
+	memcpy((a) + pos, tmp, n*sizeof(type));				\
+    } while (0)
+
+/* Read block k of a lazily read annotation file, and insert its annotations
+   into the arrays after those of the preceding blocks.  Returns 0 if memory
+   is exhausted. */
+static int read_block(k)
+long k;
+{
+    long j, n, n0 = n_annots, pos = n_annots;
+    void *tmp;
+
+    for (j = k + 1; j < n_blocks; j++)
+	if (block_first[j] >= 0) {
+	    pos = block_first[j];
+	    break;
+	}
+    if ((n = annidx_read_block(k, add_annotation)) < 0) {
+	g_warning("Error in allocating memory for annotations");
+	n_annots = n0;
+	return (0);
+    }
+    ann_generation++;	/* there may be new aux strings */
+
+    if (pos < n0 && n > 0) {
+	/* Move the new annotations (appended to the arrays) into place. */
+	if ((tmp = malloc(n * (sizeof(WFDB_Time) > sizeof(long) ?
+			       sizeof(WFDB_Time) : sizeof(long)))) == NULL) {
+	    g_warning("Error in allocating memory for annotations");
+	    n_annots = n0;
+	    return (0);
+	}
+	ROTATE_ARRAY(ann_time, WFDB_Time);
+	ROTATE_ARRAY(ann_anntyp, char);
+	ROTATE_ARRAY(ann_subtyp, signed char);
+	ROTATE_ARRAY(ann_chan, unsigned char);
+	ROTATE_ARRAY(ann_num, signed char);
+	ROTATE_ARRAY(ann_aux, long);
+	free(tmp);
+	for (; j < n_blocks; j++)
+	    if (block_first[j] >= 0) block_first[j] += n;
+	if (ann_cur >= pos) ann_cur += n;
+	if (attached >= pos) attached += n;
+    }
+    block_first[k] = pos;
+    return (1);
+}
+
+/* Read blocks k0 through k1-1 of a lazily read annotation file, if they
+   have not been read already.  Returns the index following the last
+   annotation of block k1-1. */
+static long read_blocks(k0, k1)
+long k0, k1;
+{
+    long k;
+
+    if (k1 > n_blocks) k1 = n_blocks;
+    for (k = k0; k < k1; k++)
+	if (block_first[k] < 0 && !read_block(k))
+	    break;
+    for (k = k1 - 1; k >= k0; k--)
+	if (block_first[k] >= 0)
+	    return (block_first[k] + annidx_block_size(k));
+    return (n_annots);
+}
+
+/* Ensure_annotations() reads any blocks of a lazily read annotation file
+   that contain annotations between times left and right inclusive, and the
+   block containing the first annotation at or after left (so that, if
+   there is such an annotation, it can be found in the arrays.) */
+static void ensure_annotations(left, right)
+long left, right;
+{
+    long k0, k1;
+
+    if (n_blocks > 0) {
+	k0 = annidx_first_block(left);
+	k1 = annidx_last_block(right) + 1;
+	(void)read_blocks(k0, k1 > k0 ? k1 : k0 + 1);
+    }
+}
+
+/* Begin reading the annotation file lazily, once annidx_open() has found
+   that it has n blocks.  Only the first block is read now. */
+static void start_lazy(n)
+long n;
+{
+    long k;
+
+    n_blocks = n;
+    block_first = g_renew(long, block_first, n_blocks);
+    for (k = 0; k < n_blocks; k++)
+	block_first[k] = -1;
+    (void)read_blocks(0, 1);
+}
+
+/* Prefetch_annotations() reads the annotations between times left and right,
+   if they have not been read already, so that they can be shown without
+   delay. */
+void prefetch_annotations(left, right)
+long left, right;
+{
+    ensure_annotations(left, right);
+}
+
+/* Read annotations from input annotator 0 into memory, and sort them.
+   Returns 1 if memory was exhausted, 2 otherwise. */
+static int read_annotations()
+{
+    struct WFDB_ann annot;
+    int status = 2;
+
+    while (getann(0, &annot) == 0) {
+	if (!add_annotation(&annot)) {
+	    g_warning("Error in allocating memory for annotations");
+	    status = 1;
+	    break;
+	}
+    }
+    sort_annotations();
+    return (status);
+}
 
 /* Annot_init() (re)opens annotation file(s) for the current record, and
    reads the annotations into memory.  The function returns 0 if no annotations
    can be read, 1 if some annotations were read but memory was exhausted, or 2
-   if all of the annotations were read successfully.  On return, ap_start and
-   annp both point to the first (earliest) annotation, ap_end points to the
-   last one, and attached and scope_annp are reset to NULL. */
+   if all of the annotations were read successfully.  On return, ann_cur is
+   the index of the first (earliest) annotation, and attached is reset to
+   -1.  If the annotations for the current record and annotator have already
+   been read by load_annotations(), they are used without reading the file
+   again. */
 
 int annot_init()
 {
-    char *p;
-    struct ap *a;
+    double lfreq = 0.;
+    long i;
+    int status;
 
     /* If any annotation editing has been performed, bring the output file
        up-to-date. */
@@ -118,17 +420,18 @@ int annot_init()
 			   clearing file space as needed) */
 
     /* Reset pointers. */
-    attached = scope_annp = NULL;
+    attached = ann_cur = -1;
 
-    /* Free any memory that was previously allocated for annotations.
-       This might take a while ... */
-    /*if (frame) xv_set(frame, FRAME_BUSY, TRUE, NULL);*/
-    while (ap_end) {
-	a = ap_end->previous;
-	if (ap_end->this.aux) free(ap_end->this.aux);
-	free(ap_end);
-	ap_end = a;
+    /* Keep the annotations read by load_annotations() if they belong to the
+       current record and annotator; otherwise discard them. */
+    if (loaded_freq > 0. && nann > 0 && af.name &&
+	strncmp(record, loaded_record, RNLMAX) == 0 &&
+	strncmp(af.name, loaded_annotator, ANLMAX) == 0) {
+	lfreq = loaded_freq;
+	loaded_freq = 0.;
     }
+    else
+	discard_annotations();
 
     /* Check that the annotator name, if any, is legal. */
     if (nann > 0 && badname(af.name)) {
@@ -155,6 +458,7 @@ int annot_init()
 	*/
 	g_warning("The annotator name %s cannot be used", ts);
 
+	discard_annotations();
 	af.name = NULL;
 	annotator[0] = '\0';
 	/*set_annot_item("");*/
@@ -168,159 +472,509 @@ int annot_init()
     /* Set time of last update to current time. */
     tupdate = time((time_t *)NULL);
 
+    /* If the annotations have already been read, convert their times to
+       the display's time base if necessary.  If the file is read lazily,
+       the blocks that have been read are read again in the new time base,
+       so that their times agree with those of blocks read later. */
+    if (lfreq > 0.) {
+	if (lfreq != freq && n_blocks > 0) {
+	    i = n_blocks;
+	    n_annots = aux_used = n_aux_strings = 0;
+	    if (aux_table) g_hash_table_remove_all(aux_table);
+	    ann_generation++;
+	    annidx_set_freq(freq);
+	    start_lazy(i);
+	}
+	else if (lfreq != freq) {
+	    for (i = 0; i < n_annots; i++)
+		ann_time[i] = ann_time[i] * freq / lfreq;
+	    ann_generation++;
+	}
+	if (n_annots == 0)
+	    return (annotations = 0);
+	ann_cur = 0;
+	return (annotations = 2);
+    }
+
     /* Return 0 if no annotations are requested or available. */
     if (getgvmode() & WFDB_HIGHRES) setafreq(freq);
     else setafreq(0.);
     if (nann < 1 || annopen(record, &af, 1) < 0) {
-	ap_start = annp = scope_annp = NULL;
 	/*if (frame) xv_set(frame, FRAME_BUSY, FALSE, NULL);*/
 	return (annotations = 0);
     }
     if (getgvmode() & WFDB_HIGHRES) setafreq(freq);
     else setafreq(0.);
-    if ((ap_start = annp = scope_annp = a = get_ap()) == NULL ||
-	getann(0, &(a->this))) {
+
+    /* Read annotations into memory (or only the first block, if the file is
+       to be read lazily.)  Stop (and return 1) if we run out of memory. */
+    if ((i = annidx_open(record, af.name, freq)) > 0) {
+	start_lazy(i);
+	status = 2;
+    }
+    else
+	status = read_annotations();
+    if (n_annots == 0) {
 	(void)annopen(record, NULL, 0);
 	/*if (frame) xv_set(frame, FRAME_BUSY, FALSE, NULL);*/
 	return (annotations = 0);
     }
 
-    /* Read annotations into memory, constructing a doubly-linked list on the
-       fly. */
-    do {
-	a->next = NULL;
-	a->previous = ap_end;
-	if (ap_end) ap_end->next = a;
-	ap_end = a;
-	/* Copy the aux string, if any (since the aux pointer returned by
-	   getann points to static memory that may be overwritten).  Return 1
-	   if we run out of memory. */
-	if (a->this.aux) {
-	    if ((p = (char *)calloc(*(a->this.aux)+2, 1)) == NULL) {
-		/*
-		if (frame)
-		    xv_set(frame, FRAME_BUSY, FALSE, NULL);
-		if (frame) {
-#ifdef NOTICE
-		    Xv_notice notice = xv_create((Frame)frame, NOTICE,
-						 XV_SHOW, TRUE,
-#else
-		    (void)notice_prompt((Frame)frame, (Event *)NULL,
-#endif
-		      NOTICE_MESSAGE_STRINGS,
-		      "Error in allocating memory for aux string\n", 0,
-		      NOTICE_BUTTON_YES, "Continue", 0);
-#ifdef NOTICE
-		    xv_destroy_safe(notice);
-#endif
-		}
-		*/
-		return (annotations = 1);
+    ann_cur = 0;
+    /*if (frame) xv_set(frame, FRAME_BUSY, FALSE, NULL);*/
+    return (annotations = status);
+}
+
+/* Read all annotations for record rec and annotator ann, which must already
+   be open as input annotator 0, with times in units of 1/afreq seconds.
+   This replaces any annotations previously in memory, so the annotation
+   display must not be redrawn until annot_init() has been called for the
+   same record and annotator.  Returns the number of annotations that can be
+   listed by list_annotation():  all of them, unless lazy is nonzero and the
+   file is read lazily (see annidx.c), in which case only those that are not
+   beat labels or that have aux strings are listed. */
+long load_annotations(rec, ann, afreq, lazy)
+const char *rec, *ann;
+double afreq;
+int lazy;
+{
+    long n;
+
+    discard_annotations();
+    attached = ann_cur = -1;
+    setiafreq(0, afreq);
+    if (lazy && (n = annidx_open(rec, ann, afreq)) > 0)
+	start_lazy(n);
+    else
+	(void)read_annotations();
+    g_strlcpy(loaded_record, rec, sizeof(loaded_record));
+    g_strlcpy(loaded_annotator, ann, sizeof(loaded_annotator));
+    loaded_freq = afreq;
+    return (n_blocks > 0 ? annidx_notes() : n_annots);
+}
+
+/* Copy the i-th annotation listed by load_annotations() into *annot.  The aux
+   string, if any, remains in memory until the annotations are read again. */
+void list_annotation(i, annot)
+long i;
+struct WFDB_ann *annot;
+{
+    if (n_blocks > 0) {
+	annidx_get_note(i, annot);
+	return;
+    }
+    annot->time = ann_time[i];
+    annot->anntyp = ann_anntyp[i];
+    annot->subtyp = ann_subtyp[i];
+    annot->chan = ann_chan[i];
+    annot->num = ann_num[i];
+    annot->aux = ann_auxp(i);
+}
+
+/* Return the index of the first annotation at or after time t (n_annots if
+   there is none.) */
+static long ann_lower_bound(t)
+long t;
+{
+    long lo = 0, hi = n_annots, mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo)/2;
+	if (ann_time[mid] < t) lo = mid + 1;
+	else hi = mid;
+    }
+    return (lo);
+}
+
+/* Conditions prepared from the search template by prepare_search().  The
+   anntyp, subtyp, chan and num columns are compared directly with eq_anntyp,
+   eq_subtyp, eq_chan, and eq_num (each -1 if the field is not compared), a
+   block of annotations at a time.  Annotations that pass are then checked
+   against type_ok (for tests of anntyp that are not simple comparisons:
+   M_MAP2, or M_ANNTYP with a template anntyp of 0) and aux_ok (whether each
+   distinct aux string contains the template's aux string), if needed. */
+static int eq_anntyp, eq_subtyp, eq_chan, eq_num, use_type_ok, use_aux_ok;
+static unsigned char type_ok[256];
+
+/* aux_ok is computed only when the template's aux string or the annotation
+   list changes. */
+static unsigned char *aux_ok;
+static long aux_ok_alloc, aux_ok_generation = -1;
+static char *aux_ok_pattern;
+
+/* Prepare to search for annotations matching the template in the fields
+   specified by the mask.  Returns 0 if no annotation can match. */
+static int prepare_search(template, mask)
+struct WFDB_ann *template;
+int mask;
+{
+    char *pattern;
+    int c, ntypes = 0, any_aux = 0;
+    long id;
+
+    eq_subtyp = (mask&M_SUBTYP) ? (unsigned char) template->subtyp : -1;
+    eq_chan   = (mask&M_CHAN)   ? (unsigned char) template->chan   : -1;
+    eq_num    = (mask&M_NUM)    ? (unsigned char) template->num    : -1;
+
+    for (c = 0; c < 256; c++) {
+	type_ok[c] = 1;
+	if (mask&M_ANNTYP) {
+	    if (template->anntyp) {
+		if (template->anntyp != (char) c)
+		    type_ok[c] = 0;
 	    }
-	    memcpy(p, a->this.aux, *(a->this.aux)+1);
-	    a->this.aux = p;
+	    else if ((c & 0x80) == 0)
+		type_ok[c] = 0;
+	}
+	if ((mask&M_MAP2) && template->anntyp != map2((char) c))
+	    type_ok[c] = 0;
+	if (type_ok[c]) {
+	    ntypes++;
+	    eq_anntyp = c;
 	}
-    } while ((a = get_ap()) && getann(0, &(a->this)) == 0);
-
-    /* Return 1 if we ran out of memory while reading the annotation file. */
-    if (a == NULL) {
-	/*if (frame) xv_set(frame, FRAME_BUSY, FALSE, NULL);*/
-	return (annotations = 1);
     }
+    if (ntypes == 0)
+	return (0);
+    if (ntypes > 1)
+	eq_anntyp = -1;
+    use_type_ok = (ntypes > 1 && ntypes < 256);
 
-    /* Return 2 if the entire annotation file has been read successfully. */
-    else {
-	free(a);	/* release last (unneeded) ap structure */
-	/*if (frame) xv_set(frame, FRAME_BUSY, FALSE, NULL);*/
-	return (annotations = 2);
+    use_aux_ok = (mask&M_AUX);
+    if (use_aux_ok) {
+	pattern = (template->aux ? (char *) template->aux + 1 : "");
+	if (aux_ok_generation != ann_generation ||
+	    strcmp(aux_ok_pattern, pattern)) {
+	    if (n_aux_strings > aux_ok_alloc) {
+		aux_ok = g_renew(unsigned char, aux_ok, n_aux_strings);
+		aux_ok_alloc = n_aux_strings;
+	    }
+	    for (id = 0; id < n_aux_strings; id++)
+		aux_ok[id] = (strstr((char *) ann_aux_arena
+				     + ann_aux_offset[id] + 1, pattern) != NULL);
+	    g_free(aux_ok_pattern);
+	    aux_ok_pattern = g_strdup(pattern);
+	    aux_ok_generation = ann_generation;
+	}
+	for (id = 0; id < n_aux_strings && !any_aux; id++)
+	    any_aux = aux_ok[id];
+	if (!any_aux)
+	    return (0);
     }
+    return (1);
+}
+
+/* Return 1 if annotation i passes the direct comparisons. */
+static int columns_match(i)
+long i;
+{
+    return ((eq_anntyp < 0 || (unsigned char) ann_anntyp[i] == eq_anntyp) &&
+	    (eq_subtyp < 0 || (unsigned char) ann_subtyp[i] == eq_subtyp) &&
+	    (eq_chan < 0   || ann_chan[i] == eq_chan) &&
+	    (eq_num < 0    || (unsigned char) ann_num[i] == eq_num));
+}
+
+/* Return 1 if annotation i, which passes the direct comparisons, matches
+   the template. */
+static int candidate_ok(i)
+long i;
+{
+    if (use_type_ok && !type_ok[(unsigned char) ann_anntyp[i]])
+	return (0);
+    if (use_aux_ok && (ann_aux[i] < 0 || !aux_ok[ann_aux[i]]))
+	return (0);
+    return (1);
+}
+
+#define BLOCK_SIZE 16
+
+/* Return a bit mask of which of the BLOCK_SIZE annotations beginning at
+   index i pass the direct comparisons. */
+#ifdef __SSE2__
+#define COMPARE_COLUMN(col, v)						\
+    if ((v) >= 0)							\
+	m = _mm_and_si128(m, _mm_cmpeq_epi8(				\
+	      _mm_loadu_si128((const __m128i *) ((col) + i)),		\
+	      _mm_set1_epi8((char) (v))))
+
+static unsigned int block_match(i)
+long i;
+{
+    __m128i m = _mm_set1_epi8(-1);
+
+    COMPARE_COLUMN(ann_anntyp, eq_anntyp);
+    COMPARE_COLUMN(ann_subtyp, eq_subtyp);
+    COMPARE_COLUMN(ann_chan, eq_chan);
+    COMPARE_COLUMN(ann_num, eq_num);
+    return (_mm_movemask_epi8(m));
+}
+#else
+static unsigned int block_match(i)
+long i;
+{
+    unsigned int bits = 0;
+    int b;
+
+    for (b = 0; b < BLOCK_SIZE; b++)
+	if (columns_match(i + b))
+	    bits |= (1 << b);
+    return (bits);
+}
+#endif
+
+/* Return the index of the first matching annotation at or after index i and
+   before index end, or -1 if there is none. */
+static long search_forward(i, end)
+long i, end;
+{
+    unsigned int bits;
+    int b;
+
+    for (; i + BLOCK_SIZE <= end; i += BLOCK_SIZE)
+	if ((bits = block_match(i)))
+	    for (b = g_bit_nth_lsf(bits, -1); b >= 0;
+		 b = g_bit_nth_lsf(bits, b))
+		if (candidate_ok(i + b))
+		    return (i + b);
+    for (; i < end; i++)
+	if (columns_match(i) && candidate_ok(i))
+	    return (i);
+    return (-1);
+}
+
+/* Return the index of the last matching annotation at or before index i and
+   at or after index start, or -1 if there is none. */
+static long search_backward(i, start)
+long i, start;
+{
+    unsigned int bits;
+    int b;
+
+    for (; i - start >= BLOCK_SIZE - 1; i -= BLOCK_SIZE)
+	if ((bits = block_match(i - BLOCK_SIZE + 1)))
+	    for (b = g_bit_nth_msf(bits, -1); b >= 0;
+		 b = g_bit_nth_msf(bits, b))
+		if (candidate_ok(i - BLOCK_SIZE + 1 + b))
+		    return (i - BLOCK_SIZE + 1 + b);
+    for (; i >= start; i--)
+	if (columns_match(i) && candidate_ok(i))
+	    return (i);
+    return (-1);
 }
 
+/* When the annotation file is read lazily, searches read and search
+   SEARCH_BLOCKS blocks at a time. */
+#define SEARCH_BLOCKS 16
+
 /* next_match() returns the time of the next annotation (i.e., the one later
    than and closest to those currently displayed) that matches the template
-   annotation.  The mask specifies which fields must match. */
+   annotation.  The mask specifies which fields must match.  The search
+   begins at ann_cur, or at the first annotation following the display if
+   that is later; on return, ann_cur is the index of the matching
+   annotation, or -1 if there is none. */
 long next_match(template, mask)
 struct WFDB_ann *template;
 int mask;
 {
-    if (annotations && annp) {
-	/* annp might be NULL if the annotation list is empty, or if the
+    long i, j, k, end, t;
+
+    if (annotations && ann_cur >= 0) {
+	/* ann_cur might be -1 if the annotation list is empty, or if the
 	   last annotation occurs before display_start_time;  in either
 	   case, next_match() returns -1. */
-	do {
-	    if (mask&M_ANNTYP) {
-		if (template->anntyp) {
-		    if (template->anntyp != annp->this.anntyp)
-			continue;
-		}
-		else if ((annp->this.anntyp & 0x80) == 0)
-		    continue;
+	t = display_start_time + nsamp;
+	if (ann_time[ann_cur] > t) t = ann_time[ann_cur];
+	k = (n_blocks > 0) ? annidx_first_block(t) : 0;
+	for (j = -1; n_blocks == 0 || k < n_blocks; k += SEARCH_BLOCKS) {
+	    end = (n_blocks > 0) ? read_blocks(k, k + SEARCH_BLOCKS) : n_annots;
+	    if ((i = j) < 0) {
+		i = ann_lower_bound(display_start_time + nsamp);
+		if (i < ann_cur) i = ann_cur;
 	    }
-	    if ((mask&M_SUBTYP) && template->subtyp != annp->this.subtyp)
-		continue;
-	    if ((mask&M_CHAN)   && template->chan   != annp->this.chan  )
-		continue;
-	    if ((mask&M_NUM)    && template->num    != annp->this.num   )
-		continue;
-	    if ((mask&M_AUX)    && (annp->this.aux == NULL ||
-			  strstr(annp->this.aux+1, template->aux+1) == NULL))
-		continue;
-	    if ((mask&M_MAP2)&&template->anntyp!=map2(annp->this.anntyp))
-		continue;
-	    if (annp->this.time < display_start_time + nsamp)
-		continue;
-	    return (annp->this.time);
-	} while (annp->next, annp = annp->next);
+	    if (prepare_search(template, mask) &&
+		(i = search_forward(i, end)) >= 0)
+		return (ann_time[ann_cur = i]);
+	    if (n_blocks == 0) break;
+	    j = end;	/* annotations before end have been searched */
+	}
+	ann_cur = -1;
     }
     return (-1L);
 }
 
 /* previous_match() returns the time of the previous annotation (i.e., the one
    earlier than and closest to those currently displayed) that matches the
-   template annotation.  The mask specifies which fields must match. */
+   template annotation.  The mask specifies which fields must match.  The
+   search begins at ann_cur, or at the last annotation at or before
+   display_start_time if that is earlier; on return, ann_cur is the index of
+   the matching annotation, or -1 if there is none. */
 long previous_match(template, mask)
 struct WFDB_ann *template;
 int mask;
 {
+    long i, j, k, k0, n, start, t;
+
     if (annotations) {
-	/* annp might be NULL if the annotation list is empty, or if the
+	/* ann_cur might be -1 if the annotation list is empty, or if the
 	   last annotation occurs before display_start_time.  In the first
 	   case, previous_match() returns -1;  in the second case, it begins
 	   its search with the last annotation in the list. */
-	if (annp == NULL) {
-	    if (ap_end && ap_end->this.time < display_start_time)
-		annp = ap_end;
+	if (ann_cur < 0) {
+	    if (n_blocks > 0)
+		(void)read_blocks(n_blocks - 1, n_blocks);
+	    if (n_annots > 0 && ann_time[n_annots-1] < display_start_time)
+		ann_cur = n_annots - 1;
 	    else
 		return (-1L);
 	}
-	do {
-	    if (mask&M_ANNTYP) {
-		if (template->anntyp) {
-		    if (template->anntyp != annp->this.anntyp)
-			continue;
-		}
-		else if ((annp->this.anntyp & 0x80) == 0)
-		    continue;
+	t = display_start_time;
+	if (ann_time[ann_cur] < t) t = ann_time[ann_cur];
+	k = (n_blocks > 0) ? annidx_last_block(t) : 0;
+	for (j = -1; n_blocks == 0 || k >= 0; k -= SEARCH_BLOCKS) {
+	    start = 0;
+	    if (n_blocks > 0) {
+		/* The blocks read here precede those already searched, which
+		   therefore move up in the arrays. */
+		n = n_annots;
+		k0 = (k >= SEARCH_BLOCKS) ? k - SEARCH_BLOCKS + 1 : 0;
+		(void)read_blocks(k0, k + 1);
+		if ((start = block_first[k0]) < 0) break; /* out of memory */
+		if (j >= 0) j += n_annots - n;
+	    }
+	    if ((i = j) < 0) {
+		i = ann_lower_bound(display_start_time + 1) - 1;
+		if (i > ann_cur) i = ann_cur;
 	    }
-	    if ((mask&M_SUBTYP) && template->subtyp != annp->this.subtyp)
-		continue;
-	    if ((mask&M_CHAN)   && template->chan   != annp->this.chan  )
-		continue;
-	    if ((mask&M_NUM)    && template->num    != annp->this.num   )
-		continue;
-	    if ((mask&M_AUX)    && (annp->this.aux == NULL ||
-			  strstr(annp->this.aux+1, template->aux+1) == NULL))
-		continue;
-	    if ((mask&M_MAP2)&&template->anntyp!=map2(annp->this.anntyp))
-		continue;
-	    if (annp->this.time > display_start_time)
-		continue;
-	    return (annp->this.time);
-	} while (annp->previous, annp = annp->previous);
+	    if (prepare_search(template, mask) &&
+		(i = search_backward(i, start)) >= 0)
+		return (ann_time[ann_cur = i]);
+	    if (n_blocks == 0) break;
+	    j = start - 1;	/* annotations after start have been searched */
+	}
+	ann_cur = -1;
     }
     return (-1L);
 }
 
+/* Find_annotations() sets *first to the index of the first annotation in
+   the interval [left, right), and returns the number of annotations in the
+   interval, reading them first if the annotation file is read lazily.  On
+   return, ann_cur is the index of the first annotation at or after left (or
+   -1 if there is none.) */
+long find_annotations(left, right, first)
+long left, right;
+long *first;
+{
+    long i;
+
+    ensure_annotations(left, right);
+    i = ann_lower_bound(left);
+    ann_cur = (i < n_annots) ? i : -1;
+    *first = i;
+    return (ann_lower_bound(right) - i);
+}
+
+/* Time (relative to the left edge of the display) of the first sample in
+   pixel column x. */
+static long column_offset(x)
+int x;
+{
+    long t = (long)(x / tscale);
+
+    while (t * tscale < x) t++;
+    return (t);
+}
+
+/* Number of annotations in a column from which to estimate the dominant
+   type (see below.) */
+#define AGG_SAMPLES	32
+
+/* Aggregate_annotations() summarizes the annotations in each of the first
+   ncols pixel columns of the display, beginning at time left:  count[x] is the
+   number of annotations in column x, and dominant[x] is the most common
+   annotation type among them (or 0 if there are none.)  Each column is found
+   by binary search, and if it contains more than AGG_SAMPLES annotations,
+   the dominant type is estimated from AGG_SAMPLES of them, evenly spaced;
+   the cost therefore depends on ncols and not on the number of annotations. */
+void aggregate_annotations(left, ncols, count, dominant)
+long left;
+int ncols;
+long *count;
+char *dominant;
+{
+    int x, hist[256], best;
+    long i0, i1, j, k, n;
+    unsigned char c;
+
+    memset(hist, 0, sizeof(hist));
+    ensure_annotations(left, left + column_offset(ncols));
+    i0 = ann_lower_bound(left);
+    for (x = 0; x < ncols; x++) {
+	i1 = ann_lower_bound(left + column_offset(x + 1));
+	count[x] = n = i1 - i0;
+	dominant[x] = 0;
+	k = (n < AGG_SAMPLES) ? n : AGG_SAMPLES;
+	for (j = 0, best = 0; j < k; j++) {
+	    c = ann_anntyp[i0 + j*n/k];
+	    if (++hist[c] > best) {
+		best = hist[c];
+		dominant[x] = c;
+	    }
+	}
+	for (j = 0; j < k; j++)
+	    hist[(unsigned char) ann_anntyp[i0 + j*n/k]] = 0;
+	i0 = i1;
+    }
+}
+
+/* Show_annotation_density() is used in place of show_annotations() when
+   there are too many annotations in the window for their labels to be
+   legible.  Each pixel column containing annotations is marked by a bar whose
+   height increases with the number of annotations, and the dominant type is
+   labelled wherever it changes (or there is room for another label.) */
+static void show_annotation_density(left, ncols)
+long left;
+int ncols;
+{
+    static long *count;
+    static char *dominant;
+    static GdkSegment *bars;
+    static int ncols_alloc;
+    int x, h, nbars = 0, label_end = -1;
+    char *p, last = 0;
+
+    if (ncols > ncols_alloc) {
+	count = g_renew(long, count, ncols);
+	dominant = g_renew(char, dominant, ncols);
+	bars = g_renew(GdkSegment, bars, ncols);
+	ncols_alloc = ncols;
+    }
+    aggregate_annotations(left, ncols, count, dominant);
+
+    for (x = 0; x < ncols; x++) {
+	if (count[x] == 0)
+	    continue;
+	h = g_bit_storage(count[x]) * linesp / 8;
+	if (h > linesp) h = linesp;
+	if (h < 1) h = 1;
+	bars[nbars].x1 = bars[nbars].x2 = x;
+	bars[nbars].y1 = abase - linesp;
+	bars[nbars].y2 = abase - linesp + h;
+	nbars++;
+
+	if (x >= label_end && (dominant[x] != last || label_end < 0 ||
+			       x >= label_end + mmx(5))) {
+	    if ((dominant[x] & 0x80) || dominant[x] == NOTQRS) p = ".";
+	    else p = annstr(dominant[x]);
+	    wave_draw_string(wave_drawable, draw_ann, x, abase, p, strlen(p));
+	    label_end = x + wave_text_width(p, strlen(p))
+		+ wave_text_width(" ", 1);
+	    last = dominant[x];
+	}
+    }
+    if (nbars > 0)
+	gdk_draw_segments(wave_drawable, draw_ann, bars, nbars);
+}
+
 /* Show_annotations() displays annotations between times left and left+dt at
 appropriate x-locations in the ECG display area. */
 void show_annotations(left, dt)
@@ -329,33 +983,40 @@ int dt;
 {
     char buf[5], *p;
     int n, s, x, y, ytop, xs = -1, ys;
-    long t, right = left + dt;
+    long i, end, count, right = left + dt;
 
     if (annotations == 0) return;
 
-    /* Find the first annotation to be displayed. */
-    (void)locate_annotation(left, -128);  /* -128 is the lowest chan value */
-    if (annp == NULL) return;
+    /* Find the annotations to be displayed. */
+    if ((count = find_annotations(left, right, &i)) == 0) return;
+    end = i + count;
+
+    /* If there are more annotations than can be labelled legibly (more
+       than one for each character width), summarize them instead. */
+    if (ann_mode != 2 && count > canvas_width / wave_text_width("N", 1)) {
+	show_annotation_density(left, (int)(dt*tscale) + 1);
+	return;
+    }
 
     /* Display all of the annotations in the window. */
-    while (annp->this.time < right) {
-	x = (int)((annp->this.time - left)*tscale);
-	if (annp->this.anntyp & 0x80) {
+    for (; i < end; i++) {
+	x = (int)((ann_time[i] - left)*tscale);
+	if (ann_anntyp[i] & 0x80) {
 	    y = ytop = abase; p = ".";
 	}
-	else switch (annp->this.anntyp) {
+	else switch (ann_anntyp[i]) {
 	  case NOTQRS:
 	    y = ytop = abase; p = "."; break;
 	  case NOISE:
 	    y = ytop = abase - linesp;
-	    if (annp->this.subtyp == -1) { p = "U"; break; }
+	    if (ann_subtyp[i] == -1) { p = "U"; break; }
 	    /* The existing scheme is good for up to 4 signals;  it can be
 	       easily extended to 8 or 12 signals using the chan and num
 	       fields, or to an arbitrary number of signals using `aux'. */
 	    for (s = 0; s < nsig && s < 4; s++) {
-		if (annp->this.subtyp & (0x10 << s))
+		if (ann_subtyp[i] & (0x10 << s))
 		    buf[s] = 'u';	/* signal s is unreadable */
-		else if (annp->this.subtyp & (0x01 << s))
+		else if (ann_subtyp[i] & (0x01 << s))
 		    buf[s] = 'n';	/* signal s is noisy */
 		else
 		    buf[s] = 'c';	/* signal s is clean */
@@ -366,13 +1027,13 @@ int dt;
 	  case TCH:
 	  case NOTE:
 	    y = ytop = abase - linesp;
-	    if (!show_aux && annp->this.aux) p = annp->this.aux+1;
-	    else p = annstr(annp->this.anntyp);
+	    if (!show_aux && ann_aux[i] >= 0) p = ann_auxp(i)+1;
+	    else p = annstr(ann_anntyp[i]);
 	    break;
 	  case LINK:
 	    y = ytop = abase - linesp;
-	    if (!show_aux && annp->this.aux) {
-		char *p1 = annp->this.aux + 1, *p2 = p1 + *(p1-1);
+	    if (!show_aux && ann_aux[i] >= 0) {
+		char *p1 = ann_auxp(i) + 1, *p2 = p1 + *(p1-1);
 		p = p1;
 		while (p1 < p2) {
 		    if (*p1 == ' ' || *p1 == '\t') {
@@ -385,8 +1046,8 @@ int dt;
 	    break;		
 	  case RHYTHM:
 	    y = ytop = abase + linesp;
-	    if (!show_aux && annp->this.aux) p = annp->this.aux+1;
-	    else p = annstr(annp->this.anntyp);
+	    if (!show_aux && ann_aux[i] >= 0) p = ann_auxp(i)+1;
+	    else p = annstr(ann_anntyp[i]);
 	    break;
 	  case INDEX_MARK:
 	    y = ytop = abase - linesp;
@@ -405,93 +1066,93 @@ int dt;
 	    p = ";";
 	    break;
 	  default:
-	    y = ytop = abase; p = annstr(annp->this.anntyp); break;
+	    y = ytop = abase; p = annstr(ann_anntyp[i]); break;
 	}
 	if (ann_mode == 2 && y == abase) {
-	    int yy = y + annp->this.num*vscalea;
+	    int yy = y + ann_num[i]*vscalea;
 
 	    if (xs >= 0)
-		gdk_draw_line(gtk_widget_get_window(wave_view),
+		gdk_draw_line(wave_drawable,
 			      draw_ann, xs, ys, x, yy);
 	    xs = x;
 	    ys = yy;
 	}
 	else {
-	    if (ann_mode == 1 && (unsigned)annp->this.chan < nsig) {
+	    if (ann_mode == 1 && (unsigned)ann_chan[i] < nsig) {
 		if (sig_mode == 0)
 		    y = ytop +=
-			base[(unsigned)annp->this.chan] - abase + mmy(2);
+			base[(unsigned)ann_chan[i]] - abase + mmy(2);
 		else {
-		    int i;
+		    int j;
 
-		    for (i = 0; i < siglistlen; i++)
-			if (annp->this.chan == siglist[i]) {
-			    y = ytop += base[i] - abase + mmy(2);
+		    for (j = 0; j < siglistlen; j++)
+			if (ann_chan[i] == siglist[j]) {
+			    y = ytop += base[j] - abase + mmy(2);
 			    break;
 			}
 		}
 	    }
 
 	    n = strlen(p);
-	    if (n > 3 && !overlap && annp->next &&
-		(annp->next)->this.time < right) {
+	    if (n > 3 && !overlap && i + 1 < n_annots &&
+		ann_time[i+1] < right) {
 	        int maxwidth;
 
-		maxwidth = (int)(((annp->next)->this.time-annp->this.time)*
+		maxwidth = (int)((ann_time[i+1]-ann_time[i])*
 				 tscale)
 		          - wave_text_width(" ", 1);
 
 	        while (n > 3 && wave_text_width(p, n) > maxwidth)
 		    n--;
 	    }
-	    wave_draw_string(gtk_widget_get_window(wave_view),
-			     annp->this.anntyp == LINK ? draw_sig : draw_ann,
+	    wave_draw_string(wave_drawable,
+			     ann_anntyp[i] == LINK ? draw_sig : draw_ann,
 			     x, y, p, n);
 
-	    if (annp->this.anntyp == LINK) {
+	    if (ann_anntyp[i] == LINK) {
 		int xx = x + wave_text_width(p, n), yy = y + linesp/4;
 
-		gdk_draw_line(gtk_widget_get_window(wave_view),
+		gdk_draw_line(wave_drawable,
 			      draw_sig, x, yy, xx, yy);
 	    }
 	
 	    if (show_subtype) {
-		sprintf(buf, "%d", annp->this.subtyp); p = buf; y += linesp;
-		wave_draw_string(gtk_widget_get_window(wave_view),
+		sprintf(buf, "%d", ann_subtyp[i]); p = buf; y += linesp;
+		wave_draw_string(wave_drawable,
 				 draw_ann, x, y, p, strlen(p));
 	    }
 	    if (show_chan) {
-		sprintf(buf, "%d", annp->this.chan); p = buf; y += linesp;
-		wave_draw_string(gtk_widget_get_window(wave_view),
+		sprintf(buf, "%d", ann_chan[i]); p = buf; y += linesp;
+		wave_draw_string(wave_drawable,
 				 draw_ann, x, y, p, strlen(p));
 	    }
 	    if (show_num) {
-		sprintf(buf, "%d", annp->this.num); p = buf; y += linesp;
-		wave_draw_string(gtk_widget_get_window(wave_view),
+		sprintf(buf, "%d", ann_num[i]); p = buf; y += linesp;
+		wave_draw_string(wave_drawable,
 				 draw_ann, x, y, p, strlen(p));
 	    }
-	    if (show_aux && annp->this.aux != NULL) {
-		p = annp->this.aux + 1; y += linesp;
-		wave_draw_string(gtk_widget_get_window(wave_view),
+	    if (show_aux && ann_aux[i] >= 0) {
+		p = ann_auxp(i) + 1; y += linesp;
+		wave_draw_string(wave_drawable,
 				 draw_ann, x, y, p, strlen(p));
 	    }
 	}
-	if (show_marker && !gvflag && annp->this.anntyp != NOTQRS) {
+	if (show_marker && !gvflag && ann_anntyp[i] != NOTQRS) {
 	    GdkSegment marker[2];
 
 	    marker[0].x1 = marker[0].x2 = marker[1].x1 = marker[1].x2 = x;
-	    if (ann_mode == 1 && (unsigned)annp->this.chan < nsig) {
-		unsigned int c = (unsigned)annp->this.chan;
+	    if (ann_mode == 1 && (unsigned)ann_chan[i] < nsig) {
+		unsigned int c = (unsigned)ann_chan[i];
 
 		if (sig_mode == 1) {
-		    int i;
+		    int j;
 
-		    for (i = 0; i < siglistlen; i++)
-			if (c == siglist[i]) {
-			    c = i;
+		    for (j = 0; j < siglistlen; j++)
+			if (c == siglist[j]) {
+			    c = j;
 			    break;
 			}
-		    if (i == siglistlen) {
+		    if (j == siglistlen) {
 			marker[0].y1 = 0;
 			marker[1].y2 = canvas_height;
 		    }
@@ -513,73 +1174,60 @@ int dt;
 	    }
 	    marker[0].y2 = ytop - linesp;
 	    marker[1].y1 = y + mmy(2);
-	    gdk_draw_segments(gtk_widget_get_window(wave_view),
+	    gdk_draw_segments(wave_drawable,
 			      draw_ann, marker, 2);
 	}
-	if (annp->next == NULL) break;
-	annp = annp->next;
-    
     }
+    ann_cur = (i < n_annots) ? i : n_annots - 1;
 }
 
 void clear_annotation_display()
 {
     if (ann_mode == 1 || (use_overlays && show_marker)) {
-	gdk_draw_rectangle(gtk_widget_get_window(wave_view), clear_ann, TRUE,
+	gdk_draw_rectangle(wave_drawable, clear_ann, TRUE,
 		       0, 0, canvas_width+mmx(10), canvas_height);
 	if (!use_overlays)
 	    do_disp();
     }
     else
-	gdk_draw_rectangle(gtk_widget_get_window(wave_view), clear_ann, TRUE,
+	gdk_draw_rectangle(wave_drawable, clear_ann, TRUE,
 		       0, abase-mmy(8), canvas_width+mmx(10), mmy(13));
 }
 
 /* This function locates an annotation at time t, attached to signal s, in the
-   annotation list.  If there is no such annotation, it returns NULL, and annp
-   points to the annotation that follows t (annp is NULL if no annotations
-   follow t).  If there is an annotation at time t, the function sets annp to
-   point to the first such annotation, and returns the value of annp.  (More
-   than one annotation may exist at time t;  if so, on return, annp points to
-   the one with the lowest `chan' field than is no less than s.)
+   annotation list.  If there is no such annotation, it returns -1, and
+   ann_cur is the index of the annotation that follows t (ann_cur is -1 if no
+   annotations follow t).  If there is an annotation at time t, the function
+   sets ann_cur to the index of the first such annotation, and returns the
+   value of ann_cur.  (More than one annotation may exist at time t;  if so,
+   on return, ann_cur is the index of the one with the lowest `chan' field
+   that is no less than s.)  Since the annotations are sorted by time and
+   chan, this is a binary search.
  */
 
-struct ap *locate_annotation(t, s)
+long locate_annotation(t, s)
 long t;
 int s;
 {
-    /* First, find out which of ap_start, annp, and ap_end is nearest t. */
-    if (annp == NULL) {
-	if (ap_start == NULL) return (NULL);
-	annp = ap_start;
-    }
-    if (annp->this.time < t) {
-	if (ap_end == NULL || ap_end->this.time < t)
-	    /* no annotations follow t */
-	    return (annp = NULL);
-	if (t - annp->this.time > ap_end->this.time - t)
-	    annp = ap_end;	/* closer to end than to previous position */
+    long lo, hi, mid;
+
+    ensure_annotations(t, t);
+    lo = ann_lower_bound(t);
+    hi = n_annots;
+
+    /* Among the annotations at time t, find the first with chan >= s. */
+    while (lo < hi) {
+	mid = lo + (hi - lo)/2;
+	if (ann_time[mid] == t && ann_chan[mid] < s) lo = mid + 1;
+	else hi = mid;
     }
-    else {
-	if (t < ap_start->this.time) {	/* no annotations precede t */
-	    annp = ap_start;
-	    return (NULL);
-	}
-	if (t - ap_start->this.time < annp->this.time - t)
-	    annp = ap_start;
-    }
-
-    /* Traverse the list to find the annotation at time t and signal s, or its
-       successor. */
-    while (annp->this.time >= t && annp->previous)
-	annp = annp->previous;
-    while ((annp && annp->this.time < t) ||
-	   (annp->this.time == t && annp->this.chan < s))
-	annp = annp->next;
-    if (annp == NULL || annp->this.time != t || annp->this.chan != s)
-	return (NULL);
+    if (lo >= n_annots)
+	return (ann_cur = -1);	/* no annotations follow t */
+    ann_cur = lo;
+    if (ann_time[lo] != t || ann_chan[lo] != s)
+	return (-1);
     else
-	return (annp);
+	return (ann_cur);
 }
 
 /* Reset the base frame title. */
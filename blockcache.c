@@ -0,0 +1,597 @@
+/*
+ * Metaann
+ *
+ * Copyright (C) 2014 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Persistent block cache
+
+   Remote files (headers, annotations and signal files) are kept on disk
+   between sessions, as blocks of BLOCK_SIZE bytes, so that a reviewer
+   returning to the same project need not download them again.  The
+   blocks of a URL are stored in files named by the SHA-1 hash of the URL
+   and the block number; a small "info" file records the URL's validators
+   (ETag and Last-Modified) and length.
+
+   The first time a URL is used in a session, it is revalidated with a
+   HEAD request; if the resource has changed, its blocks are discarded.
+   If the server can't be reached, the cached blocks are used as they
+   are.  Blocks are discarded, least recently used first (as recorded by
+   their modification times), when their total size exceeds the limit
+   given to block_cache_init().
+
+   The cache may be used from any thread; the lock is not held during
+   network requests. */
+
+#include <string.h>
+#include <stdlib.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "url.h"
+#include "blockcache.h"
+
+#define BLOCK_SHIFT 16
+#define BLOCK_SIZE (1 << BLOCK_SHIFT)
+#define INFO_SUFFIX ".info"
+#define INFO_GROUP "Cache"
+
+struct cached_url {
+    char *url;
+    char *hash;			/* prefix of the names of its files */
+    struct url_info info;	/* validators and length */
+    gboolean checked;		/* revalidated during this session */
+    gboolean missing;		/* not found during this session */
+};
+
+struct cached_block {
+    char *name;			/* file name (hash.number) */
+    gint64 size;		/* number of bytes */
+    GList *lru;			/* link in block_lru */
+};
+
+static GMutex cache_lock;
+static char *cache_dir;
+static char **cache_bases;
+static char *auth_user, *auth_pass;
+static GHashTable *url_table, *block_table;
+static GQueue block_lru = G_QUEUE_INIT;	/* most recently used first */
+static gint64 disk_size, disk_limit;
+
+static char *cache_path(const char *name)
+{
+    return g_build_filename(cache_dir, name, NULL);
+}
+
+static void free_block(gpointer data)
+{
+    struct cached_block *blk = data;
+
+    g_free(blk->name);
+    g_free(blk);
+}
+
+/* Discard a block (with the lock held.) */
+static void remove_block(struct cached_block *blk)
+{
+    char *path = cache_path(blk->name);
+
+    g_remove(path);
+    g_free(path);
+    disk_size -= blk->size;
+    g_queue_delete_link(&block_lru, blk->lru);
+    g_hash_table_remove(block_table, blk->name);
+}
+
+static void trim_block_cache(void)
+{
+    GList *l;
+
+    while (disk_size > disk_limit && (l = block_lru.tail))
+	remove_block(l->data);
+}
+
+/* Enter a block in the index (with the lock held.) */
+static void add_block(const char *name, gint64 size, gboolean newest)
+{
+    struct cached_block *blk;
+
+    if ((blk = g_hash_table_lookup(block_table, name)))
+	remove_block(blk);
+
+    blk = g_new0(struct cached_block, 1);
+    blk->name = g_strdup(name);
+    blk->size = size;
+    if (newest) {
+	g_queue_push_head(&block_lru, blk);
+	blk->lru = block_lru.head;
+    }
+    else {
+	g_queue_push_tail(&block_lru, blk);
+	blk->lru = block_lru.tail;
+    }
+    g_hash_table_insert(block_table, blk->name, blk);
+    disk_size += size;
+}
+
+struct scanned_block {
+    char *name;
+    gint64 size;
+    time_t mtime;
+};
+
+static int compare_scanned(const void *a, const void *b)
+{
+    const struct scanned_block *sa = a, *sb = b;
+    return (sa->mtime > sb->mtime ? -1 : sa->mtime < sb->mtime);
+}
+
+/* Block_cache_init() opens (creating if necessary) the cache in the
+   given directory, with a limit of the given number of bytes.  Files
+   that are not found locally may be looked up (see cache_find_url()) in
+   the given remote directories. */
+void block_cache_init(const char *dir, gint64 limit, char **base_urls)
+{
+    GDir *d;
+    GArray *found;
+    GHashTable *hashes;
+    GStatBuf st;
+    struct scanned_block sb;
+    const char *name;
+    char *path, *hash;
+    guint i;
+
+    g_mutex_lock(&cache_lock);
+    cache_dir = g_strdup(dir);
+    cache_bases = g_strdupv(base_urls);
+    disk_limit = limit;
+    url_table = g_hash_table_new(g_str_hash, g_str_equal);
+    block_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+					NULL, &free_block);
+    g_mkdir_with_parents(cache_dir, 0700);
+
+    /* Index the blocks left by previous sessions, most recently used
+       first, and discard info files whose blocks are all gone. */
+    found = g_array_new(FALSE, FALSE, sizeof(struct scanned_block));
+    hashes = g_hash_table_new_full(g_str_hash, g_str_equal, &g_free, NULL);
+    if ((d = g_dir_open(cache_dir, 0, NULL))) {
+	while ((name = g_dir_read_name(d))) {
+	    if (g_str_has_suffix(name, INFO_SUFFIX))
+		continue;
+	    path = cache_path(name);
+	    if (!g_stat(path, &st)) {
+		sb.name = g_strdup(name);
+		sb.size = st.st_size;
+		sb.mtime = st.st_mtime;
+		g_array_append_val(found, sb);
+		hash = g_strndup(name, strcspn(name, "."));
+		g_hash_table_insert(hashes, hash, hash);
+	    }
+	    g_free(path);
+	}
+	g_dir_rewind(d);
+	while ((name = g_dir_read_name(d))) {
+	    if (!g_str_has_suffix(name, INFO_SUFFIX))
+		continue;
+	    hash = g_strndup(name, strcspn(name, "."));
+	    if (!g_hash_table_lookup(hashes, hash)) {
+		path = cache_path(name);
+		g_remove(path);
+		g_free(path);
+	    }
+	    g_free(hash);
+	}
+	g_dir_close(d);
+    }
+    g_hash_table_destroy(hashes);
+
+    qsort(found->data, found->len, sizeof(struct scanned_block),
+	  &compare_scanned);
+    for (i = 0; i < found->len; i++) {
+	sb = g_array_index(found, struct scanned_block, i);
+	add_block(sb.name, sb.size, FALSE);
+	g_free(sb.name);
+    }
+    g_array_free(found, TRUE);
+    trim_block_cache();
+    g_mutex_unlock(&cache_lock);
+}
+
+/* Block_cache_set_auth() sets the credentials used for requests. */
+void block_cache_set_auth(const char *username, const char *password)
+{
+    g_mutex_lock(&cache_lock);
+    g_free(auth_user);
+    g_free(auth_pass);
+    auth_user = g_strdup(username);
+    auth_pass = g_strdup(password);
+    g_mutex_unlock(&cache_lock);
+}
+
+static void save_info(struct cached_url *cu)
+{
+    GKeyFile *kf;
+    char *data, *name, *path, *len;
+    gsize size;
+
+    kf = g_key_file_new();
+    g_key_file_set_string(kf, INFO_GROUP, "Url", cu->url);
+    if (cu->info.etag)
+	g_key_file_set_string(kf, INFO_GROUP, "ETag", cu->info.etag);
+    if (cu->info.last_modified)
+	g_key_file_set_string(kf, INFO_GROUP, "LastModified",
+			      cu->info.last_modified);
+    len = g_strdup_printf("%" G_GINT64_FORMAT, cu->info.length);
+    g_key_file_set_string(kf, INFO_GROUP, "Length", len);
+    g_free(len);
+
+    data = g_key_file_to_data(kf, &size, NULL);
+    name = g_strconcat(cu->hash, INFO_SUFFIX, NULL);
+    path = cache_path(name);
+    g_file_set_contents(path, data, size, NULL);
+    g_free(path);
+    g_free(name);
+    g_free(data);
+    g_key_file_free(kf);
+}
+
+/* Find (or create) the entry for a URL, with the lock held. */
+static struct cached_url *get_url(const char *url)
+{
+    struct cached_url *cu;
+    GKeyFile *kf;
+    char *name, *path, *s;
+
+    if ((cu = g_hash_table_lookup(url_table, url)))
+	return (cu);
+
+    cu = g_new0(struct cached_url, 1);
+    cu->url = g_strdup(url);
+    cu->hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, url, -1);
+    cu->info.length = -1;
+
+    name = g_strconcat(cu->hash, INFO_SUFFIX, NULL);
+    path = cache_path(name);
+    kf = g_key_file_new();
+    if (g_key_file_load_from_file(kf, path, 0, NULL)) {
+	cu->info.etag = g_key_file_get_string(kf, INFO_GROUP, "ETag", NULL);
+	cu->info.last_modified = g_key_file_get_string(kf, INFO_GROUP,
+						       "LastModified", NULL);
+	if ((s = g_key_file_get_string(kf, INFO_GROUP, "Length", NULL))) {
+	    cu->info.length = g_ascii_strtoll(s, NULL, 10);
+	    g_free(s);
+	}
+    }
+    g_key_file_free(kf);
+    g_free(path);
+    g_free(name);
+
+    g_hash_table_insert(url_table, cu->url, cu);
+    return (cu);
+}
+
+static void remove_url_blocks(struct cached_url *cu)
+{
+    GList *l, *ln;
+    struct cached_block *blk;
+    size_t n = strlen(cu->hash);
+
+    for (l = block_lru.head; l; l = ln) {
+	ln = l->next;
+	blk = l->data;
+	if (!strncmp(blk->name, cu->hash, n) && blk->name[n] == '.')
+	    remove_block(blk);
+    }
+}
+
+/* Two sets of validators match if they have the same length and the same
+   ETag, or (lacking ETags) the same Last-Modified date.  If the server
+   sends neither, the length is all there is to go on. */
+static gboolean same_version(const struct url_info *a,
+			     const struct url_info *b)
+{
+    if (a->length != b->length)
+	return FALSE;
+    if (a->etag || b->etag)
+	return (a->etag && b->etag && !strcmp(a->etag, b->etag));
+    if (a->last_modified || b->last_modified)
+	return (a->last_modified && b->last_modified
+		&& !strcmp(a->last_modified, b->last_modified));
+    return TRUE;
+}
+
+/* Revalidate a URL, if that hasn't been done yet in this session.
+   Returns the entry, or NULL if the resource doesn't exist (or can't be
+   reached, and isn't cached.) */
+static struct cached_url *check_url(const char *url, GError **err)
+{
+    struct cached_url *cu;
+    struct url_info info;
+    char *user, *pass;
+    gboolean ok, usable;
+
+    g_mutex_lock(&cache_lock);
+    cu = get_url(url);
+    if (cu->checked || cu->missing) {
+	g_mutex_unlock(&cache_lock);
+	if (cu->missing) {
+	    g_set_error(err, g_quark_from_static_string("metaann-cache"), 1,
+			"%s not found", url);
+	    return (NULL);
+	}
+	return (cu);
+    }
+    user = g_strdup(auth_user);
+    pass = g_strdup(auth_pass);
+    g_mutex_unlock(&cache_lock);
+
+    ok = url_stat(url, user, pass, &info, err);
+    g_free(user);
+    g_free(pass);
+
+    g_mutex_lock(&cache_lock);
+    if (ok) {
+	if (!same_version(&info, &cu->info)) {
+	    remove_url_blocks(cu);
+	    url_info_clear(&cu->info);
+	    cu->info = info;
+	    save_info(cu);
+	}
+	else
+	    url_info_clear(&info);
+	cu->checked = TRUE;
+    }
+    else if (cu->info.length >= 0) {
+	/* Offline; use what we have. */
+	g_clear_error(err);
+	cu->checked = TRUE;
+    }
+    else
+	cu->missing = TRUE;
+    usable = cu->checked;
+    g_mutex_unlock(&cache_lock);
+    return (usable ? cu : NULL);
+}
+
+static void store_block(struct cached_url *cu, gint64 b,
+			const char *data, gsize size)
+{
+    char *name, *path;
+
+    name = g_strdup_printf("%s.%" G_GINT64_FORMAT, cu->hash, b);
+    path = cache_path(name);
+    if (g_file_set_contents(path, data, size, NULL)) {
+	add_block(name, size, TRUE);
+	trim_block_cache();
+    }
+    g_free(path);
+    g_free(name);
+}
+
+/* Get block b of a URL, from the cache or from the server.  Returns the
+   contents (which may be short, or empty, at the end of the file), or
+   NULL on error.  A block that begins at or past the end of the file
+   (which the server reports as an unsatisfiable range) is empty. */
+static char *get_block(struct cached_url *cu, gint64 b, gsize *size,
+		       GError **err)
+{
+    struct cached_block *blk;
+    char *name, *path, *data, *user, *pass;
+    GError *gerr = NULL;
+    gboolean partial;
+    gint64 i, n;
+    int len;
+
+    name = g_strdup_printf("%s.%" G_GINT64_FORMAT, cu->hash, b);
+    g_mutex_lock(&cache_lock);
+    if ((blk = g_hash_table_lookup(block_table, name))) {
+	path = cache_path(name);
+	if (g_file_get_contents(path, &data, size, NULL)) {
+	    g_queue_unlink(&block_lru, blk->lru);
+	    g_queue_push_head_link(&block_lru, blk->lru);
+	    g_utime(path, NULL);
+	    g_mutex_unlock(&cache_lock);
+	    g_free(path);
+	    g_free(name);
+	    return (data);
+	}
+	remove_block(blk);
+	g_free(path);
+    }
+    user = g_strdup(auth_user);
+    pass = g_strdup(auth_pass);
+    g_mutex_unlock(&cache_lock);
+    g_free(name);
+
+    data = url_get_range(cu->url, user, pass, b << BLOCK_SHIFT, BLOCK_SIZE,
+			 &partial, &len, &gerr);
+    g_free(user);
+    g_free(pass);
+    if (!data) {
+	if (b > 0 && g_error_matches(gerr, URL_ERROR, 416)) {
+	    g_error_free(gerr);
+	    *size = 0;
+	    return (g_strdup(""));
+	}
+	g_propagate_error(err, gerr);
+	return (NULL);
+    }
+
+    g_mutex_lock(&cache_lock);
+    if (partial) {
+	if (len > 0)
+	    store_block(cu, b, data, len);
+	*size = len;
+    }
+    else {
+	/* The server sent the whole file; keep all of it. */
+	for (i = 0; (i << BLOCK_SHIFT) < len; i++) {
+	    n = MIN(BLOCK_SIZE, len - (i << BLOCK_SHIFT));
+	    store_block(cu, i, data + (i << BLOCK_SHIFT), n);
+	}
+	if ((b << BLOCK_SHIFT) < len) {
+	    *size = MIN(BLOCK_SIZE, len - (b << BLOCK_SHIFT));
+	    memmove(data, data + (b << BLOCK_SHIFT), *size);
+	}
+	else
+	    *size = 0;
+    }
+    g_mutex_unlock(&cache_lock);
+    return (data);
+}
+
+/* Cache_url_read() reads count bytes of a URL, beginning at the given
+   offset, into buf.  Returns the number of bytes read (less than count
+   at the end of the file), or -1 on error. */
+gssize cache_url_read(const char *url, gint64 offset, gsize count,
+		      void *buf, GError **err)
+{
+    struct cached_url *cu;
+    char *data;
+    gsize size, done = 0;
+    gint64 b, a, n;
+
+    if (!(cu = check_url(url, err)))
+	return (-1);
+    if ((n = cache_url_length(url)) >= 0)
+	count = MAX(0, MIN((gint64) count, n - offset));
+
+    while (done < count) {
+	b = (offset + done) >> BLOCK_SHIFT;
+	a = (offset + done) - (b << BLOCK_SHIFT);
+	if (!(data = get_block(cu, b, &size, err)))
+	    return (-1);
+	n = MIN((gint64) size - a, (gint64) (count - done));
+	if (n > 0)
+	    memcpy((char *) buf + done, data + a, n);
+	g_free(data);
+	if (n <= 0)
+	    break;
+	done += n;
+	if (size < BLOCK_SIZE)
+	    break;
+    }
+    return (done);
+}
+
+/* Cache_url_get() retrieves the whole contents of a URL (like url_get()
+   in url.c), from the cache if possible. */
+char * cache_url_get(const char *url, int *length, GError **err)
+{
+    GString *str;
+    char *data;
+    gsize size;
+    gint64 b;
+    struct cached_url *cu;
+    gint64 n;
+
+    if (length)
+	*length = 0;
+    if (!(cu = check_url(url, err)))
+	return (NULL);
+
+    /* If the length is known, don't ask for a block beyond the end. */
+    n = cache_url_length(url);
+    str = g_string_new(NULL);
+    for (b = 0; n < 0 || (b << BLOCK_SHIFT) < n; b++) {
+	if (!(data = get_block(cu, b, &size, err))) {
+	    g_string_free(str, TRUE);
+	    return (NULL);
+	}
+	g_string_append_len(str, data, size);
+	g_free(data);
+	if (size < BLOCK_SIZE)
+	    break;
+    }
+    if (length)
+	*length = str->len;
+    return g_string_free(str, FALSE);
+}
+
+/* Cache_url_length() returns the length of a URL, or -1 if it is not
+   known (or the URL doesn't exist.) */
+gint64 cache_url_length(const char *url)
+{
+    struct cached_url *cu;
+    gint64 n;
+
+    if (!(cu = check_url(url, NULL)))
+	return (-1);
+    g_mutex_lock(&cache_lock);
+    n = cu->info.length;
+    g_mutex_unlock(&cache_lock);
+    return (n);
+}
+
+/* Cache_url_version() returns a string that identifies the current
+   version of a URL (its ETag, or else its Last-Modified date), or NULL if
+   the server supplies neither (or the URL doesn't exist.) */
+char * cache_url_version(const char *url)
+{
+    struct cached_url *cu;
+    char *v = NULL;
+
+    if (!(cu = check_url(url, NULL)))
+	return (NULL);
+    g_mutex_lock(&cache_lock);
+    if (cu->info.etag)
+	v = g_strconcat("ETag: ", cu->info.etag, NULL);
+    else if (cu->info.last_modified)
+	v = g_strconcat("Last-Modified: ", cu->info.last_modified, NULL);
+    g_mutex_unlock(&cache_lock);
+    return (v);
+}
+
+/* Cache_url_has_range() returns TRUE if count bytes of a URL, beginning
+   at the given offset, can be read from the cache without contacting
+   the server. */
+gboolean cache_url_has_range(const char *url, gint64 offset, gsize count)
+{
+    struct cached_url *cu;
+    char *name;
+    gint64 b, end;
+    gboolean ok;
+
+    g_mutex_lock(&cache_lock);
+    cu = get_url(url);
+    ok = cu->checked;
+    end = offset + count;
+    if (cu->info.length >= 0)
+	end = MIN(end, cu->info.length);
+    for (b = offset >> BLOCK_SHIFT; ok && (b << BLOCK_SHIFT) < end; b++) {
+	name = g_strdup_printf("%s.%" G_GINT64_FORMAT, cu->hash, b);
+	ok = (g_hash_table_lookup(block_table, name) != NULL);
+	g_free(name);
+    }
+    g_mutex_unlock(&cache_lock);
+    return (ok);
+}
+
+/* Cache_find_url() returns the URL of the first of the remote
+   directories given to block_cache_init() that contains a file with the
+   given relative path, or NULL if there is none. */
+char * cache_find_url(const char *path)
+{
+    char *url;
+    int i;
+
+    for (i = 0; cache_bases && cache_bases[i]; i++) {
+	url = g_strconcat(cache_bases[i], "/", path, NULL);
+	if (check_url(url, NULL))
+	    return (url);
+	g_free(url);
+    }
+    return (NULL);
+}
@@ -0,0 +1,37 @@
+/*
+ * Metaann
+ *
+ * Copyright (C) 2014 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+
+void block_cache_init(const char *dir, gint64 limit, char **base_urls);
+
+void block_cache_set_auth(const char *username, const char *password);
+
+char * cache_url_get(const char *url, int *length, GError **err);
+
+gssize cache_url_read(const char *url, gint64 offset, gsize count,
+		      void *buf, GError **err);
+
+gint64 cache_url_length(const char *url);
+
+char * cache_url_version(const char *url);
+
+gboolean cache_url_has_range(const char *url, gint64 offset, gsize count);
+
+char * cache_find_url(const char *path);
@@ -0,0 +1,223 @@
+/*
+ * Metaann
+ *
+ * Copyright (C) 2014 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Min/max decimation
+
+   When a screen shows more samples than there are pixel columns,
+   find_display_list() needs the extrema of each signal within each
+   column.  The samples are read into a block with each signal stored
+   contiguously, and the extrema of each column are then found using
+   SSE2 or AVX2 instructions where available (selected at run time), or
+   a plain C loop otherwise.  Invalid samples (WFDB_INVALID_SAMPLE) are
+   ignored; a column with no valid samples has min > max. */
+
+#include <limits.h>
+#include "wave.h"
+#include "gtkwave.h"
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) \
+    && (defined(__i386__) || defined(__x86_64__))
+# define USE_X86_SIMD
+# include <immintrin.h>
+#endif
+
+typedef void (*minmax_func)(const WFDB_Sample *p, long n,
+			    WFDB_Sample *lo, WFDB_Sample *hi);
+
+static void minmax_scalar(const WFDB_Sample *p, long n,
+			  WFDB_Sample *lo, WFDB_Sample *hi)
+{
+    WFDB_Sample a = *lo, b = *hi;
+    long i;
+
+    for (i = 0; i < n; i++) {
+	if (p[i] == WFDB_INVALID_SAMPLE) continue;
+	if (p[i] < a) a = p[i];
+	if (p[i] > b) b = p[i];
+    }
+    *lo = a;
+    *hi = b;
+}
+
+#ifdef USE_X86_SIMD
+
+/* SSE2 has no 32-bit min/max instructions, so these are done by
+   comparing and masking. */
+__attribute__((target("sse2")))
+static void minmax_sse2(const WFDB_Sample *p, long n,
+			WFDB_Sample *lo, WFDB_Sample *hi)
+{
+    __m128i inv = _mm_set1_epi32(WFDB_INVALID_SAMPLE);
+    __m128i big = _mm_set1_epi32(INT_MAX);
+    __m128i small = _mm_set1_epi32(INT_MIN);
+    __m128i vlo = big, vhi = small, x, bad, xl, xh, m;
+    int tmp[4], k;
+    long i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+	x = _mm_loadu_si128((const __m128i *) (p + i));
+	bad = _mm_cmpeq_epi32(x, inv);
+	xl = _mm_or_si128(_mm_and_si128(bad, big), _mm_andnot_si128(bad, x));
+	xh = _mm_or_si128(_mm_and_si128(bad, small), _mm_andnot_si128(bad, x));
+	m = _mm_cmplt_epi32(xl, vlo);
+	vlo = _mm_or_si128(_mm_and_si128(m, xl), _mm_andnot_si128(m, vlo));
+	m = _mm_cmpgt_epi32(xh, vhi);
+	vhi = _mm_or_si128(_mm_and_si128(m, xh), _mm_andnot_si128(m, vhi));
+    }
+
+    _mm_storeu_si128((__m128i *) tmp, vlo);
+    for (k = 0; k < 4; k++)
+	if (tmp[k] < *lo) *lo = tmp[k];
+    _mm_storeu_si128((__m128i *) tmp, vhi);
+    for (k = 0; k < 4; k++)
+	if (tmp[k] > *hi) *hi = tmp[k];
+
+    minmax_scalar(p + i, n - i, lo, hi);
+}
+
+__attribute__((target("avx2")))
+static void minmax_avx2(const WFDB_Sample *p, long n,
+			WFDB_Sample *lo, WFDB_Sample *hi)
+{
+    __m256i inv = _mm256_set1_epi32(WFDB_INVALID_SAMPLE);
+    __m256i big = _mm256_set1_epi32(INT_MAX);
+    __m256i small = _mm256_set1_epi32(INT_MIN);
+    __m256i vlo = big, vhi = small, x, bad;
+    int tmp[8], k;
+    long i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+	x = _mm256_loadu_si256((const __m256i *) (p + i));
+	bad = _mm256_cmpeq_epi32(x, inv);
+	vlo = _mm256_min_epi32(vlo, _mm256_blendv_epi8(x, big, bad));
+	vhi = _mm256_max_epi32(vhi, _mm256_blendv_epi8(x, small, bad));
+    }
+
+    _mm256_storeu_si256((__m256i *) tmp, vlo);
+    for (k = 0; k < 8; k++)
+	if (tmp[k] < *lo) *lo = tmp[k];
+    _mm256_storeu_si256((__m256i *) tmp, vhi);
+    for (k = 0; k < 8; k++)
+	if (tmp[k] > *hi) *hi = tmp[k];
+
+    minmax_scalar(p + i, n - i, lo, hi);
+}
+
+#endif /* USE_X86_SIMD */
+
+static minmax_func get_minmax_func(void)
+{
+    static minmax_func func;
+
+    if (func)
+	return (func);
+
+    func = &minmax_scalar;
+#ifdef USE_X86_SIMD
+    if (sizeof(WFDB_Sample) == sizeof(int)) {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	    func = &minmax_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+	    func = &minmax_sse2;
+    }
+#endif
+    return (func);
+}
+
+/* Decim_columns() determines which samples belong to each column of a
+   screen of nsamp samples beginning at time t0.  Columns are aligned to
+   the record rather than to the screen: sample t belongs to pixel
+   (long)(t*scale) of the record, so that screens beginning at different
+   times divide the samples they have in common into columns in the same
+   way.  Column x of the screen contains samples jump[x] through
+   jump[x+1]-1 (counted from t0); samples beyond the last column that
+   fits in the given width are included in the last column.  Returns the
+   number of columns, and sets *pjump to an array (owned by this module)
+   of ncols+1 elements. */
+int decim_columns(long t0, long nsamp, double scale, int width, long **pjump)
+{
+    static long *jump;
+    static int jump_size;
+    long g0, i;
+    int x, ncols;
+
+    if (nsamp < 1) nsamp = 1;
+    if (width < 1) width = 1;
+    g0 = (long) (t0 * scale);
+    ncols = (int) ((long) ((t0 + nsamp - 1) * scale) - g0) + 1;
+    if (ncols > width) ncols = width;
+    if (ncols + 1 > jump_size) {
+	jump_size = ncols + 1;
+	jump = g_renew(long, jump, jump_size);
+    }
+
+    jump[0] = 0;
+    for (x = 1; x < ncols; x++) {
+	/* Find the first sample whose pixel is g0+x. */
+	i = (long) ((g0 + x) / scale) - t0;
+	if (i <= jump[x-1]) i = jump[x-1] + 1;
+	while ((long) ((t0 + i) * scale) < g0 + x)
+	    i++;
+	while (i - 1 > jump[x-1] && (long) ((t0 + i - 1) * scale) >= g0 + x)
+	    i--;
+	jump[x] = i;
+    }
+    jump[ncols] = nsamp;
+
+    *pjump = jump;
+    return (ncols);
+}
+
+/* Decim_block() merges the extrema of a block of samples into the column
+   extrema cmin and cmax (indexed by [signal * width + column]).  The
+   block contains n samples of each of ns signals, beginning with sample
+   i0 of the screen; sample i of signal c is planes[c*stride + i - i0]. */
+void decim_block(const WFDB_Sample *planes, long stride, int ns,
+		 long i0, long n, const long *jump, int ncols, int width,
+		 WFDB_Sample *cmin, WFDB_Sample *cmax)
+{
+    minmax_func minmax = get_minmax_func();
+    long a, b;
+    int c, x, lo, hi;
+
+    if (n <= 0 || ncols < 1)
+	return;
+
+    /* Find the column containing sample i0. */
+    lo = 0;
+    hi = ncols - 1;
+    while (lo < hi) {
+	x = (lo + hi + 1) / 2;
+	if (jump[x] <= i0)
+	    lo = x;
+	else
+	    hi = x - 1;
+    }
+
+    for (x = lo; x < ncols && jump[x] < i0 + n; x++) {
+	a = MAX(jump[x], i0);
+	b = MIN(jump[x+1], i0 + n);
+	if (a >= b)
+	    continue;
+	for (c = 0; c < ns; c++)
+	    (*minmax)(planes + c * stride + (a - i0), b - a,
+		      &cmin[c * width + x], &cmax[c * width + x]);
+    }
+}
@@ -25,6 +25,8 @@
 #include "gtkwave.h"
 
 static int grid_plotted;
+static GdkPixmap *grid_pixmap;	/* the grid, drawn once for each geometry */
+static int grid_width, grid_height;
 
 /* Call this function from the repaint procedure to restore the grid after
    the window has been cleared. */
@@ -36,7 +38,9 @@ void restore_grid()
 
 /* Show_grid() does what is necessary to display the grid in the requested
 style.  Note that the grid can be made to disappear and reappear by show_grid()
-without redrawing it, by manipulating the color map. */
+without redrawing it, by manipulating the color map.  The grid is drawn into
+an off-screen pixmap, which is copied into the wave view each time it is
+shown, and redrawn only when the grid style or the canvas size changes. */
 void show_grid()
 {
     int i, ii, x, xx, y, yy;
@@ -71,24 +75,34 @@ void show_grid()
     }
 
     /* The grid must be drawn if it has not been plotted already, if the grid
-       spacing or style has changed, or if we are not using a read/write color
-       map. */
+       spacing or style has changed, or if the canvas size has changed. */
     if (!grid_plotted || ghflag != oghf || gvflag != ogvf ||
-	(ghflag && dy != ody) || (gvflag && dx != odx) || !use_overlays) {
-	gdk_draw_rectangle(gtk_widget_get_window(wave_view), clear_grd, TRUE,
+	(ghflag && dy != ody) || (gvflag && dx != odx) ||
+	grid_width != canvas_width || grid_height != canvas_height) {
+	if (grid_width != canvas_width || grid_height != canvas_height) {
+	    if (grid_pixmap) g_object_unref(grid_pixmap);
+	    grid_pixmap = NULL;
+	    grid_width = canvas_width;
+	    grid_height = canvas_height;
+	}
+	if (!grid_pixmap && canvas_width > 0 && canvas_height > 0)
+	    grid_pixmap = gdk_pixmap_new(gtk_widget_get_window(wave_view),
+					 canvas_width, canvas_height, -1);
+	if (!grid_pixmap) return;
+	gdk_draw_rectangle(grid_pixmap, clear_grd, TRUE,
 		       0, 0, canvas_width,canvas_height);
 	
 	/* If horizontal grid lines are enabled, draw them. */
 	if (ghflag)
 	    for (i = y = 0; y < canvas_height + dy; i++, y = i*dy) {
 		if (0 < y && y < canvas_height)
-		    gdk_draw_line(gtk_widget_get_window(wave_view),
+		    gdk_draw_line(grid_pixmap,
 			      (ghflag > 1) ? draw_cgrd : draw_grd,
 			      0, y, canvas_width, y);
 		if (ghflag > 1)		/* Draw fine horizontal grid lines. */
 		    for (ii = 1; ii < 5; ii++) {
 			yy = y + ii*dyfine;
-			gdk_draw_line(gtk_widget_get_window(wave_view), draw_grd,
+			gdk_draw_line(grid_pixmap, draw_grd,
 				  0, yy, canvas_width, yy);
 		    }
 	    }
@@ -97,13 +111,13 @@ void show_grid()
 	if (gvflag)
 	    for (i = x = 0; x < canvas_width + dx; i++, x = i*dx) {
 		if (0 < x && x < canvas_width)
-		    gdk_draw_line(gtk_widget_get_window(wave_view),
+		    gdk_draw_line(grid_pixmap,
 			      (gvflag > 1) ? draw_cgrd : draw_grd,
 			      x, 0, x, canvas_height);
 		if (gvflag > 1)		/* Draw fine vertical grid lines. */
 		    for (ii = 1; ii < 5; ii++) {
 			xx = x + ii*dxfine;
-			gdk_draw_line(gtk_widget_get_window(wave_view), draw_grd,
+			gdk_draw_line(grid_pixmap, draw_grd,
 				  xx, 0, xx, canvas_height);
 		    }
 	    }
@@ -111,6 +125,9 @@ void show_grid()
         oghf = ghflag; ogvf = gvflag; odx = dx; ody = dy;
 	grid_plotted = 1;
     }
+    if (grid_pixmap)
+	gdk_draw_drawable(wave_drawable, clear_grd, grid_pixmap, 0, 0, 0, 0,
+			  canvas_width, canvas_height);
 
     /* If the grid was hidden, make it visible by changing the color map. */
     if (grid_hidden) {
@@ -59,6 +59,8 @@
 COMMON GtkWidget *wave_view;
 COMMON PangoLayout *wave_text_layout;
 COMMON int wave_view_font_offset;
+COMMON GdkDrawable *wave_drawable;	/* where the wave view is being drawn
+					   (see repaint() in wave_widget.c) */
 
 /* Graphics contexts.  For each displayed object (signal, annotation, cursor,
    and grid) there are drawing and erasing graphics contexts;  in addition,
@@ -77,24 +79,35 @@ COMMON GdkGC *draw_sig, *clear_sig,
 /* Display lists
 
 A display list contains all information needed to draw a screenful of signals.
-For each of the nsig signals, a display list contains a list of the
-(x, y) pixel coordinate pairs that specify the vertices of the polyline
-that represents the signal.  
-
-A cache of recently-used display lists (up to MAX_DISPLAY_LISTS of them) is
-maintained as a singly-linked list;  the first display list is pointed
-to by first_list.
+For each of the nsig signals, a display list contains the y pixel coordinates
+of the vertices of the polyline that represents the signal.  The x coordinates
+depend only on the screen geometry, so a single table of them is shared by all
+lists, and the vertices are assembled when the signals are drawn.
+
+A cache of recently-used display lists is maintained (see sig.c), indexed by
+the record, starting time, duration, canvas size and amplitude scales used to
+make each list.  The lists are also kept in a doubly-linked list in order of
+use;  the most recently used display list is pointed to by first_list.
 */
 
 struct display_list {
-    struct display_list *next;	/* link to next display list */
+    struct display_list *next;	/* link to next (less recently used) list */
+    struct display_list *prev;	/* link to previous display list */
+    char *record;	/* record name */
     long start;		/* time of first sample */
     int nsig;		/* number of signals */
     int npoints;	/* number of (input) points per signal */
     int ndpts;		/* number of (output) points per signal */
     int xmax;		/* largest x, expressed as window abscissa */
+    int width, height;	/* canvas size for which the list was made */
+    double *vscale;	/* amplitude scales for which the list was made */
+    size_t size;	/* memory used by the list, in bytes */
     int *sb;		/* signal baselines, expressed as window ordinates */
-    GdkPoint **vlist;	/* vertex list pointers for each signal */
+    int *dy;		/* y-offset applied to each signal */
+    gint16 **ylist;	/* ordinates for each signal, expressed as window
+			   ordinates relative to the signal's base (the
+			   abscissas are shared; see abscissas() in sig.c) */
+    WFDB_Sample *cmin, *cmax; /* column extrema, if found from the samples */
 };
 COMMON struct display_list *first_list;
 COMMON GdkSegment *level;
@@ -104,10 +117,60 @@ extern void wave_draw_string(GdkDrawable *drawable, GdkGC *gc,
                              int x, int y, const char *str, int length); /* in annot.c */
 extern struct display_list *find_display_list(	/* in signal.c */
 					      long time);
+extern void prefetch_display_list(long time);	/* in signal.c */
+extern void show_signal_layer(void);		/* in signal.c */
+extern void show_overlay_layer(void);		/* in signal.c */
+
+extern int pyramid_columns(long t0, long ns,	/* in pyramid.c */
+			   int width, double scale,
+			   WFDB_Sample **pmin, WFDB_Sample **pmax);
+extern int pyramid_usable(long ns, int width);	/* in pyramid.c */
+extern void clear_pyramid(void);		/* in pyramid.c */
+extern long get_samples(long t0, long n,	/* in sigcache.c */
+			WFDB_Sample **pdata, long *pstride);
+extern void clear_sample_cache(void);		/* in sigcache.c */
+extern long read_mapped_samples(long t0, long n,	/* in sigmap.c */
+				const int *slot, WFDB_Sample *data,
+				long stride);
+
+/* A byte range of a remote signal file (see remote_sample_ranges()) */
+struct remote_range {
+    char *url;
+    gint64 offset;
+    gsize count;
+};
+
+extern int remote_sample_ranges(long t0, long n,	/* in sigmap.c */
+				struct remote_range **pranges);
+extern void free_remote_ranges(struct remote_range *ranges, int n);
+extern int unpack_samples(int fmt, const guchar *p, /* in unpack.c */
+			  long k, long n, WFDB_Sample *out);
+extern long annidx_open(const char *rec,	/* in annidx.c */
+			const char *ann, double afreq);
+extern void annidx_close(void);			/* in annidx.c */
+extern void annidx_init(const char *dir);	/* in annidx.c */
+extern void annidx_set_freq(double afreq);	/* in annidx.c */
+extern long annidx_block_size(long k);		/* in annidx.c */
+extern long annidx_first_block(long t);		/* in annidx.c */
+extern long annidx_last_block(long t);		/* in annidx.c */
+extern long annidx_read_block(long k,		/* in annidx.c */
+			      int (*add)(struct WFDB_ann *));
+extern long annidx_notes(void);			/* in annidx.c */
+extern void annidx_get_note(long i,		/* in annidx.c */
+			    struct WFDB_ann *annot);
+extern int decim_columns(long t0, long nsamp,	/* in decim.c */
+			 double scale, int width, long **pjump);
+extern void decim_block(const WFDB_Sample *planes, /* in decim.c */
+			long stride, int ns, long i0, long n,
+			const long *jump, int ncols, int width,
+			WFDB_Sample *cmin, WFDB_Sample *cmax);
 
 GtkWidget *create_wave_view(void);
 void wave_view_force_reload(void);
 void wave_view_force_recalibrate(void);
+void wave_view_redraw(void);
+void wave_view_redraw_overlay(void);
+void wave_view_show_placeholder(const char *text);
 
 GtkWidget *create_wave_window(void);
 
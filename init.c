@@ -49,6 +49,7 @@ int ns;
 	(vmax = realloc(vmax, ns * sizeof(WFDB_Sample))) == NULL ||
 	(vmin = realloc(vmin, ns * sizeof(WFDB_Sample))) == NULL ||
 	(vvalid = realloc(vvalid, ns * sizeof(int))) == NULL ||
+	(sigslot = realloc(sigslot, ns * sizeof(int))) == NULL ||
 	(level_name_string =
 		realloc(level_name_string, ns * sizeof(char **))) == NULL ||
 	(level_value_string =
@@ -73,6 +74,7 @@ int ns;
 	/*level_name[i] = level_value[i] = level_units[i] = (Panel_item)NULL;*/
 	dc_coupled[i] = scope_v[i] = vref[i] = level_v[i] = v[i] = v0[i] =
 	    vmax[i] = vmin[i] = 0;
+	sigslot[i] = i;
 	vscale[i] = vmag[i] = 1.0;
 	if ((level_name_string[i] = calloc(1, 12)) == NULL ||
 	    (level_value_string[i] = calloc(1, 12)) == NULL ||
@@ -83,6 +85,83 @@ int ns;
     maxnsig = ns;
 }
 
+/* Select_signals() chooses which of the ns signals described in df are to be
+   read, by setting their entries in sigslot to 0 (and the others to -1).  The
+   signals may be listed, by number or by name and separated by commas or
+   spaces, in the Wave.Signals resource.  Otherwise, if only the signals in
+   the signal list are shown (sig_mode 1) and the list is kept from the
+   previous record (keep_list), those are read; otherwise, all signals are
+   read.  Since isigopen() opens the first n signals of a record, the signals
+   following the last one selected need never be opened (and their files never
+   fetched); the others that are opened but not selected are skipped when the
+   samples are decoded and cached (see sig.c and sigcache.c).  Returns the
+   number of signals to be opened. */
+static int select_signals(ns, keep_list)
+int ns, keep_list;
+{
+    const char *spec;
+    char **names, *end;
+    int c, i, n;
+    long k;
+
+    for (c = 0; c < ns; c++)
+	sigslot[c] = -1;
+
+    spec = defaults_get_string("wave.signals", "Wave.Signals", "");
+    names = g_strsplit_set(spec ? spec : "", ", \t", -1);
+    for (i = n = 0; names[i]; i++) {
+	if (*names[i] == '\0')
+	    continue;
+	n++;
+	k = strtol(names[i], &end, 10);
+	if (*end == '\0' && 0 <= k && k < ns)
+	    sigslot[k] = 0;
+	else
+	    for (c = 0; c < ns; c++)
+		if (df[c].desc && strcmp(df[c].desc, names[i]) == 0)
+		    sigslot[c] = 0;
+    }
+    g_strfreev(names);
+
+    if (n == 0 && keep_list && sig_mode == 1)
+	for (i = 0; i < siglistlen; i++)
+	    if (0 <= siglist[i] && siglist[i] < ns)
+		sigslot[siglist[i]] = 0;
+
+    for (c = ns; c > 0 && sigslot[c-1] < 0; c--)
+	;
+    if (c == 0) {
+	/* Nothing (or nothing that exists) was selected. */
+	if (n > 0)
+	    g_warning("No signals of record %s match Wave.Signals", record);
+	for (c = 0; c < ns; c++)
+	    sigslot[c] = 0;
+	c = ns;
+    }
+    return (c);
+}
+
+/* Number_signals() assigns each of the nsig open signals that is to be read
+   its position among those read, and sets record_key accordingly. */
+static void number_signals()
+{
+    GString *key;
+    int c;
+
+    key = g_string_new(NULL);
+    g_string_printf(key, "%s:%d", record, nsig);
+    for (c = nsigread = 0; c < nsig; c++)
+	if (sigslot[c] >= 0)
+	    sigslot[c] = nsigread++;
+    if (nsigread < nsig)
+	for (c = 0; c < nsig; c++)
+	    if (sigslot[c] >= 0)
+		g_string_append_printf(key, "%c%d",
+				       sigslot[c] == 0 ? ':' : ',', c);
+    g_free(record_key);
+    record_key = g_string_free(key, FALSE);
+}
+
 /* Open up a new ECG record. */
 int record_init(s)
 char *s;
@@ -113,11 +192,20 @@ char *s;
     /* Reset the frame title. */
     set_frame_title();
 
-    /* Open as many signals as possible. */
+    /* Find out how many signals there are, and read their descriptions
+       without opening them, so that only the signals to be read need be
+       opened (see select_signals(), below).  Then open as many of those as
+       possible. */
     nsig = isigopen(record, NULL, 0);
     if (nsig > maxnsig)
 	alloc_sigdata(nsig);
+    if (nsig > 0 && isigopen(record, df, -nsig) == nsig)
+	nsig = select_signals(nsig, !rebuild_list);
+    else
+	for (i = 0; i < nsig; i++)
+	    sigslot[i] = i;
     nsig = isigopen(record, df, nsig);
+    number_signals();
     /* Get time resolution for annotations in sample intervals.  Except in
        WFDB_HIGHRES mode (selected using the -H option), the resolution is
        1 sample interval.  In WFDB_HIGHRES mode, when editing a multi-frequency
@@ -206,9 +294,9 @@ char *s;
 	    level = realloc(level, nsig * sizeof(GdkSegment));
 	    maxsiglistlen = nsig;
 	}
-	for (i = 0; i < nsig; i++)
-	    siglist[i] = i;
-	siglistlen = nsig;
+	for (i = siglistlen = 0; i < nsig; i++)
+	    if (sigslot[i] >= 0)
+		siglist[siglistlen++] = i;
 	/*reset_siglist();*/
     }
 
@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <wfdb/wfdb.h>
 #include <wfdb/wfdblib.h>
+#include <wfdb/ecgmap.h>
 #include <gtk/gtk.h>
 #include <gdk/gdkkeysyms.h>
 #include <glib/gstdio.h>
@@ -32,6 +33,17 @@
 #include "gtkwave.h"
 #include "conf.h"
 #include "url.h"
+#include "blockcache.h"
+#include "outbox.h"
+
+/* Time to wait for unsent results when exiting (microseconds) */
+#define OUTBOX_EXIT_WAIT (5 * G_USEC_PER_SEC)
+
+/* Subdirectory of the cache directory holding the block cache */
+#define BLOCK_CACHE_DIR "blocks"
+
+/* Subdirectory of the cache directory holding saved annotation indexes */
+#define INDEX_CACHE_DIR "annidx"
 
 /* Input database parameters */
 
@@ -158,10 +170,13 @@ enum {
 #define S_COMPLETE "\342\227\217"
 #define S_PARTIAL  "\342\227\213"
 #define S_UNSEEN   " "
+#define S_QUEUED   "\342\227\220"	/* complete, but not yet sent */
+#define S_REJECTED "\342\234\227"	/* refused by the server */
 
 #define S_ADJ_UNNEEDED " "
 #define S_ADJ_NEEDED   "\342\226\241"
 #define S_ADJ_DONE     "\342\226\240"
+#define S_ADJ_QUEUED   "\342\227\251"
 
 /**** Utilities ****/
 
@@ -409,17 +424,124 @@ static void read_results_list(struct results_list *rl,
   wfdb_fclose(listfile);
 }
 
+/* Results are saved in the outbox (see outbox.c), which sends them to
+   the server in the background.  Until the server has acknowledged
+   them, they are counted here, by position and by record, so that their
+   status can be shown.  Results that the server refuses are counted in
+   the same way, until they are saved again. */
+
+struct result_counts {
+  GHashTable *results;
+  GHashTable *records;
+};
+
+static struct result_counts unsent, rejected;
+
+static void count_result(struct result_counts *c, const char *record,
+			 WFDB_Time t, int delta)
+{
+  char *key;
+  int n;
+
+  if (!c->results) {
+    c->results = g_hash_table_new_full(g_str_hash, g_str_equal,
+				       g_free, NULL);
+    c->records = g_hash_table_new_full(g_str_hash, g_str_equal,
+				       g_free, NULL);
+  }
+
+  key = g_strdup_printf("%s\t%.0f", record, (double) t);
+  n = GPOINTER_TO_INT(g_hash_table_lookup(c->results, key)) + delta;
+  if (n > 0)
+    g_hash_table_insert(c->results, key, GINT_TO_POINTER(n));
+  else {
+    g_hash_table_remove(c->results, key);
+    g_free(key);
+  }
+
+  n = GPOINTER_TO_INT(g_hash_table_lookup(c->records, record)) + delta;
+  if (n > 0)
+    g_hash_table_insert(c->records, g_strdup(record),
+			GINT_TO_POINTER(n));
+  else
+    g_hash_table_remove(c->records, record);
+}
+
+static int result_counted(const struct result_counts *c,
+			  const char *record, WFDB_Time t)
+{
+  char *key;
+  int n;
+
+  if (!c->results)
+    return 0;
+  key = g_strdup_printf("%s\t%.0f", record, (double) t);
+  n = GPOINTER_TO_INT(g_hash_table_lookup(c->results, key));
+  g_free(key);
+  return (n > 0);
+}
+
+static int record_counted(const struct result_counts *c, const char *record)
+{
+  return (c->records
+	  && g_hash_table_lookup(c->records, record) != NULL);
+}
+
+/* Decode the form data of a result, as made by save_result().  Returns
+   NULL if it isn't valid. */
+static struct result_info * parse_result_postdata(const char *postdata)
+{
+  struct result_info *r;
+  char **fields, *name, *value;
+  int i;
+
+  r = g_slice_new0(struct result_info);
+  r->time = -1;
+  fields = g_strsplit(postdata, "&", -1);
+  for (i = 0; fields[i]; i++) {
+    if (!(value = strchr(fields[i], '=')))
+      continue;
+    *value++ = 0;
+    name = fields[i];
+    value = g_uri_unescape_string(value, NULL);
+    if (!value)
+      continue;
+    if (!strcmp(name, "record"))
+      r->record = value;
+    else if (!strcmp(name, "time")) {
+      r->time = strtol(value, NULL, 10);
+      g_free(value);
+    }
+    else if (!strcmp(name, "status"))
+      r->status = value;
+    else if (!strcmp(name, "substatus"))
+      r->substatus = value;
+    else if (!strcmp(name, "comment"))
+      r->comment = value;
+    else
+      g_free(value);
+  }
+  g_strfreev(fields);
+
+  if (!r->record || r->time < 0) {
+    g_free(r->record);
+    g_free(r->status);
+    g_free(r->substatus);
+    g_free(r->comment);
+    g_slice_free(struct result_info, r);
+    return NULL;
+  }
+  return r;
+}
+
 static void save_result(struct results_list *rl,
 			const struct result_info *r)
 {
   GString *postdata;
-  char *response;
-  GError *err = NULL;
 
   g_return_if_fail(r != NULL);
   g_return_if_fail(r->record != NULL);
-  g_return_if_fail(rl != NULL);
-  g_return_if_fail(rl->post_url != NULL);
+  g_return_if_fail(rl == &my_results);
 
   postdata = g_string_new(NULL);
   g_string_append(postdata, "record=");
@@ -435,17 +557,8 @@ static void save_result(struct results_list *rl,
 
   g_printerr("POST: %s\n", postdata->str);
 
-  response = url_post(rl->post_url, postdata->str,
-		      gtk_entry_get_text(GTK_ENTRY(user_name_entry)),
-		      gtk_entry_get_text(GTK_ENTRY(password_entry)),
-		      NULL, &err);
+  outbox_submit(postdata->str);
   g_string_free(postdata, TRUE);
-  g_free(response);
-  if (err) {
-    show_message(GTK_MESSAGE_WARNING, "Unable to save annotations",
-		 "%s", err->message);
-    g_clear_error(&err);
-  }
 }
 
 static void flush_results()
@@ -688,6 +801,101 @@ static void read_reviewer_results(const char *users_url,
   g_print("\n");
 }
 
+/* Read the list of events to be adjudicated, as computed by the
+   server, together with the reviewers' results for those events
+   (rather than every reviewer's complete list of results.)  Each line
+   of the list is one of:
+
+     reviewer USER
+     conflict RECORD TIME
+     result   USER RECORD TIME STATUS SUBSTATUS COMMENT
+     events   N_SINGLE N_MULTIPLE
+
+   with fields separated by tabs.  Returns 0 if the list can't be read
+   (for example, if the server doesn't provide it), in which case the
+   complete lists must be read instead (see read_reviewer_results.) */
+static int read_adjudication_queue(const char *queue_url)
+{
+  WFDB_FILE *queuefile;
+  char buf[10000], **strs, *p;
+  GHashTable *lists;
+  struct results_list *rl;
+  int i, rn, total1, total2;
+
+  queuefile = wfdb_fopen((char*) queue_url, "r");
+  if (!queuefile) {
+    g_printerr("warning: cannot read adjudication queue '%s'\n", queue_url);
+    return 0;
+  }
+
+  lists = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  total1 = total2 = 0;
+
+  g_print("----- Annotation lists to compare: -----\n");
+
+  while (wfdb_fgets(buf, sizeof(buf), queuefile)) {
+    i = strlen(buf);
+    while (i > 0 && (buf[i - 1] == '\n' || buf[i - 1] == '\r'))
+      buf[--i] = 0;
+
+    strs = g_strsplit(buf, "\t", -1);
+    if (!strs || !strs[0] || !strs[1]) {
+      /* ignore blank lines */
+    }
+    else if (!strcmp(strs[0], "reviewer")) {
+      g_print("  %s\n", strs[1]);
+
+      rl = g_slice_new0(struct results_list);
+      g_hash_table_insert(lists, g_strdup(strs[1]), rl);
+      if ((p = strchr(strs[1], '@')))
+	*p = 0;
+      rl->username = g_strdup(strs[1]);
+
+      n_reviewers++;
+      reviewer_results = g_renew(struct results_list *,
+                                 reviewer_results, n_reviewers);
+      reviewer_results[n_reviewers - 1] = rl;
+    }
+    else if (!strcmp(strs[0], "conflict") && strs[2]) {
+      rn = find_rec(strs[1]);
+      if (rn >= 0) {
+	records[rn].n_conflicts++;
+        n_alarms_to_compare++;
+        alarms_to_compare = g_renew(struct alarm_pos, alarms_to_compare,
+                                    n_alarms_to_compare);
+
+        alarms_to_compare[n_alarms_to_compare - 1].record_index = rn;
+        alarms_to_compare[n_alarms_to_compare - 1].time
+          = strtol(strs[2], NULL, 10);
+      }
+    }
+    else if (!strcmp(strs[0], "result")
+             && strs[2] && strs[3] && strs[4] && strs[5] && strs[6]
+             && (rl = g_hash_table_lookup(lists, strs[1]))) {
+      put_result(rl, strs[2], strtol(strs[3], NULL, 10),
+                 strs[4], strs[5], strs[6]);
+    }
+    else if (!strcmp(strs[0], "events") && strs[2]) {
+      total1 = atoi(strs[1]);
+      total2 = atoi(strs[2]);
+    }
+    g_strfreev(strs);
+  }
+
+  wfdb_fclose(queuefile);
+  g_hash_table_destroy(lists);
+  g_print("\n");
+
+  qsort(alarms_to_compare, n_alarms_to_compare,
+        sizeof(alarms_to_compare[0]), &compare_alarm_pos);
+
+  g_print("Alarms annotated by only one reviewer:     %6d\n", total1);
+  g_print("Alarms annotated by two or more reviewers: %6d\n", total2);
+  g_print("Alarms with conflicting annotations:       %6d\n", n_alarms_to_compare);
+  g_print("\n");
+  return 1;
+}
+
 /**** Reading records/alarms ****/
 
 static void delete_recursive(const char *dname)
@@ -708,6 +916,76 @@ static void delete_recursive(const char *dname)
   g_remove(dname);
 }
 
+/* Remove the working files left in the cache directory, but keep the
+   block cache (see blockcache.c) and the saved annotation indexes (see
+   annidx.c), which persist between sessions. */
+static void clear_cache_dir(const char *dname)
+{
+  GDir *dir;
+  const char *name;
+  char *fullname;
+
+  if ((dir = g_dir_open(dname, 0, NULL))) {
+    while ((name = g_dir_read_name(dir))) {
+      if (name[0] == '.' || !strcmp(name, BLOCK_CACHE_DIR)
+	  || !strcmp(name, INDEX_CACHE_DIR))
+	continue;
+      fullname = g_build_filename(dname, name, NULL);
+      delete_recursive(fullname);
+      g_free(fullname);
+    }
+    g_dir_close(dir);
+  }
+}
+
+static char ** remote_database_dirs()
+{
+  GPtrArray *dirs;
+  char **comps;
+  int i;
+
+  dirs = g_ptr_array_new();
+  comps = g_strsplit_set(database_path, " \t\n;", -1);
+  for (i = 0; comps[i]; i++) {
+    if (g_str_has_prefix(comps[i], "http://")
+	|| g_str_has_prefix(comps[i], "https://")) {
+      while (g_str_has_suffix(comps[i], "/"))
+	comps[i][strlen(comps[i]) - 1] = 0;
+      g_ptr_array_add(dirs, g_strdup(comps[i]));
+    }
+  }
+  g_strfreev(comps);
+  g_ptr_array_add(dirs, NULL);
+  return (char **) g_ptr_array_free(dirs, FALSE);
+}
+
+/* Copy a file from the first remote directory that has it into the
+   working directory, going through the block cache. */
+static int fetch_remote_file(char **urls, const char *file)
+{
+  char *url, *content, *dname;
+  int i, len;
+
+  if (g_file_test(file, G_FILE_TEST_EXISTS))
+    return 1;
+
+  for (i = 0; urls[i]; i++) {
+    url = g_strconcat(urls[i], "/", file, NULL);
+    content = cache_url_get(url, &len, NULL);
+    g_free(url);
+    if (content) {
+      dname = g_path_get_dirname(file);
+      g_mkdir_with_parents(dname, 0700);
+      g_free(dname);
+      g_file_set_contents(file, content, len, NULL);
+      g_free(content);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
 static void read_records_list()
 {
   WFDB_FILE *listfile;
@@ -776,10 +1054,14 @@ static void update_rec_status(int index)
     return;
 
   n = n_results_for_record(&my_results, records[index].name);
-  if (!compare_mode) {
+  if (record_counted(&rejected, records[index].name))
+    gtk_list_store_set(record_store, &iter,
+		       REC_COL_STATUS, S_REJECTED, -1);
+  else if (!compare_mode) {
     if (n == records[index].n_alarms)
-      gtk_list_store_set(record_store, &iter,
-			 REC_COL_STATUS, S_COMPLETE, -1);
+      gtk_list_store_set(record_store, &iter, REC_COL_STATUS,
+			 (record_counted(&unsent, records[index].name)
+			  ? S_QUEUED : S_COMPLETE), -1);
     else if (n > 0)
       gtk_list_store_set(record_store, &iter,
 			 REC_COL_STATUS, S_PARTIAL, -1);
@@ -789,8 +1071,9 @@ static void update_rec_status(int index)
   }
   else {
     if (n > 0 && n == records[index].n_conflicts)
-      gtk_list_store_set(record_store, &iter,
-			 REC_COL_STATUS, S_ADJ_DONE, -1);
+      gtk_list_store_set(record_store, &iter, REC_COL_STATUS,
+			 (record_counted(&unsent, records[index].name)
+			  ? S_ADJ_QUEUED : S_ADJ_DONE), -1);
     else if (records[index].n_conflicts > 0)
       gtk_list_store_set(record_store, &iter,
 			 REC_COL_STATUS, S_ADJ_NEEDED, -1);
@@ -825,9 +1108,7 @@ static int try_open_anns(char *recname, const char *annname)
       g_printerr("Downloading %s to cache...", fname);
       fflush(stderr);
 
-      data = url_get(fname, gtk_entry_get_text(GTK_ENTRY(user_name_entry)),
-		     gtk_entry_get_text(GTK_ENTRY(password_entry)),
-		     &len, NULL);
+      data = cache_url_get(fname, &len, NULL);
       if (data && (tmpf = wfdb_open(ai.name, recname, WFDB_WRITE))) {
 	wfdb_fwrite(data, 1, len, tmpf);
 	wfdb_fclose(tmpf);
@@ -970,9 +1251,22 @@ static int is_target_annotation(const WFDB_Annotation *ann)
   return 1;
 }
 
+/* Return true if every annotation accepted by is_target_annotation() is
+   either not a beat label or has an aux string, so that the alarms can be
+   found among the annotations listed when the file is read lazily. */
+static int targets_are_notes(void)
+{
+  if (target_aux && target_aux[0])
+    return 1;
+  return (target_anntyp != TARGET_ANY
+	  && (target_anntyp < 0 || target_anntyp > ACMAX
+	      || !isqrs(target_anntyp)));
+}
+
 static void select_record(int index)
 {
   WFDB_Annotation ann;
+  long j, n;
   int i;
 
   g_return_if_fail(index >= 0);
@@ -987,6 +1281,17 @@ static void select_record(int index)
   wfdbquit();
   setwfdb(database_path);
 
+  if (cache_enabled) {
+    char **urls = remote_database_dirs();
+    char *hname = g_strconcat(cur_record, ".hea", NULL);
+
+    block_cache_set_auth(gtk_entry_get_text(GTK_ENTRY(user_name_entry)),
+			 gtk_entry_get_text(GTK_ENTRY(password_entry)));
+    fetch_remote_file(urls, hname);
+    g_free(hname);
+    g_strfreev(urls);
+  }
+
   i = isigopen(cur_record, 0, 0);
   if (i < 0) {
     show_message(GTK_MESSAGE_ERROR, "Cannot read record",
@@ -1010,14 +1315,19 @@ static void select_record(int index)
   for (i = 0; i < cur_record_n_alarms; i++)
     g_free(cur_record_alarms[i].message);
   g_free(cur_record_alarms);
+  cur_alarm = NULL;
   cur_record_alarms = NULL;
   cur_record_n_alarms = 0;
 
   g_printerr("reading alarms for %s...\n", cur_record);
 
-  setiafreq(0, cur_record_afreq);
+  /* The annotations are kept in memory, and will be displayed by the wave
+     view without reading the file again (see annot_init.) */
+  n = load_annotations(cur_record, database_annotator, cur_record_afreq,
+		       targets_are_notes());
 
-  while (0 <= getann(0, &ann)) {
+  for (j = 0; j < n; j++) {
+    list_annotation(j, &ann);
     if (is_target_annotation(&ann)) {
       cur_record_n_alarms++;
       cur_record_alarms = g_renew(struct alarm_info, cur_record_alarms,
@@ -1038,13 +1348,15 @@ static void select_record(int index)
     g_object_unref(ann_store);
   ann_store = NULL;
 
+  /* This must come before select_alarm(), so that the record is loaded into
+     the wave view (using the annotations read above) only once. */
+  wave_view_force_reload();
+
   if (cur_record_n_alarms == 0)
     g_printerr("warning: no alarms found in record %s\n",
                cur_record);
   else
     select_alarm(0);
-
-  wave_view_force_reload();
 }
 
 static void update_ann_status(int index)
@@ -1074,17 +1386,23 @@ static void update_ann_status(int index)
     else if (responses[statcode].comment_required
 	     && (!r->comment || !r->comment[0]))
       status = S_PARTIAL;
+    else if (result_counted(&unsent, cur_record, t))
+      status = S_QUEUED;
     else
       status = S_COMPLETE;
   }
   else {
-    if (r && r->status)
+    if (r && r->status && result_counted(&unsent, cur_record, t))
+      status = S_ADJ_QUEUED;
+    else if (r && r->status)
       status = S_ADJ_DONE;
     else if (alarm_has_conflicts(cur_record, t))
       status = S_ADJ_NEEDED;
     else
       status = S_ADJ_UNNEEDED;
   }
+  if (result_counted(&rejected, cur_record, t))
+    status = S_REJECTED;
 
   gtk_list_store_set(ann_store, &iter, ANN_COL_STATUS, status, -1);
 }
@@ -1117,35 +1435,389 @@ static void build_ann_store()
 			  GTK_TREE_MODEL(ann_store));
 }
 
+/**** Result outbox ****/
+
+/* Results refused by the server are reported in a single notice, which
+   isn't modal, since a whole journal may be refused at once (for
+   example, if the project has been closed.)  The notice counts the
+   results refused since it was last dismissed. */
+
+static GtkWidget *rejected_dialog;
+static int n_rejected;
+
+static void show_rejected(const char *record)
+{
+  GtkWindow *parent;
+
+  if (!rejected_dialog) {
+    if (window && gtk_widget_get_visible(window))
+      parent = GTK_WINDOW(window);
+    else
+      parent = GTK_WINDOW(user_name_dialog);
+    rejected_dialog = gtk_message_dialog_new
+      (parent, GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_WARNING,
+       GTK_BUTTONS_OK, "Unable to save annotations");
+    g_signal_connect_swapped(rejected_dialog, "response",
+			     G_CALLBACK(gtk_widget_destroy), rejected_dialog);
+    g_signal_connect(rejected_dialog, "destroy",
+		     G_CALLBACK(gtk_widget_destroyed), &rejected_dialog);
+    n_rejected = 0;
+  }
+
+  n_rejected++;
+  if (n_rejected == 1)
+    gtk_message_dialog_format_secondary_text
+      (GTK_MESSAGE_DIALOG(rejected_dialog),
+       "The server did not accept the result for record %s.  It is"
+       " marked with \342\234\227 until it is saved again.", record);
+  else
+    gtk_message_dialog_format_secondary_text
+      (GTK_MESSAGE_DIALOG(rejected_dialog),
+       "The server did not accept %d results (the last for record %s)."
+       "  They are marked with \342\234\227 until they are saved again.",
+       n_rejected, record);
+  gtk_widget_show(rejected_dialog);
+}
+
+/* Called when a result has been queued in the outbox, or has been sent
+   (or rejected) by the server.  A result found in the journal when the
+   program starts replaces the one read from the server, since it is
+   newer.  A rejected result is kept, but marked as rejected until it is
+   saved again. */
+static void result_queue_changed(const char *postdata, int state)
+{
+  struct result_info *r;
+  int i;
+
+  if (!(r = parse_result_postdata(postdata)))
+    return;
+
+  if (state == OUTBOX_QUEUED) {
+    put_result(&my_results, r->record, r->time,
+	       r->status, r->substatus, r->comment);
+    count_result(&unsent, r->record, r->time, 1);
+    if (result_counted(&rejected, r->record, r->time))
+      count_result(&rejected, r->record, r->time, -1);
+  }
+  else
+    count_result(&unsent, r->record, r->time, -1);
+
+  if (state == OUTBOX_REJECTED) {
+    if (!result_counted(&rejected, r->record, r->time))
+      count_result(&rejected, r->record, r->time, 1);
+    show_rejected(r->record);
+  }
+
+  if (ann_store && !g_strcmp0(r->record, cur_record))
+    for (i = 0; i < cur_record_n_alarms; i++)
+      if (cur_record_alarms[i].time == r->time)
+	update_ann_status(i);
+  if (record_store && (i = find_rec(r->record)) >= 0)
+    update_rec_status(i);
+
+  g_free(r->record);
+  g_free(r->status);
+  g_free(r->substatus);
+  g_free(r->comment);
+  g_slice_free(struct result_info, r);
+}
+
+/**** Loading records in the background ****/
+
+/* Selecting a record means downloading its header and annotation files,
+   reading its alarms, opening its signals, and reading the samples
+   around the alarm to be shown; over a slow connection, this can take
+   several seconds.  Once the main loop is running, a record is therefore
+   loaded in stages.  A worker thread downloads the files (through the
+   block cache) and checks that the signal files can be found; the main
+   thread then reads the alarms and opens the record, since the WFDB
+   library isn't thread-safe; another worker fetches the signal data
+   around the alarm (see remote_sample_ranges() in sigmap.c); and
+   finally the display list is built and drawn in the main thread.
+
+   A placeholder is shown until the signals are drawn.  Starting another
+   load (as when the reviewer skips ahead) cancels the one in progress:
+   a worker stops between downloads once its generation is no longer
+   current, and its results are discarded. */
+
+enum { LOAD_FIRST, LOAD_LAST, LOAD_TIME };
+
+#define LOAD_CHUNK 65536
+
+struct load_job {
+  int generation;
+  char **urls;			/* remote directories from the WFDB path */
+  char **files;			/* files to download (header first) */
+  struct remote_range *ranges;	/* signal data to fetch */
+  int n_ranges;
+  GSourceFunc done;		/* called in the main thread when finished */
+};
+
+static gint load_generation;	/* accessed atomically */
+static int loading_index = -1;	/* record being loaded, or -1 */
+static int loading_target;	/* alarm to select when it is loaded */
+static WFDB_Time loading_time;
+static int async_loading;	/* 0 until the main loop is running */
+static int signals_loaded;	/* signal data has just been fetched */
+
+static void show_alarm(void);
+
+static void free_load_job(struct load_job *job)
+{
+  g_strfreev(job->urls);
+  g_strfreev(job->files);
+  free_remote_ranges(job->ranges, job->n_ranges);
+  g_free(job);
+}
+
+static int load_current(const struct load_job *job)
+{
+  return (g_atomic_int_get(&load_generation) == job->generation);
+}
+
+/* Find the signal files named in a header file, relative to the working
+   directory.  The segments of a multi-segment record are not examined. */
+static char ** header_signal_files(const char *hname)
+{
+  GPtrArray *names;
+  char *text, *rdir, **lines, **fields, *prev = NULL;
+  int i, first = 1;
+
+  names = g_ptr_array_new();
+  if (g_file_get_contents(hname, &text, NULL, NULL)) {
+    rdir = g_path_get_dirname(hname);
+    lines = g_strsplit(text, "\n", -1);
+    g_free(text);
+    for (i = 0; lines[i]; i++) {
+      g_strstrip(lines[i]);
+      if (lines[i][0] == '#' || lines[i][0] == 0)
+	continue;
+      fields = g_strsplit_set(lines[i], " \t", 2);
+      if (first) {
+	first = 0;
+	if (strchr(fields[0], '/')) {
+	  g_strfreev(fields);
+	  break;
+	}
+      }
+      else if (strcmp(fields[0], "-") && g_strcmp0(fields[0], prev)) {
+	g_free(prev);
+	prev = g_strdup(fields[0]);
+	if (!strcmp(rdir, "."))
+	  g_ptr_array_add(names, g_strdup(fields[0]));
+	else
+	  g_ptr_array_add(names, g_strconcat(rdir, "/", fields[0], NULL));
+      }
+      g_strfreev(fields);
+    }
+    g_strfreev(lines);
+    g_free(rdir);
+    g_free(prev);
+  }
+  g_ptr_array_add(names, NULL);
+  return (char **) g_ptr_array_free(names, FALSE);
+}
+
+static gpointer load_thread(gpointer data)
+{
+  struct load_job *job = data;
+  char **sigfiles, *url, *buf;
+  gsize done, n;
+  int i, j;
+
+  for (i = 0; job->files && job->files[i] && load_current(job); i++) {
+    if (!fetch_remote_file(job->urls, job->files[i]) || i > 0)
+      continue;
+
+    /* Look up the signal files as well, so that opening the record
+       won't need to wait for the server. */
+    sigfiles = header_signal_files(job->files[0]);
+    for (j = 0; sigfiles[j] && load_current(job); j++) {
+      if (!g_file_test(sigfiles[j], G_FILE_TEST_EXISTS)
+	  && (url = cache_find_url(sigfiles[j])))
+	g_free(url);
+    }
+    g_strfreev(sigfiles);
+  }
+
+  buf = g_malloc(LOAD_CHUNK);
+  for (i = 0; i < job->n_ranges; i++) {
+    for (done = 0; done < job->ranges[i].count && load_current(job);
+	 done += n) {
+      n = MIN(LOAD_CHUNK, job->ranges[i].count - done);
+      if (cache_url_read(job->ranges[i].url, job->ranges[i].offset + done,
+			 n, buf, NULL) <= 0)
+	break;
+    }
+  }
+  g_free(buf);
+
+  g_idle_add(job->done, job);
+  return NULL;
+}
+
+/* Start a job in a new thread, cancelling any other job. */
+static void start_load_job(struct load_job *job)
+{
+  GThread *thread;
+
+  job->generation = g_atomic_int_add(&load_generation, 1) + 1;
+  thread = g_thread_try_new("load", &load_thread, job, NULL);
+  if (thread)
+    g_thread_unref(thread);
+  else
+    load_thread(job);
+}
+
+static void show_loading(const char *text)
+{
+  int i;
+
+  for (i = 0; i < n_responses; i++)
+    gtk_widget_set_sensitive(alarm_button[i], (text == NULL));
+  gtk_widget_set_sensitive(comment_entry, (text == NULL));
+  gtk_widget_set_sensitive(ann_combo, (text == NULL));
+  if (text)
+    label_printf(message_label, "<big><i>%s</i></big>", text);
+  wave_view_show_placeholder(text);
+}
+
+static void goto_record(int index, int target, WFDB_Time t);
+
+/* Select a record, and then the alarm given by target: the first or
+   last alarm, or the alarm at time t.  If the record has no alarms,
+   move on to the next or previous record instead, returning 0. */
+static int enter_record(int index, int target, WFDB_Time t)
+{
+  select_record(index);
+
+  if (cur_record_n_alarms < 1) {
+    if (target == LOAD_FIRST && index + 1 < n_records) {
+      goto_record(index + 1, target, 0);
+      return 0;
+    }
+    if (target == LOAD_LAST && index > 0) {
+      goto_record(index - 1, target, 0);
+      return 0;
+    }
+  }
+  else if (target == LOAD_LAST)
+    select_alarm(cur_record_n_alarms - 1);
+  else if (target == LOAD_TIME)
+    select_alarm_at_time(t);
+  return 1;
+}
+
+static gboolean record_files_loaded(gpointer data)
+{
+  struct load_job *job = data;
+  int index = loading_index;
+
+  if (load_current(job) && index >= 0) {
+    loading_index = -1;
+    show_loading(NULL);
+    if (enter_record(index, loading_target, loading_time))
+      show_alarm();
+  }
+  free_load_job(job);
+  return FALSE;
+}
+
+/* Switch to another record (see enter_record()).  Before the main loop
+   starts, or if there is no cache, this is done immediately, and the
+   caller must show the alarm; otherwise the record is loaded in the
+   background, and the alarm is shown when it is ready. */
+static void goto_record(int index, int target, WFDB_Time t)
+{
+  struct load_job *job;
+  char *msg;
+
+  g_return_if_fail(index >= 0);
+  g_return_if_fail(index < n_records);
+
+  if (!async_loading || !cache_enabled) {
+    enter_record(index, target, t);
+    return;
+  }
+
+  flush_results();
+  loading_index = index;
+  loading_target = target;
+  loading_time = t;
+
+  job = g_new0(struct load_job, 1);
+  job->urls = remote_database_dirs();
+  job->files = g_new0(char *, 3);
+  job->files[0] = g_strconcat(records[index].name, ".hea", NULL);
+  job->files[1] = g_strconcat(records[index].name, ".",
+			      database_annotator, NULL);
+  job->done = &record_files_loaded;
+
+  block_cache_set_auth(gtk_entry_get_text(GTK_ENTRY(user_name_entry)),
+		       gtk_entry_get_text(GTK_ENTRY(password_entry)));
+  msg = g_strdup_printf("Loading record %s...", records[index].name);
+  show_loading(msg);
+  g_free(msg);
+  gtk_combo_box_set_active(GTK_COMBO_BOX(record_combo), index);
+
+  start_load_job(job);
+}
+
+static gboolean signal_data_loaded(gpointer data)
+{
+  struct load_job *job = data;
+
+  if (load_current(job) && loading_index < 0) {
+    signals_loaded = 1;
+    show_alarm();
+  }
+  free_load_job(job);
+  return FALSE;
+}
+
+/* Fetch the remote signal data for samples t0 through t0+n-1 of the
+   current record in the background, if it isn't already in the cache.
+   Returns 1 if a job was started, in which case show_alarm() is called
+   again when it finishes. */
+static int load_signal_data(WFDB_Time t0, long n)
+{
+  struct load_job *job;
+
+  if (!async_loading || !cache_enabled)
+    return 0;
+
+  job = g_new0(struct load_job, 1);
+  job->n_ranges = remote_sample_ranges(t0, n, &job->ranges);
+  if (job->n_ranges == 0) {
+    /* cancel any earlier fetch, since its alarm is no longer needed */
+    g_atomic_int_inc(&load_generation);
+    free_load_job(job);
+    return 0;
+  }
+  job->done = &signal_data_loaded;
+  wave_view_show_placeholder("Loading signals...");
+  start_load_job(job);
+  return 1;
+}
+
 static void next_alarm()
 {
   g_return_if_fail(!at_last_alarm());
 
   if (cur_alarm_index + 1 < cur_record_n_alarms)
     select_alarm(cur_alarm_index + 1);
-  else {
-    do {
-      select_record(cur_record_index + 1);
-    } while (cur_record_n_alarms < 1
-             && cur_record_index + 1 < n_records);
-  }
+  else
+    goto_record(cur_record_index + 1, LOAD_FIRST, 0);
 }
 
 static void prev_alarm()
 {
   g_return_if_fail(!at_first_alarm());
 
-  if (cur_alarm_index > 0) {
+  if (cur_alarm_index > 0)
     select_alarm(cur_alarm_index - 1);
-  }
-  else {
-    do {
-      select_record(cur_record_index - 1);
-    } while (cur_record_n_alarms < 1
-             && cur_record_index > 0);
-
-    select_alarm(cur_record_n_alarms - 1);
-  }
+  else
+    goto_record(cur_record_index - 1, LOAD_LAST, 0);
 }
 
 
@@ -1183,8 +1855,10 @@ static void next_to_compare()
             && alarms_to_compare[i].time > cur_alarm->time)) {
 
       if (alarms_to_compare[i].record_index != cur_record_index)
-        select_record(alarms_to_compare[i].record_index);
-      select_alarm_at_time(alarms_to_compare[i].time);
+        goto_record(alarms_to_compare[i].record_index, LOAD_TIME,
+                    alarms_to_compare[i].time);
+      else
+        select_alarm_at_time(alarms_to_compare[i].time);
       return;
     }
   }
@@ -1202,13 +1876,146 @@ static void prev_to_compare()
             && alarms_to_compare[i].time < cur_alarm->time)) {
 
       if (alarms_to_compare[i].record_index != cur_record_index)
-        select_record(alarms_to_compare[i].record_index);
-      select_alarm_at_time(alarms_to_compare[i].time);
+        goto_record(alarms_to_compare[i].record_index, LOAD_TIME,
+                    alarms_to_compare[i].time);
+      else
+        select_alarm_at_time(alarms_to_compare[i].time);
       return;
     }
   }
 }
 
+/**** Prefetching ****/
+
+/* While the reviewer is looking at one alarm, get ready for the next.
+   If the next alarm is in the current record, its display list is built
+   (and the signal data read) when the main loop is idle; this has to be
+   done in the main thread, since the WFDB library can only have one
+   record open at a time.  The header and annotation files for the next
+   record are downloaded into the cache by a separate thread, so that
+   select_record() will find them there.  Downloads go through the
+   block cache, so a record reviewed in an earlier session is not
+   fetched again unless it has changed on the server. */
+
+struct prefetch_job {
+  char **urls;			/* remote directories from the WFDB path */
+  char **files;			/* names of files to download */
+};
+
+static guint prefetch_source;
+static int prefetched_record_index = -1;
+
+static void free_prefetch_job(struct prefetch_job *job)
+{
+  g_strfreev(job->urls);
+  g_strfreev(job->files);
+  g_free(job);
+}
+
+static gpointer prefetch_thread(gpointer data)
+{
+  struct prefetch_job *job = data;
+  int i;
+
+  for (i = 0; job->files[i]; i++)
+    fetch_remote_file(job->urls, job->files[i]);
+
+  free_prefetch_job(job);
+  return NULL;
+}
+
+static void prefetch_record_files(int index)
+{
+  struct prefetch_job *job;
+  GThread *thread;
+
+  if (!cache_enabled || index < 0 || index >= n_records
+      || index == prefetched_record_index)
+    return;
+  prefetched_record_index = index;
+
+  job = g_new0(struct prefetch_job, 1);
+  job->urls = remote_database_dirs();
+  job->files = g_new0(char *, 3);
+  job->files[0] = g_strconcat(records[index].name, ".hea", NULL);
+  job->files[1] = g_strconcat(records[index].name, ".",
+			      database_annotator, NULL);
+
+  thread = g_thread_try_new("prefetch", &prefetch_thread, job, NULL);
+  if (thread)
+    g_thread_unref(thread);
+  else
+    free_prefetch_job(job);
+}
+
+/* Find the alarm that will be shown when the reviewer clicks "next".  If
+   it is in a different record, its time is not yet known. */
+static int next_alarm_position(int *rec_index, WFDB_Time *t)
+{
+  int i;
+
+  if (!cur_alarm)
+    return 0;
+
+  if (compare_mode) {
+    for (i = 0; i < n_alarms_to_compare; i++) {
+      if (alarms_to_compare[i].record_index > cur_record_index
+	  || (alarms_to_compare[i].record_index == cur_record_index
+	      && alarms_to_compare[i].time > cur_alarm->time)) {
+	*rec_index = alarms_to_compare[i].record_index;
+	*t = alarms_to_compare[i].time;
+	return 1;
+      }
+    }
+    return 0;
+  }
+
+  if (cur_alarm_index + 1 < cur_record_n_alarms) {
+    *rec_index = cur_record_index;
+    *t = cur_record_alarms[cur_alarm_index + 1].time;
+    return 1;
+  }
+  else if (cur_record_index + 1 < n_records) {
+    *rec_index = cur_record_index + 1;
+    *t = -1;
+    return 1;
+  }
+  return 0;
+}
+
+static gboolean prefetch_next(G_GNUC_UNUSED gpointer data)
+{
+  int rec_index;
+  WFDB_Time t;
+
+  prefetch_source = 0;
+
+  if (!next_alarm_position(&rec_index, &t))
+    return FALSE;
+
+  if (rec_index == cur_record_index) {
+    /* same position as show_time_at_pos(t, 0.75) */
+    if (nsamp > 0 && !strcmp(record, cur_record)) {
+      t = t * getifreq() / cur_record_afreq - 0.75 * nsamp;
+      prefetch_display_list(t);
+      prefetch_annotations(t, t + nsamp);
+    }
+    prefetch_record_files(cur_record_index + 1);
+  }
+  else {
+    prefetch_record_files(rec_index);
+  }
+  return FALSE;
+}
+
+static void schedule_prefetch()
+{
+  /* low priority, so that the current alarm is drawn first */
+  if (!prefetch_source)
+    prefetch_source = g_idle_add_full(G_PRIORITY_LOW, &prefetch_next,
+				      NULL, NULL);
+}
+
 /**** Callbacks ****/
 
 static void show_time_at_pos(WFDB_Time t, gdouble pos)
@@ -1217,8 +2024,14 @@ static void show_time_at_pos(WFDB_Time t, gdouble pos)
   set_display_start_time(t - pos * nsamp);
 }
 
-static void recenter_clicked(G_GNUC_UNUSED GtkButton *btn, G_GNUC_UNUSED gpointer data)
+/* Show the current alarm, once its record has been loaded. */
+static void show_alarm()
 {
+  WFDB_Time t;
+
+  if (loading_index >= 0 || !cur_alarm)
+    return;
+
   g_printerr("Loading record %s...\n", cur_record);
   set_record_and_annotator(cur_record, database_annotator);
 
@@ -1232,12 +2045,60 @@ static void recenter_clicked(G_GNUC_UNUSED GtkButton *btn, G_GNUC_UNUSED gpointe
      nsamp is */
   while (gtk_events_pending())
     gtk_main_iteration();
+  if (loading_index >= 0 || !cur_alarm)
+    return;
 
-  show_time_at_pos(cur_alarm->time * getifreq() / cur_record_afreq, 0.75);
+  t = cur_alarm->time * getifreq() / cur_record_afreq;
+  calibrate();
+  if (!signals_loaded && load_signal_data(t - 0.75 * nsamp, nsamp))
+    return;
+  signals_loaded = 0;
+
+  wave_view_show_placeholder(NULL);
+  show_time_at_pos(t, 0.75);
+  schedule_prefetch();
+}
+
+static void recenter_clicked(G_GNUC_UNUSED GtkButton *btn, G_GNUC_UNUSED gpointer data)
+{
+  show_alarm();
+}
+
+/* While a record is being loaded, the navigation buttons move on from
+   the record being loaded, rather than the current one. */
+static int skip_loading_record(int dir)
+{
+  int i, index = loading_index;
+
+  if (index < 0)
+    return 0;
+
+  if (!compare_mode) {
+    if (index + dir >= 0 && index + dir < n_records)
+      goto_record(index + dir, (dir > 0 ? LOAD_FIRST : LOAD_LAST), 0);
+    return 1;
+  }
+
+  if (dir > 0) {
+    for (i = 0; i < n_alarms_to_compare; i++)
+      if (alarms_to_compare[i].record_index > index)
+	break;
+  }
+  else {
+    for (i = n_alarms_to_compare - 1; i >= 0; i--)
+      if (alarms_to_compare[i].record_index < index)
+	break;
+  }
+  if (i >= 0 && i < n_alarms_to_compare)
+    goto_record(alarms_to_compare[i].record_index, LOAD_TIME,
+		alarms_to_compare[i].time);
+  return 1;
 }
 
 static void prev_clicked(G_GNUC_UNUSED GtkButton *btn, G_GNUC_UNUSED gpointer data)
 {
+  if (skip_loading_record(-1))
+    return;
   if (at_first_alarm())
     select_alarm(cur_alarm_index);
   else {
@@ -1248,6 +2109,8 @@ static void prev_clicked(G_GNUC_UNUSED GtkButton *btn, G_GNUC_UNUSED gpointer da
 
 static void next_clicked(G_GNUC_UNUSED GtkButton *btn, G_GNUC_UNUSED gpointer data)
 {
+  if (skip_loading_record(1))
+    return;
   if (at_last_alarm())
     select_alarm(cur_alarm_index);
   else {
@@ -1258,6 +2121,8 @@ static void next_clicked(G_GNUC_UNUSED GtkButton *btn, G_GNUC_UNUSED gpointer da
 
 static void prevcomp_clicked(G_GNUC_UNUSED GtkButton *btn, G_GNUC_UNUSED gpointer data)
 {
+  if (skip_loading_record(-1))
+    return;
   if (at_first_to_compare())
     select_alarm(cur_alarm_index);
   else {
@@ -1268,6 +2133,8 @@ static void prevcomp_clicked(G_GNUC_UNUSED GtkButton *btn, G_GNUC_UNUSED gpointe
 
 static void nextcomp_clicked(G_GNUC_UNUSED GtkButton *btn, G_GNUC_UNUSED gpointer data)
 {
+  if (skip_loading_record(1))
+    return;
   if (at_last_to_compare())
     select_alarm(cur_alarm_index);
   else {
@@ -1279,8 +2146,8 @@ static void nextcomp_clicked(G_GNUC_UNUSED GtkButton *btn, G_GNUC_UNUSED gpointe
 static void record_combo_changed(GtkComboBox *combo, G_GNUC_UNUSED gpointer data)
 {
   int n = gtk_combo_box_get_active(combo);
-  if (n >= 0 && n != cur_record_index) {
-    select_record(n);
+  if (n >= 0 && n != cur_record_index && n != loading_index) {
+    goto_record(n, LOAD_FIRST, 0);
     recenter_clicked(NULL, NULL);
   }
 }
@@ -1539,9 +2406,11 @@ int main(int argc, char **argv)
   const char *version_req, *options_fname, *msg, *geomstr, *path,
     *user_cache_dir, *username, *password, *old_project, *old_role;
   struct project_list *project_list;
-  char *rvr_list_url, *rvr_post_url, *adj_users_url,
-    *adj_results_url, *adj_list_url, *adj_post_url,
+  char *rvr_list_url, *rvr_post_url, *rvr_batch_url, *adj_users_url,
+    *adj_results_url, *adj_queue_url, *adj_list_url, *adj_post_url,
+    *adj_batch_url,
     *options_xml, *orig_working_dir, *cache_dir, *name;
+  char *blocks_dir, *index_dir, **dirs, *outbox_hash, *outbox_file;
   char *project_url = NULL;
   char geom[50];
   GtkTreeModel *model;
@@ -1765,11 +2634,14 @@ int main(int argc, char **argv)
 
   rvr_list_url = g_strdup(defaults_get_string("", "Reviewer.List", ""));
   rvr_post_url = g_strdup(defaults_get_string("", "Reviewer.Post", ""));
+  rvr_batch_url = g_strdup(defaults_get_string("", "Reviewer.BatchPost", ""));
 
   adj_users_url = g_strdup(defaults_get_string("", "Adjudicator.Users", ""));
   adj_results_url = g_strdup(defaults_get_string("", "Adjudicator.Results", ""));
+  adj_queue_url = g_strdup(defaults_get_string("", "Adjudicator.Queue", ""));
   adj_list_url = g_strdup(defaults_get_string("", "Adjudicator.List", ""));
   adj_post_url = g_strdup(defaults_get_string("", "Adjudicator.Post", ""));
+  adj_batch_url = g_strdup(defaults_get_string("", "Adjudicator.BatchPost", ""));
 
   /* ugh, need to do this before calling isigopen (or other high-level
      wfdb funcs) for the first time */
@@ -1802,7 +2674,7 @@ int main(int argc, char **argv)
   user_cache_dir = g_get_user_cache_dir();
   if (user_cache_dir) {
     cache_dir = g_build_filename(user_cache_dir, "metaann", NULL);
-    delete_recursive(cache_dir);
+    clear_cache_dir(cache_dir);
     if (!g_mkdir_with_parents(cache_dir, 0700) && !g_chdir(cache_dir)) {
 #ifdef G_OS_WIN32
       char *oldfile = g_build_filename(orig_working_dir, "curl-ca-bundle.crt", NULL);
@@ -1826,6 +2698,16 @@ int main(int argc, char **argv)
       if (f2) fclose(f2);
 #endif
       cache_enabled = 1;
+      blocks_dir = g_build_filename(cache_dir, BLOCK_CACHE_DIR, NULL);
+      block_cache_init(blocks_dir,
+		       defaults_get_integer("", "Database.DiskCacheSize",
+					    1048576) * (gint64) 1024,
+		       (dirs = remote_database_dirs()));
+      g_strfreev(dirs);
+      g_free(blocks_dir);
+      index_dir = g_build_filename(cache_dir, INDEX_CACHE_DIR, NULL);
+      annidx_init(index_dir);
+      g_free(index_dir);
     }
   }
   else
@@ -1936,13 +2818,30 @@ int main(int argc, char **argv)
   read_records_list();
 
   if (compare_mode) {
-    read_reviewer_results(adj_users_url, adj_results_url);
+    if (!adj_queue_url[0] || !read_adjudication_queue(adj_queue_url))
+      read_reviewer_results(adj_users_url, adj_results_url);
     read_results_list(&my_results, adj_list_url, adj_post_url);
   }
   else {
     read_results_list(&my_results, rvr_list_url, rvr_post_url);
   }
 
+  /* results not yet sent in an earlier session are sent now; the
+     journal is specific to the user and the project */
+  name = g_strconcat(gtk_entry_get_text(GTK_ENTRY(user_name_entry)),
+		     "\n", my_results.post_url, NULL);
+  outbox_hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, name, -1);
+  g_free(name);
+  outbox_file = g_build_filename(g_get_user_data_dir(), "metaann",
+				 "outbox", outbox_hash, NULL);
+  outbox_set_auth(gtk_entry_get_text(GTK_ENTRY(user_name_entry)),
+		  gtk_entry_get_text(GTK_ENTRY(password_entry)));
+  outbox_open(outbox_file, my_results.post_url,
+	      (compare_mode ? adj_batch_url : rvr_batch_url),
+	      &result_queue_changed);
+  g_free(outbox_hash);
+  g_free(outbox_file);
+
   for (i = 0; i < n_records; i++)
     update_rec_status(i);
 
@@ -1992,6 +2891,7 @@ int main(int argc, char **argv)
   gtk_widget_show(wave_window);
 
   recenter_clicked(NULL, NULL);
+  async_loading = 1;
 
   gtk_widget_show_all(window);
   gtk_widget_hide(project_dialog);
@@ -2005,10 +2905,11 @@ int main(int argc, char **argv)
   gtk_main();
 
   flush_results();
+  outbox_close(OUTBOX_EXIT_WAIT);
 
   if (cache_enabled) {
     g_chdir(orig_working_dir);
-    delete_recursive(cache_dir);
+    clear_cache_dir(cache_dir);
   }
 
   return 0;
@@ -0,0 +1,422 @@
+/*
+ * Metaann
+ *
+ * Copyright (C) 2014 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Result outbox
+
+   Results are not posted to the server directly.  Each one is first
+   appended to a journal on disk, and flushed, so that it survives a
+   crash or a lost connection; a background thread then posts the
+   queued results in order, and records each acknowledgement in the
+   journal.  If a request fails, it is retried after a delay that grows
+   from RETRY_MIN to RETRY_MAX.  A result that the server refuses as
+   invalid (with a 4xx status other than those for authentication or
+   rate limiting) is discarded, so that it doesn't hold up the others.
+
+   If the server provides a batch URL, the results waiting in the queue
+   are sent together, as one form in which each field is repeated once
+   per result (up to BATCH_MAX at a time); the sender waits up to
+   BATCH_DELAY after a result is submitted, so that a reviewer working
+   quickly sends a few requests rather than one per alarm.  If a batch
+   is refused, its results are sent again one at a time.
+
+   The journal is a text file of lines "P\tID\tPOSTDATA" (a queued
+   result) and "A\tID" (its acknowledgement).  When it is opened, the
+   results not yet acknowledged are queued again, and the journal is
+   rewritten to contain only those; it is truncated whenever the queue
+   becomes empty.  A final line without a newline was cut short by a
+   crash, and is ignored.
+
+   The notify function is called, in the main thread, when a result is
+   queued (from outbox_submit(), or when it is found in the journal by
+   outbox_open()) and when it has been sent or rejected. */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#ifdef G_OS_WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "url.h"
+#include "outbox.h"
+
+#define RETRY_MIN (G_USEC_PER_SEC)
+#define RETRY_MAX (60 * G_USEC_PER_SEC)
+#define BATCH_MAX 200
+#define BATCH_DELAY (2 * G_USEC_PER_SEC)
+
+struct outbox_entry {
+    gulong id;
+    char *postdata;
+    gint64 queued;		/* time it was submitted, or 0 */
+};
+
+struct outbox_event {
+    char *postdata;
+    int state;
+};
+
+static GMutex outbox_lock;
+static GCond outbox_cond;
+static GQueue outbox_queue = G_QUEUE_INIT;
+static char *outbox_url;
+static char *outbox_batch_url;
+static char *outbox_fname;
+static FILE *journal;
+static gulong next_id;
+static char *auth_user, *auth_pass;
+static OutboxNotifyFunc notify_func;
+static gboolean closing;
+static gboolean draining;	/* send without waiting for more */
+static gulong single_until;	/* send entries up to this one singly */
+static GThread *sender;
+
+static void free_entry(struct outbox_entry *e)
+{
+    g_free(e->postdata);
+    g_free(e);
+}
+
+static gboolean notify_idle(gpointer data)
+{
+    struct outbox_event *ev = data;
+
+    if (notify_func)
+	notify_func(ev->postdata, ev->state);
+    g_free(ev->postdata);
+    g_free(ev);
+    return FALSE;
+}
+
+static void notify_later(const char *postdata, int state)
+{
+    struct outbox_event *ev = g_new(struct outbox_event, 1);
+
+    ev->postdata = g_strdup(postdata);
+    ev->state = state;
+    g_idle_add(&notify_idle, ev);
+}
+
+/* Append a line to the journal (with the lock held.) */
+static void journal_append(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!journal)
+	return;
+    va_start(ap, fmt);
+    vfprintf(journal, fmt, ap);
+    va_end(ap);
+}
+
+/* Flush the journal to disk (with the lock held.) */
+static void journal_sync(void)
+{
+    if (!journal)
+	return;
+    fflush(journal);
+#ifdef G_OS_WIN32
+    _commit(fileno(journal));
+#else
+    fsync(fileno(journal));
+#endif
+}
+
+/* Rewrite the journal to hold only the queued entries (with the lock
+   held.) */
+static void journal_compact(void)
+{
+    GString *str;
+    GList *l;
+    struct outbox_entry *e;
+
+    if (!outbox_fname)
+	return;
+    if (journal)
+	fclose(journal);
+    str = g_string_new(NULL);
+    for (l = outbox_queue.head; l; l = l->next) {
+	e = l->data;
+	g_string_append_printf(str, "P\t%lu\t%s\n", e->id, e->postdata);
+    }
+    if (!g_file_set_contents(outbox_fname, str->str, str->len, NULL))
+	g_printerr("warning: cannot write %s\n", outbox_fname);
+    g_string_free(str, TRUE);
+    journal = g_fopen(outbox_fname, "a");
+}
+
+/* Decide how many entries, from the head of the queue, to send in the
+   next request (with the lock held.)  Returns 0 if the sender should
+   wait until more entries arrive, or until the given time. */
+static int next_batch_size(gint64 *until)
+{
+    struct outbox_entry *e = g_queue_peek_head(&outbox_queue);
+    int n = g_queue_get_length(&outbox_queue);
+
+    *until = 0;
+    if (!e)
+	return (0);
+    if (!outbox_batch_url || e->id <= single_until)
+	return (1);
+    if (n >= BATCH_MAX)
+	return (BATCH_MAX);
+
+    /* Give the reviewer a moment to produce more results, so that they
+       can be sent together. */
+    if (!draining && e->queued + BATCH_DELAY > g_get_monotonic_time()) {
+	*until = e->queued + BATCH_DELAY;
+	return (0);
+    }
+    return (n);
+}
+
+/* Send the queued entries, oldest first. */
+static gpointer sender_thread(G_GNUC_UNUSED gpointer data)
+{
+    struct outbox_entry *e;
+    GString *postdata;
+    GList *l;
+    char *user, *pass, *response;
+    const char *url;
+    GError *err = NULL;
+    gint64 delay = 0, until;
+    int i, n, state;
+
+    g_mutex_lock(&outbox_lock);
+    while (!closing) {
+	if (!(n = next_batch_size(&until))) {
+	    if (until)
+		g_cond_wait_until(&outbox_cond, &outbox_lock, until);
+	    else
+		g_cond_wait(&outbox_cond, &outbox_lock);
+	    continue;
+	}
+
+	/* Several entries are sent to the batch URL as one form, with
+	   each field repeated once for each entry. */
+	postdata = g_string_new(NULL);
+	for (i = 0, l = outbox_queue.head; i < n; i++, l = l->next) {
+	    e = l->data;
+	    if (i > 0)
+		g_string_append_c(postdata, '&');
+	    g_string_append(postdata, e->postdata);
+	}
+	url = (n > 1 ? outbox_batch_url : outbox_url);
+
+	user = g_strdup(auth_user);
+	pass = g_strdup(auth_pass);
+	g_mutex_unlock(&outbox_lock);
+	response = url_post(url, postdata->str, user, pass, NULL, &err);
+	g_free(response);
+	g_free(user);
+	g_free(pass);
+	g_string_free(postdata, TRUE);
+	g_mutex_lock(&outbox_lock);
+
+	if (closing) {
+	    /* The journal is closed; the entries will be sent again (with
+	       the same effect) in the next session. */
+	    g_clear_error(&err);
+	    break;
+	}
+	if (!err)
+	    state = OUTBOX_SENT;
+	else if (err->domain == URL_ERROR && err->code >= 400
+		 && err->code < 500 && err->code != 401 && err->code != 403
+		 && err->code != 408 && err->code != 429) {
+	    g_printerr("warning: result rejected: %s\n", err->message);
+	    state = OUTBOX_REJECTED;
+	}
+	else {
+	    /* Try again later, unless we are closing. */
+	    g_printerr("warning: unable to save result: %s\n", err->message);
+	    g_clear_error(&err);
+	    delay = CLAMP(delay * 2, RETRY_MIN, RETRY_MAX);
+	    until = g_get_monotonic_time() + delay;
+	    while (!closing
+		   && g_cond_wait_until(&outbox_cond, &outbox_lock, until))
+		;
+	    continue;
+	}
+	g_clear_error(&err);
+	delay = 0;
+
+	if (state == OUTBOX_REJECTED && n > 1) {
+	    /* One of them is invalid; send them one at a time, so that
+	       only that one is discarded. */
+	    e = g_queue_peek_nth(&outbox_queue, n - 1);
+	    single_until = e->id;
+	    continue;
+	}
+
+	for (i = 0; i < n; i++) {
+	    e = g_queue_pop_head(&outbox_queue);
+	    if (!g_queue_is_empty(&outbox_queue))
+		journal_append("A\t%lu\n", e->id);
+	    notify_later(e->postdata, state);
+	    free_entry(e);
+	}
+	if (g_queue_is_empty(&outbox_queue))
+	    journal_compact();
+	else
+	    journal_sync();
+	g_cond_broadcast(&outbox_cond);
+    }
+    g_mutex_unlock(&outbox_lock);
+    return NULL;
+}
+
+/* Outbox_open() queues the entries left in the journal file fname by an
+   earlier session, and starts sending them (and any others submitted)
+   to the given URL.  If batch_url is not NULL, entries that are queued
+   together are sent to it in one request.  If the journal can't be
+   written, results are still sent, but are not kept on disk. */
+void outbox_open(const char *fname, const char *url, const char *batch_url,
+		 OutboxNotifyFunc notify)
+{
+    struct outbox_entry *e;
+    char *text, **lines, *p;
+    gulong id;
+    GList *l;
+    int i;
+
+    g_return_if_fail(url != NULL);
+    g_return_if_fail(sender == NULL);
+
+    g_mutex_lock(&outbox_lock);
+    outbox_url = g_strdup(url);
+    outbox_batch_url = (batch_url && batch_url[0] ? g_strdup(batch_url)
+			: NULL);
+    outbox_fname = g_strdup(fname);
+    notify_func = notify;
+
+    if (fname && g_file_get_contents(fname, &text, NULL, NULL)) {
+	lines = g_strsplit(text, "\n", -1);
+	g_free(text);
+	/* the last element is empty unless the line was cut short */
+	for (i = 0; lines[i] && lines[i + 1]; i++) {
+	    if (lines[i][0] == 'P' && lines[i][1] == '\t') {
+		id = strtoul(lines[i] + 2, &p, 10);
+		if (*p != '\t')
+		    continue;
+		e = g_new0(struct outbox_entry, 1);
+		e->id = id;
+		e->postdata = g_strdup(p + 1);
+		g_queue_push_tail(&outbox_queue, e);
+		next_id = MAX(next_id, id + 1);
+	    }
+	    else if (lines[i][0] == 'A' && lines[i][1] == '\t') {
+		id = strtoul(lines[i] + 2, NULL, 10);
+		for (l = outbox_queue.head; l; l = l->next) {
+		    e = l->data;
+		    if (e->id == id) {
+			g_queue_delete_link(&outbox_queue, l);
+			free_entry(e);
+			break;
+		    }
+		}
+	    }
+	}
+	g_strfreev(lines);
+    }
+
+    if (fname) {
+	p = g_path_get_dirname(fname);
+	g_mkdir_with_parents(p, 0700);
+	g_free(p);
+	journal_compact();
+    }
+    for (l = outbox_queue.head; l; l = l->next) {
+	e = l->data;
+	if (notify_func)
+	    notify_func(e->postdata, OUTBOX_QUEUED);
+    }
+
+    closing = FALSE;
+    sender = g_thread_new("outbox", &sender_thread, NULL);
+    g_mutex_unlock(&outbox_lock);
+}
+
+void outbox_set_auth(const char *username, const char *password)
+{
+    g_mutex_lock(&outbox_lock);
+    g_free(auth_user);
+    g_free(auth_pass);
+    auth_user = g_strdup(username);
+    auth_pass = g_strdup(password);
+    g_mutex_unlock(&outbox_lock);
+}
+
+/* Outbox_submit() saves a request (URL-encoded form data) in the
+   journal, and queues it to be sent. */
+void outbox_submit(const char *postdata)
+{
+    struct outbox_entry *e;
+
+    g_return_if_fail(postdata != NULL);
+    g_return_if_fail(sender != NULL);
+
+    g_mutex_lock(&outbox_lock);
+    e = g_new(struct outbox_entry, 1);
+    e->id = next_id++;
+    e->postdata = g_strdup(postdata);
+    e->queued = g_get_monotonic_time();
+    journal_append("P\t%lu\t%s\n", e->id, e->postdata);
+    journal_sync();
+    g_queue_push_tail(&outbox_queue, e);
+    g_cond_broadcast(&outbox_cond);
+    g_mutex_unlock(&outbox_lock);
+
+    if (notify_func)
+	notify_func(postdata, OUTBOX_QUEUED);
+}
+
+/* Outbox_close() waits up to wait_usec microseconds for the queued
+   entries to be sent, and then stops the sender.  Entries that have not
+   been sent remain in the journal for the next session. */
+void outbox_close(gint64 wait_usec)
+{
+    gint64 until = g_get_monotonic_time() + wait_usec;
+
+    if (!sender)
+	return;
+
+    g_mutex_lock(&outbox_lock);
+    draining = TRUE;
+    g_cond_broadcast(&outbox_cond);
+    while (!g_queue_is_empty(&outbox_queue)
+	   && g_cond_wait_until(&outbox_cond, &outbox_lock, until))
+	;
+    closing = TRUE;
+    notify_func = NULL;
+    if (journal) {
+	fclose(journal);
+	journal = NULL;
+    }
+    g_cond_broadcast(&outbox_cond);
+    g_mutex_unlock(&outbox_lock);
+
+    /* The sender may be waiting for the server; don't wait for it. */
+    g_thread_unref(sender);
+    sender = NULL;
+}
@@ -0,0 +1,38 @@
+/*
+ * Metaann
+ *
+ * Copyright (C) 2014 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+
+/* States reported to the notify function given to outbox_open() */
+enum {
+    OUTBOX_QUEUED,		/* saved in the journal, not yet sent */
+    OUTBOX_SENT,		/* acknowledged by the server */
+    OUTBOX_REJECTED		/* refused by the server, and discarded */
+};
+
+typedef void (*OutboxNotifyFunc)(const char *postdata, int state);
+
+void outbox_open(const char *fname, const char *url, const char *batch_url,
+		 OutboxNotifyFunc notify);
+
+void outbox_set_auth(const char *username, const char *password);
+
+void outbox_submit(const char *postdata);
+
+void outbox_close(gint64 wait_usec);
@@ -0,0 +1,450 @@
+/*
+ * Metaann
+ *
+ * Copyright (C) 2014 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Min/max summaries of the current record
+
+   When many samples are drawn in each pixel column, find_display_list()
+   needs only the extrema of each signal within each column.  Finding
+   these by reading every sample means that each redraw of a zoomed-out
+   screen costs as much as reading the entire screen.
+
+   Instead, the record is divided into chunks of PYR_CHUNK samples.  For
+   each chunk, we store the minimum and maximum of each signal over blocks
+   of 64 samples, and over successively coarser blocks of 256, 1024, ...
+   samples.  A chunk is built (by reading it once with getvec) the first
+   time it is needed; after that, the extrema for a column can be found
+   from a handful of blocks at the appropriate level.
+
+   Only the summaries for the current record are kept in memory.  If the
+   Wave.SummaryFiles option is set, they are saved to a file alongside the
+   cached record (in the current directory) when another record is
+   opened, and read back if the record is opened again. */
+
+#include <limits.h>
+#include <glib/gstdio.h>
+#include "wave.h"
+#include "gtkwave.h"
+
+#define PYR_BLOCK_SHIFT 6	/* level 0 blocks are 64 samples */
+#define PYR_LEVEL_SHIFT 2	/* each level is 4 times coarser */
+#define PYR_NLEVELS 6
+#define PYR_CHUNK_SHIFT (PYR_BLOCK_SHIFT + PYR_LEVEL_SHIFT * (PYR_NLEVELS - 1))
+#define PYR_CHUNK (1L << PYR_CHUNK_SHIFT)
+
+#define LEVEL_SHIFT(l) (PYR_BLOCK_SHIFT + PYR_LEVEL_SHIFT * (l))
+#define LEVEL_NBLOCKS(l) (1 << (PYR_CHUNK_SHIFT - LEVEL_SHIFT(l)))
+
+#define PYR_READ 4096		/* samples unpacked at a time */
+
+#define PYR_FILE_SUFFIX ".mmx"
+#define PYR_FILE_MAGIC "MMXSUM1"
+
+struct pyr_chunk {
+    long nsamp;			/* number of samples (PYR_CHUNK except at
+				   the end of the record) */
+    WFDB_Sample *min[PYR_NLEVELS]; /* minimum of each signal in each block,
+				   indexed by [block * pyr_nsig + signal] */
+    WFDB_Sample *max[PYR_NLEVELS]; /* maximum, likewise */
+};
+
+struct pyr_file_header {
+    char magic[8];
+    gint32 sample_size;
+    gint32 nsig;
+    gint32 block_shift;
+    gint32 chunk_shift;
+};
+
+static char pyr_record[RNLMAX+1];
+static int pyr_nsig;
+static int pyr_modified;
+static GHashTable *pyr_chunks;
+
+static WFDB_Sample *pyr_vec;
+static WFDB_Sample *pyr_planes;	/* PYR_READ samples of each signal */
+static WFDB_Sample *colmin, *colmax;
+static int colsize;
+
+static int summary_files_enabled(void)
+{
+    return defaults_get_boolean("wave.summaryfiles", "Wave.SummaryFiles", 0);
+}
+
+static struct pyr_chunk *new_chunk(void)
+{
+    struct pyr_chunk *ch;
+    WFDB_Sample *p;
+    int l, n;
+
+    for (l = n = 0; l < PYR_NLEVELS; l++)
+	n += LEVEL_NBLOCKS(l) * pyr_nsig;
+
+    ch = g_slice_new(struct pyr_chunk);
+    ch->nsamp = 0;
+    p = g_new(WFDB_Sample, 2 * n);
+    for (l = 0; l < PYR_NLEVELS; l++) {
+	ch->min[l] = p;
+	p += LEVEL_NBLOCKS(l) * pyr_nsig;
+	ch->max[l] = p;
+	p += LEVEL_NBLOCKS(l) * pyr_nsig;
+    }
+    return ch;
+}
+
+static void free_chunk(gpointer data)
+{
+    struct pyr_chunk *ch = data;
+
+    g_free(ch->min[0]);
+    g_slice_free(struct pyr_chunk, ch);
+}
+
+/* Fill in levels 1 and above from level 0.  A block containing no valid
+   samples has min > max. */
+static void summarize_chunk(struct pyr_chunk *ch)
+{
+    int b, c, j, l, nb;
+    WFDB_Sample lo, hi, *mn, *mx;
+
+    for (l = 1; l < PYR_NLEVELS; l++) {
+	nb = LEVEL_NBLOCKS(l);
+	for (b = 0; b < nb; b++) {
+	    for (c = 0; c < pyr_nsig; c++) {
+		lo = INT_MAX;
+		hi = INT_MIN;
+		for (j = 0; j < (1 << PYR_LEVEL_SHIFT); j++) {
+		    mn = ch->min[l-1] + ((b << PYR_LEVEL_SHIFT) + j) * pyr_nsig;
+		    mx = ch->max[l-1] + ((b << PYR_LEVEL_SHIFT) + j) * pyr_nsig;
+		    if (mn[c] < lo) lo = mn[c];
+		    if (mx[c] > hi) hi = mx[c];
+		}
+		ch->min[l][b * pyr_nsig + c] = lo;
+		ch->max[l][b * pyr_nsig + c] = hi;
+	    }
+	}
+    }
+}
+
+/* Merge samples i0 through i0+n-1 of a chunk, unpacked from the mapped
+   signal files into pyr_planes, into its level 0 summaries. */
+static void summarize_planes(struct pyr_chunk *ch, long i0, long n)
+{
+    WFDB_Sample *p, *mn, *mx;
+    long i;
+    int c;
+
+    for (c = 0; c < pyr_nsig; c++) {
+	p = pyr_planes + c * PYR_READ;
+	for (i = 0; i < n; i++) {
+	    if (p[i] == WFDB_INVALID_SAMPLE) continue;
+	    mn = ch->min[0] + ((i0 + i) >> PYR_BLOCK_SHIFT) * pyr_nsig + c;
+	    mx = ch->max[0] + ((i0 + i) >> PYR_BLOCK_SHIFT) * pyr_nsig + c;
+	    if (p[i] < *mn) *mn = p[i];
+	    if (p[i] > *mx) *mx = p[i];
+	}
+    }
+}
+
+/* Read chunk k of the record and compute its summaries.  The samples are
+   unpacked from the mapped signal files, PYR_READ at a time, if possible
+   (see sigmap.c), or otherwise read using getvec().  Returns NULL if the
+   chunk lies beyond the end of the record or can't be read. */
+static struct pyr_chunk *build_chunk(long k)
+{
+    struct pyr_chunk *ch;
+    WFDB_Sample *mn, *mx;
+    long i, n, t0 = k << PYR_CHUNK_SHIFT;
+    int c, mapped;
+
+    mapped = (read_mapped_samples(t0, 0, NULL, pyr_planes, PYR_READ) >= 0);
+    if (!mapped && t0 != strtim("i") && isigsettime(t0) < 0)
+	return (NULL);
+
+    ch = new_chunk();
+    for (i = 0; i < LEVEL_NBLOCKS(0) * pyr_nsig; i++) {
+	ch->min[0][i] = INT_MAX;
+	ch->max[0][i] = INT_MIN;
+    }
+    if (mapped) {
+	for (i = 0; i < PYR_CHUNK; i += n) {
+	    n = read_mapped_samples(t0 + i, PYR_READ, NULL, pyr_planes,
+				    PYR_READ);
+	    if (n < 0) {
+		/* A remote signal file couldn't be read. */
+		free_chunk(ch);
+		return (NULL);
+	    }
+	    summarize_planes(ch, i, n);
+	    if (n < PYR_READ) {
+		i += n;
+		break;
+	    }
+	}
+    }
+    else for (i = 0; i < PYR_CHUNK && getvec(pyr_vec) > 0; i++) {
+	mn = ch->min[0] + (i >> PYR_BLOCK_SHIFT) * pyr_nsig;
+	mx = ch->max[0] + (i >> PYR_BLOCK_SHIFT) * pyr_nsig;
+	for (c = 0; c < pyr_nsig; c++) {
+	    if (pyr_vec[c] == WFDB_INVALID_SAMPLE) continue;
+	    if (pyr_vec[c] < mn[c]) mn[c] = pyr_vec[c];
+	    if (pyr_vec[c] > mx[c]) mx[c] = pyr_vec[c];
+	}
+    }
+    if (i == 0) {
+	free_chunk(ch);
+	return (NULL);
+    }
+    ch->nsamp = i;
+    summarize_chunk(ch);
+    g_hash_table_insert(pyr_chunks, GINT_TO_POINTER(k), ch);
+    pyr_modified = 1;
+    return (ch);
+}
+
+static char *summary_file_name(void)
+{
+    return g_strconcat(pyr_record, PYR_FILE_SUFFIX, NULL);
+}
+
+static void save_summaries(void)
+{
+    struct pyr_file_header hdr;
+    GHashTableIter iter;
+    gpointer key, value;
+    struct pyr_chunk *ch;
+    char *fname, *dname;
+    gint32 n[2];
+    FILE *f;
+    int ok = 1;
+
+    fname = summary_file_name();
+    dname = g_path_get_dirname(fname);
+    g_mkdir_with_parents(dname, 0777);
+    g_free(dname);
+
+    if ((f = g_fopen(fname, "wb")) == NULL) {
+	g_free(fname);
+	return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    strncpy(hdr.magic, PYR_FILE_MAGIC, sizeof(hdr.magic));
+    hdr.sample_size = sizeof(WFDB_Sample);
+    hdr.nsig = pyr_nsig;
+    hdr.block_shift = PYR_BLOCK_SHIFT;
+    hdr.chunk_shift = PYR_CHUNK_SHIFT;
+    ok = (fwrite(&hdr, sizeof(hdr), 1, f) == 1);
+
+    /* Only level 0 is saved; the others are recomputed when loading. */
+    g_hash_table_iter_init(&iter, pyr_chunks);
+    while (ok && g_hash_table_iter_next(&iter, &key, &value)) {
+	ch = value;
+	n[0] = GPOINTER_TO_INT(key);
+	n[1] = ch->nsamp;
+	ok = (fwrite(n, sizeof(gint32), 2, f) == 2
+	      && fwrite(ch->min[0], sizeof(WFDB_Sample),
+			LEVEL_NBLOCKS(0) * pyr_nsig, f)
+	         == (size_t) LEVEL_NBLOCKS(0) * pyr_nsig
+	      && fwrite(ch->max[0], sizeof(WFDB_Sample),
+			LEVEL_NBLOCKS(0) * pyr_nsig, f)
+	         == (size_t) LEVEL_NBLOCKS(0) * pyr_nsig);
+    }
+
+    if (fclose(f) != 0 || !ok) {
+	g_warning("Unable to write %s", fname);
+	g_unlink(fname);
+    }
+    g_free(fname);
+}
+
+static void load_summaries(void)
+{
+    struct pyr_file_header hdr;
+    struct pyr_chunk *ch;
+    char *fname;
+    gint32 n[2];
+    FILE *f;
+    size_t nb = LEVEL_NBLOCKS(0) * pyr_nsig;
+
+    fname = summary_file_name();
+    f = g_fopen(fname, "rb");
+    g_free(fname);
+    if (!f)
+	return;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1
+	|| strncmp(hdr.magic, PYR_FILE_MAGIC, sizeof(hdr.magic))
+	|| hdr.sample_size != sizeof(WFDB_Sample)
+	|| hdr.nsig != pyr_nsig
+	|| hdr.block_shift != PYR_BLOCK_SHIFT
+	|| hdr.chunk_shift != PYR_CHUNK_SHIFT) {
+	fclose(f);
+	return;
+    }
+
+    while (fread(n, sizeof(gint32), 2, f) == 2) {
+	if (n[1] <= 0 || n[1] > PYR_CHUNK)
+	    break;
+	ch = new_chunk();
+	ch->nsamp = n[1];
+	if (fread(ch->min[0], sizeof(WFDB_Sample), nb, f) != nb
+	    || fread(ch->max[0], sizeof(WFDB_Sample), nb, f) != nb) {
+	    free_chunk(ch);
+	    break;
+	}
+	summarize_chunk(ch);
+	g_hash_table_insert(pyr_chunks, GINT_TO_POINTER(n[0]), ch);
+    }
+    fclose(f);
+}
+
+/* Discard the summaries for the current record (saving them first, if
+   requested.) */
+void clear_pyramid(void)
+{
+    if (pyr_chunks) {
+	if (pyr_modified && summary_files_enabled())
+	    save_summaries();
+	g_hash_table_destroy(pyr_chunks);
+	pyr_chunks = NULL;
+    }
+    pyr_record[0] = 0;
+    pyr_nsig = 0;
+    pyr_modified = 0;
+}
+
+static void open_pyramid(void)
+{
+    if (pyr_chunks && pyr_nsig == nsig && strcmp(pyr_record, record) == 0)
+	return;
+
+    clear_pyramid();
+    g_strlcpy(pyr_record, record, sizeof(pyr_record));
+    pyr_nsig = nsig;
+    pyr_vec = g_renew(WFDB_Sample, pyr_vec, nsig);
+    pyr_planes = g_renew(WFDB_Sample, pyr_planes, nsig * PYR_READ);
+    pyr_chunks = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+				       NULL, &free_chunk);
+    if (summary_files_enabled())
+	load_summaries();
+}
+
+/* Find the level to be used for a screen of ns samples drawn in the given
+   number of columns: the coarsest level whose blocks are no more than half
+   a column wide.  Returns -1 if even level 0 is too coarse. */
+static int pyramid_level(long ns, int width)
+{
+    int l;
+
+    if (nsig <= 0 || width <= 1 || ns <= width)
+	return (-1);
+    for (l = PYR_NLEVELS - 1; l >= 0; l--)
+	if ((2L << LEVEL_SHIFT(l)) <= ns / width)
+	    break;
+    return (l);
+}
+
+/* Pyramid_usable() returns true if pyramid_columns() can be used for a
+   screen of ns samples drawn in the given number of columns. */
+int pyramid_usable(long ns, int width)
+{
+    return (pyramid_level(ns, width) >= 0);
+}
+
+/* Merge the extrema of samples a through b-1 (multiples of the level 0
+   block size), using the coarsest blocks, no coarser than level l, that
+   fit, into column x of colmin and colmax.  Returns the number of blocks
+   merged; *at_end is set if the end of the record was reached first. */
+static int merge_blocks(long a, long b, int l, int x, int width, int *at_end)
+{
+    struct pyr_chunk *ch;
+    WFDB_Sample *mn, *mx;
+    long k, t, tc;
+    int c, lb, n = 0;
+
+    for (t = a; t < b; t += 1L << LEVEL_SHIFT(lb), n++) {
+	for (lb = l; lb > 0; lb--)
+	    if ((t & ((1L << LEVEL_SHIFT(lb)) - 1)) == 0
+		&& t + (1L << LEVEL_SHIFT(lb)) <= b)
+		break;
+	k = t >> PYR_CHUNK_SHIFT;
+	ch = g_hash_table_lookup(pyr_chunks, GINT_TO_POINTER(k));
+	if ((!ch && (ch = build_chunk(k)) == NULL)
+	    || t >= (tc = k << PYR_CHUNK_SHIFT) + ch->nsamp) {
+	    *at_end = 1;
+	    break;
+	}
+
+	mn = ch->min[lb] + ((t - tc) >> LEVEL_SHIFT(lb)) * nsig;
+	mx = ch->max[lb] + ((t - tc) >> LEVEL_SHIFT(lb)) * nsig;
+	for (c = 0; c < nsig; c++) {
+	    if (mn[c] < colmin[c * width + x]) colmin[c * width + x] = mn[c];
+	    if (mx[c] > colmax[c * width + x]) colmax[c * width + x] = mx[c];
+	}
+    }
+    return (n);
+}
+
+/* Pyramid_columns() finds the extrema of each signal for each column of a
+   screen of ns samples beginning at sample t0.  The columns are those of
+   decim_columns(), aligned to the record.  A level 0 block belongs to the
+   column containing its first sample (or to column 0, if it begins before
+   t0), so that the extrema of each column but the first and last depend
+   only on its position in the record, not on where the screen begins.
+
+   On return, (*pmin)[c*width + x] and (*pmax)[c*width + x] give the
+   extrema of signal c in column x; if there are no valid samples in the
+   column, the minimum is greater than the maximum.  The return value is
+   the number of columns filled in, or 0 if the summaries are too coarse
+   for the requested scale or the record can't be read. */
+int pyramid_columns(long t0, long ns, int width, double scale,
+		    WFDB_Sample **pmin, WFDB_Sample **pmax)
+{
+    long a, b, *jump;
+    int at_end = 0, i, l, x, ncols, nfilled = 0;
+
+    if ((l = pyramid_level(ns, width)) < 0)
+	return (0);
+
+    open_pyramid();
+
+    if (colsize < nsig * width) {
+	colsize = nsig * width;
+	colmin = g_renew(WFDB_Sample, colmin, colsize);
+	colmax = g_renew(WFDB_Sample, colmax, colsize);
+    }
+    for (i = 0; i < nsig * width; i++) {
+	colmin[i] = INT_MAX;
+	colmax[i] = INT_MIN;
+    }
+
+    ncols = decim_columns(t0, ns, scale, width, &jump);
+    for (x = 0; x < ncols && !at_end; x++) {
+	/* Find the level 0 blocks beginning in column x. */
+	a = (x == 0) ? (t0 >> PYR_BLOCK_SHIFT) << PYR_BLOCK_SHIFT
+	    : (((t0 + jump[x] - 1) >> PYR_BLOCK_SHIFT) + 1) << PYR_BLOCK_SHIFT;
+	b = (((t0 + jump[x+1] - 1) >> PYR_BLOCK_SHIFT) + 1) << PYR_BLOCK_SHIFT;
+	if (merge_blocks(a, b, l, x, width, &at_end) > 0)
+	    nfilled = x + 1;
+    }
+
+    *pmin = colmin;
+    *pmax = colmax;
+    return (nfilled);
+}
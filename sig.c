@@ -21,15 +21,15 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <limits.h>
 #include "wave.h"
 #include "gtkwave.h"
 
 static void show_signal_names(), show_signal_baselines();
 
-/* Show_display_list() plots the display list pointed to by its argument. */
-
 static struct display_list *lp_current;
 static int highlighted = -1;
+static int *yshift;	/* y-shift of each trace (see show_tiles()) */
 
 int in_siglist(i)
 int i;
@@ -41,147 +41,355 @@ int i;
     return (0);
 }
 
-static void draw_lines_relative(GdkDrawable *drawable, GdkGC *gc,
-                                const GdkPoint *points, int n)
+/* Abscissas() returns the window abscissa of each point of a display list
+beginning at time t0.  If there are more samples to be shown than addressable
+x-pixels in the window, the abscissas are simply the integers from 0 to the
+canvas width (and some compression will be needed); otherwise, they are
+distributed across the window (at intervals > 1 pixel), with sample t at
+(long)(t*tscale) - (long)(t0*tscale), so that the points are aligned to the
+record as the columns of a compressed list are (see decim_columns()).  The
+table is shared by all display lists, and is recalculated only when the
+geometry or the starting time changes. */
+
+static int *abscissas(t0)
+long t0;
 {
-    static GdkPoint *array;
-    static int array_size;
-    int i;
-    GdkPoint p0, *p;
+    static int *xtab, xtab_size, xtab_width;
+    static long xtab_nsamp, xtab_t0;
+    static double xtab_scale;
+    int len, x;
+    long g0;
 
-    if (array_size <= n) {
-	g_free(array);
-	array_size = n + 1;
-	array = g_new(GdkPoint, array_size);
-    }
+    len = (canvas_width > 0) ? canvas_width : 1;
+    if (nsamp > canvas_width) t0 = 0L;
+    if (xtab && xtab_width == canvas_width && xtab_nsamp == nsamp &&
+	xtab_scale == tscale && xtab_t0 == t0)
+	return (xtab);
 
-    array[0].x = array[0].y = 0;
-    for (i = 0; i < n; i++) {
-	array[i + 1].x = array[i].x + points[i].x;
-	array[i + 1].y = array[i].y + points[i].y;
+    if (xtab_size < len) {
+	xtab_size = len;
+	xtab = g_renew(int, xtab, xtab_size);
     }
-
-    gdk_draw_lines(drawable, gc, &array[1], n);
+    g0 = (long)(t0*tscale);
+    for (x = 0; x < len; x++)
+	xtab[x] = (nsamp > canvas_width) ? x : (long)((t0 + x)*tscale) - g0;
+    xtab_width = canvas_width;
+    xtab_nsamp = nsamp;
+    xtab_scale = tscale;
+    xtab_t0 = t0;
+    return (xtab);
 }
 
-static void drawtrace(b, n, ybase, gc, mode)
-GdkPoint *b;
-int mode, n, ybase;
+/* Draw_runs() draws points i0 through i1-1 of a trace (see set_trace_offset(),
+below), skipping invalid samples, as polylines.  The vertices are assembled
+from the abscissa table, less xoff, and the ordinates, plus ybase. */
+
+static void draw_runs(drawable, gc, b, i0, i1, xtab, xoff, ybase)
+GdkDrawable *drawable;
 GdkGC *gc;
+gint16 *b;
+int i0, i1, *xtab, xoff, ybase;
 {
-    int j, xn, xp;
-    GdkPoint *p, *q;
+    static GdkPoint *pts;
+    static int pts_size;
+    int i, j, k;
 
-    if (ybase == -9999) return;
-    for (j = 0, p = q = b; j <= n; j++) {
-	if (j == n || q->y == WFDB_INVALID_SAMPLE) {
-	    if (p < q) {
-		while (p < q && p->y == WFDB_INVALID_SAMPLE)
-		    p++;
-		xp = p->x;
-		xn = p - b;
-		if (nsamp <= canvas_width) xn *= tscale;
-		p->x = xn;
-		p->y += ybase;
-		draw_lines_relative(gtk_widget_get_window(wave_view), gc, p, q-p);
-		p->x = xp;
-		p->y -= ybase;
-	    }
-	    p = ++q;
+    if (pts_size < i1 - i0) {
+	pts_size = i1 - i0;
+	pts = g_renew(GdkPoint, pts, pts_size);
+    }
+    for (i = i0; i < i1; i = j) {
+	while (i < i1 && b[i] == WFDB_INVALID_SAMPLE)
+	    i++;
+	for (j = i, k = 0; j < i1 && b[j] != WFDB_INVALID_SAMPLE; j++, k++) {
+	    pts[k].x = xtab[j] - xoff;
+	    pts[k].y = b[j] + ybase;
 	}
-	else
-	    ++q;
+	if (k > 0)
+	    gdk_draw_lines(drawable, gc, pts, k);
     }
 }
 
-static void show_display_list(lp)
+/* Drawtrace() draws signal c of the current display list directly into the
+wave view, with the given base (see show_tiles(), below, for yshift). */
+
+static void drawtrace(c, ybase, gc)
+int c, ybase;
+GdkGC *gc;
+{
+    if (ybase == -9999) return;
+    draw_runs(wave_drawable, gc, lp_current->ylist[c], 0, lp_current->ndpts,
+	      abscissas(lp_current->start), 0, ybase + yshift[c]);
+}
+
+/* Signal tiles
+
+Panning the display by part of a screen would otherwise require every trace
+to be redrawn.  Instead, the traces are drawn in tiles TILE_WIDTH pixels wide,
+aligned to the record (tile k covers pixels k*TILE_WIDTH through
+(k+1)*TILE_WIDTH-1, where sample t is drawn at pixel (long)(t*tscale).)  Each
+tile is kept as a bitmap, which is painted into the signal layer using
+draw_sig.  Only tiles that lie entirely within the display list they were
+drawn from are kept, and not those nearest the edges of the screen (which are
+drawn each time):  the first and last columns of a compressed list contain
+only part of the samples that they would in another list, and the ordinate of
+each column depends on the extrema of the one before it (see
+select_extrema()), so tiles whose points depend on either of those columns
+are not kept.
+
+The tiles remain valid as long as the same traces are drawn from the same
+record at the same scales, bases and y-offsets.  While the display is panned
+(the new screen overlaps the previous one), the y-offsets of the first screen
+(the anchor) are kept, and the traces of each display list are shifted by the
+difference (yshift) between its own y-offsets and those of the anchor.  When
+the screens don't overlap, when any of the y-offsets chosen for the current
+screen (see set_trace_offset()) differs from the anchor's by more than a
+quarter of the spacing between traces, or when anything else changes, the
+tiles are discarded and the current screen becomes the anchor. */
+
+#define TILE_WIDTH 128
+#define TILES_PER_SCREEN ((canvas_width + TILE_WIDTH - 1)/TILE_WIDTH + 1)
+
+static GHashTable *tile_table;	/* tile bitmaps, indexed by tile number */
+static GQueue tile_lru = G_QUEUE_INIT;	/* tile numbers, most recent first */
+static GdkGC *tile_gc;
+
+static char *tile_record;	/* record, scales and traces of the tiles */
+static long tile_npoints, tile_start;
+static int tile_width, tile_height, tile_nsig;
+static double *tile_vscale;
+static int ntraces, *trace_sig, *trace_base, *tile_dy;
+
+static void free_tile(data)
+gpointer data;
+{
+    g_object_unref(data);
+}
+
+/* Find the traces to be drawn for display list lp, and their bases. */
+static void find_traces(lp)
 struct display_list *lp;
 {
-    int i, j, k, xn, xp, in_siglist();
-    GdkPoint *p, *q;
+    int i, j, nvsig;
 
-    lp_current = lp;
-    if (!lp) return;
+    trace_sig = g_renew(int, trace_sig, MAX(nsig, siglistlen) + 1);
+    trace_base = g_renew(int, trace_base, MAX(nsig, siglistlen) + 1);
+    ntraces = 0;
     if (sig_mode == 0)
 	for (i = 0; i < nsig; i++) {
-	    if (lp->vlist[i])
-		drawtrace(lp->vlist[i], lp->ndpts, base[i], draw_sig, 0);
+	    if (lp->ylist[i] && base[i] != -9999) {
+		trace_sig[ntraces] = i;
+		trace_base[ntraces++] = base[i];
+	    }
 	}
     else if (sig_mode == 1)
 	for (i = 0; i < siglistlen; i++) {
-	    if (0 <= siglist[i] && siglist[i] < nsig && lp->vlist[siglist[i]])
-		drawtrace(lp->vlist[siglist[i]], lp->ndpts,base[i],draw_sig,0);
+	    if (0 <= siglist[i] && siglist[i] < nsig && lp->ylist[siglist[i]]
+		&& base[i] != -9999) {
+		trace_sig[ntraces] = siglist[i];
+		trace_base[ntraces++] = base[i];
+	    }
 	}
     else {	/* sig_mode == 2 (show valid signals only) */
-	int j, nvsig;
 	for (i = nvsig = 0; i < nsig; i++)
-	    if (lp->vlist[i] && vvalid[i]) nvsig++;
+	    if (lp->ylist[i] && vvalid[i]) nvsig++;
 	for (i = j = 0; i < nsig; i++) {
-	    if (lp->vlist[i] && vvalid[i]) {
+	    if (lp->ylist[i] && vvalid[i]) {
 		base[i] = canvas_height*(2*(j++)+1.)/(2.*nvsig);
-		drawtrace(lp->vlist[i], lp->ndpts, base[i], draw_sig, 0);
+		trace_sig[ntraces] = i;
+		trace_base[ntraces++] = base[i];
 	    }
 	    else
 		base[i] = -9999;
 	}
     }
-    highlighted = -1;
 }
 
-void sig_highlight(i)
-int i;
+/* Return true if the current tiles can be used to show display list lp. */
+static int tiles_match(lp)
+struct display_list *lp;
 {
-    extern void repaint();
+    static int *osig, *obase, ontraces = -1;
+    int i, limit, match;
 
-    if (!lp_current) return;
-    if (0 <= highlighted && highlighted < lp_current->nsig) {
-	if (sig_mode != 1) {
-	    drawtrace(lp_current->vlist[highlighted], lp_current->ndpts,
-		      base[highlighted], unhighlight_sig, 1);
-	    drawtrace(lp_current->vlist[highlighted], lp_current->ndpts,
-		      base[highlighted], draw_sig, 1);
-	}
-	else {
-	    int j;
-	    for (j = 0; j < siglistlen; j++) {
-		if (siglist[j] == highlighted) {
-		    drawtrace(lp_current->vlist[highlighted],
-			      lp_current->ndpts, base[j], unhighlight_sig, 1);
-		    drawtrace(lp_current->vlist[highlighted],
-			      lp_current->ndpts, base[j], draw_sig, 1);
-		}
-	    }
-	}
+    match = (tile_table && tile_record && strcmp(tile_record, lp->record) == 0
+	     && tile_npoints == lp->npoints && tile_width == lp->width
+	     && tile_height == lp->height && tile_nsig == lp->nsig
+	     && memcmp(tile_vscale, lp->vscale, lp->nsig * sizeof(double)) == 0
+	     && lp->start < tile_start + lp->npoints
+	     && tile_start < lp->start + lp->npoints
+	     && ntraces == ontraces
+	     && memcmp(trace_sig, osig, ntraces * sizeof(int)) == 0
+	     && memcmp(trace_base, obase, ntraces * sizeof(int)) == 0);
+    limit = canvas_height / (4 * MAX(ntraces, 1));
+    for (i = 0; match && i < ntraces; i++)
+	if (ABS(lp->dy[trace_sig[i]] - tile_dy[trace_sig[i]]) > limit)
+	    match = 0;
+
+    g_free(osig);
+    g_free(obase);
+    osig = g_memdup(trace_sig, (ntraces + 1) * sizeof(int));
+    obase = g_memdup(trace_base, (ntraces + 1) * sizeof(int));
+    ontraces = ntraces;
+    return (match);
+}
+
+/* Discard the current tiles, and make display list lp the anchor. */
+static void reset_tiles(lp)
+struct display_list *lp;
+{
+    if (tile_table)
+	g_hash_table_remove_all(tile_table);
+    else
+	tile_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+					   NULL, free_tile);
+    g_queue_clear(&tile_lru);
+    g_free(tile_record);
+    g_free(tile_vscale);
+    g_free(tile_dy);
+    tile_record = g_strdup(lp->record);
+    tile_npoints = lp->npoints;
+    tile_width = lp->width;
+    tile_height = lp->height;
+    tile_nsig = lp->nsig;
+    tile_vscale = g_memdup(lp->vscale, lp->nsig * sizeof(double));
+    tile_dy = g_memdup(lp->dy, lp->nsig * sizeof(int));
+}
+
+/* Draw tile k of display list lp into a new bitmap.  Sx is the abscissa of
+the tile's left edge in the wave view. */
+static GdkPixmap *draw_tile(lp, k, sx)
+struct display_list *lp;
+long k;
+int sx;
+{
+    GdkPixmap *bm;
+    GdkGCValues values;
+    GdkColor pix;
+    int c, i0, i1, j, *xtab;
+
+    bm = gdk_pixmap_new(gtk_widget_get_window(wave_view), TILE_WIDTH,
+			MAX(canvas_height, 1), 1);
+    if (!tile_gc) {
+	tile_gc = gdk_gc_new(bm);
+	gdk_gc_get_values(draw_sig, &values);
+	gdk_gc_set_line_attributes(tile_gc, values.line_width,
+				   GDK_LINE_SOLID, GDK_CAP_BUTT,
+				   GDK_JOIN_MITER);
     }
-    highlighted = i;
-    if (0 <= highlighted && highlighted < lp_current->nsig) {
-	if (sig_mode != 1) {
-	    drawtrace(lp_current->vlist[highlighted], lp_current->ndpts,
-		      base[highlighted], clear_sig, 1);
-	    drawtrace(lp_current->vlist[highlighted], lp_current->ndpts,
-		      base[highlighted], highlight_sig, 1);
-	}
-	else {
-	    int j;
-	    for (j = 0; j < siglistlen; j++) {
-		if (siglist[j] == highlighted) {
-		    drawtrace(lp_current->vlist[highlighted],
-			      lp_current->ndpts, base[j], clear_sig, 1);
-		    drawtrace(lp_current->vlist[highlighted],
-			      lp_current->ndpts, base[j], highlight_sig, 1);
-		}
+    pix.pixel = 0;
+    gdk_gc_set_foreground(tile_gc, &pix);
+    gdk_draw_rectangle(bm, tile_gc, TRUE, 0, 0, TILE_WIDTH, canvas_height);
+    pix.pixel = 1;
+    gdk_gc_set_foreground(tile_gc, &pix);
+
+    /* Draw the points within the tile, and one on either side. */
+    xtab = abscissas(lp->start);
+    for (i0 = 0; i0 < lp->ndpts && xtab[i0] < sx; i0++)
+	;
+    for (i1 = i0; i1 < lp->ndpts && xtab[i1] < sx + TILE_WIDTH; i1++)
+	;
+    if (i0 > 0) i0--;
+    if (i1 < lp->ndpts) i1++;
+    for (j = 0; j < ntraces; j++) {
+	c = trace_sig[j];
+	draw_runs(bm, tile_gc, lp->ylist[c], i0, i1, xtab, sx,
+		  trace_base[j] + yshift[c]);
+    }
+    return (bm);
+}
+
+/* Show_tiles() paints the traces of display list lp into the wave view,
+drawing only those tiles that aren't already available. */
+static void show_tiles(lp)
+struct display_list *lp;
+{
+    GdkPixmap *bm;
+    GList *l;
+    long g0, k, k0, k1;
+    int c, keep, sx, *xtab;
+
+    if (!tiles_match(lp))
+	reset_tiles(lp);
+    tile_start = lp->start;
+    yshift = g_renew(int, yshift, lp->nsig);
+    for (c = 0; c < lp->nsig; c++)
+	yshift[c] = tile_dy[c] - lp->dy[c];
+
+    xtab = abscissas(lp->start);
+    g0 = (long)(lp->start * tscale);
+    k0 = g0 / TILE_WIDTH;
+    k1 = (g0 + canvas_width - 1) / TILE_WIDTH;
+    for (k = k0; k <= k1; k++) {
+	sx = k * TILE_WIDTH - g0;
+	keep = (sx > 2 && lp->ndpts > 0 &&
+		xtab[lp->ndpts - 1] > sx + TILE_WIDTH);
+	if (!keep || !(bm = g_hash_table_lookup(tile_table,
+						GINT_TO_POINTER(k)))) {
+	    bm = draw_tile(lp, k, sx);
+	    if (keep) {
+		g_hash_table_insert(tile_table, GINT_TO_POINTER(k), bm);
+		g_queue_push_head(&tile_lru, GINT_TO_POINTER(k));
 	    }
 	}
+	else if ((l = g_queue_find(&tile_lru, GINT_TO_POINTER(k)))) {
+	    g_queue_unlink(&tile_lru, l);
+	    g_queue_push_head_link(&tile_lru, l);
+	}
+
+	gdk_gc_set_clip_mask(draw_sig, bm);
+	gdk_gc_set_clip_origin(draw_sig, sx, 0);
+	gdk_draw_rectangle(wave_drawable, draw_sig, TRUE, sx, 0,
+			   MIN(TILE_WIDTH, canvas_width - sx), canvas_height);
+	if (!keep)
+	    g_object_unref(bm);
     }
+    gdk_gc_set_clip_mask(draw_sig, NULL);
+    gdk_gc_set_clip_origin(draw_sig, 0, 0);
+
+    /* Keep the tiles for a few screens on either side. */
+    while (g_queue_get_length(&tile_lru) > 4 * TILES_PER_SCREEN)
+	g_hash_table_remove(tile_table, g_queue_pop_tail(&tile_lru));
+}
+
+/* Show_display_list() plots the display list pointed to by its argument. */
+
+static void show_display_list(lp)
+struct display_list *lp;
+{
+    lp_current = lp;
+    if (!lp) return;
+    find_traces(lp);
+    show_tiles(lp);
+    highlighted = -1;
+}
+
+/* Sig_highlight() highlights trace i (or none, if i is out of range).  The
+highlighted trace is drawn over the signal layer by show_overlay_layer(), so
+that changing it requires no other redrawing. */
+
+void sig_highlight(i)
+int i;
+{
+    if (!lp_current) return;
+    highlighted = i;
+    wave_view_redraw_overlay();
 }
 
 /* Do_disp() executes a display request.  The display will show nsamp samples
-of nsig signals, starting at display_start_time. */
+of nsig signals, starting at display_start_time.  It is drawn in two layers
+(see repaint() in wave_widget.c): show_signal_layer() draws the grid and the
+signals, and show_overlay_layer() draws the times, the annotations and the
+highlighted signal over them. */
 
 void do_disp()
 {
-    char *tp;
-    int c, i, x0, x1, y0;
+    show_signal_layer();
+    show_overlay_layer();
+}
+
+void show_signal_layer()
+{
     struct display_list *lp;
 
     /* This might take a while ... */
@@ -193,131 +401,520 @@ void do_disp()
     /* Make sure that the requested time is reasonable. */
     if (display_start_time < 0) display_start_time = 0;
 
+    /* Get a display list for the requested screen, and show it. */
+    lp = find_display_list(display_start_time);
+    show_display_list(lp);
+
+    /* If requested, show the signal names. */
+    if (show_signame) show_signal_names();
+
+    /* If requested, show the signal baselines. */
+    if (show_baseline) show_signal_baselines(lp);
+
+    /*xv_set(frame, FRAME_BUSY, FALSE, NULL);*/
+}
+
+void show_overlay_layer()
+{
+    char *tp;
+    int j, x0, x1, y0;
+
     /* Update the panel items that indicate the start and end times. */
     tp = wtimstr(display_start_time);
     /*set_start_time(tp);*/
     while (*tp == ' ') tp++;
     y0 = canvas_height - mmy(2);
     x0 = mmx(2);
-    wave_draw_string(gtk_widget_get_window(wave_view),
+    wave_draw_string(wave_drawable,
 		     time_mode == 1 ? draw_ann : draw_sig,
 		     x0, y0, tp, strlen(tp));
     tp = wtimstr(display_start_time + nsamp);
     /*set_end_time(tp);*/
     while (*tp == ' ') tp++;
     x1 = canvas_width - wave_text_width(tp, strlen(tp)) - mmx(2);
-    wave_draw_string(gtk_widget_get_window(wave_view),
+    wave_draw_string(wave_drawable,
 		     time_mode == 1 ? draw_ann : draw_sig,
 		     x1, y0, tp, strlen(tp));
 
     /* Show the annotations, if available. */
     show_annotations(display_start_time, nsamp);
 
-    /* Get a display list for the requested screen, and show it. */
-    lp = find_display_list(display_start_time);
-    show_display_list(lp);
+    /* Show the highlighted signal, if any. */
+    if (lp_current && 0 <= highlighted && highlighted < lp_current->nsig) {
+	if (sig_mode != 1)
+	    drawtrace(highlighted, base[highlighted], highlight_sig);
+	else
+	    for (j = 0; j < siglistlen; j++)
+		if (siglist[j] == highlighted)
+		    drawtrace(highlighted, base[j], highlight_sig);
+    }
+}
 
-    /* If requested, show the signal names. */
-    if (show_signame) show_signal_names();
+/* The display list cache
 
-    /* If requested, show the signal baselines. */
-    if (show_baseline) show_signal_baselines(lp);
+Display lists are indexed (in list_table) by the record name, starting time,
+screen duration, canvas size and amplitude scales, so that a list made before
+switching to another record, or before changing the gain, remains valid and
+can be found again later.  The lists are also kept in order of use, from
+first_list (most recently used) to last_list; when the total size of the
+lists exceeds the limit set by the Wave.DisplayCacheSize resource (in
+kilobytes), the least recently used lists are discarded.  The list currently
+shown (lp_current), and the one most recently made (which may be about to be
+shown), are never discarded.
 
-    /*xv_set(frame, FRAME_BUSY, FALSE, NULL);*/
+Column extrema (see sample_columns(), below) take more room than the
+ordinates themselves, so they are kept only in the most recently made list
+that has them (extrema_list), and counted in its size while they are kept. */
+
+static GHashTable *list_table;
+static struct display_list *last_list, *extrema_list;
+static size_t cache_size, cache_limit;
+
+static guint display_list_hash(key)
+gconstpointer key;
+{
+    const struct display_list *lp = key;
+    guint h;
+
+    h = g_str_hash(lp->record);
+    h = h * 31 + (guint) lp->start;
+    h = h * 31 + (guint) lp->npoints;
+    h = h * 31 + (guint) lp->width;
+    h = h * 31 + (guint) lp->height;
+    return (h);
 }
 
-static int nlists;
-static int vlist_size;
-
-/* Get_display_list() obtains storage for display lists from the heap (via
-malloc) or by recycling a display list in the cache.  Since the screen duration
-(nsamp) does not change frequently, get_display_list() calculates the pixel
-abscissas when a new display list is obtained from the heap, and recalculates
-them only when nsamp has been changed. */
-
-static struct display_list *get_display_list()
-{
-    int i, maxx, x;
-    static int max_nlists = MAX_DISPLAY_LISTS;
-    struct display_list *lp = NULL, *lpl;
-
-    if (nlists < max_nlists &&
-	(lp = (struct display_list *)calloc(1, sizeof(struct display_list))))
-	    nlists++;
-    if (lp == NULL)
-	switch (nlists) {
-	    case 0: return (NULL);
-	    case 1: lp = first_list; break;
-	    default: lpl = first_list; lp = lpl->next;
-		while (lp->next) {
-		    lpl = lp;
-		    lp = lp->next;
-		}
-		lpl->next = NULL;
-		break;
+static gboolean display_list_equal(key1, key2)
+gconstpointer key1, key2;
+{
+    const struct display_list *a = key1, *b = key2;
+
+    return (a->start == b->start && a->npoints == b->npoints &&
+	    a->width == b->width && a->height == b->height &&
+	    a->nsig == b->nsig && strcmp(a->record, b->record) == 0 &&
+	    memcmp(a->vscale, b->vscale, a->nsig * sizeof(double)) == 0);
+}
+
+static void unlink_display_list(lp)
+struct display_list *lp;
+{
+    if (lp->prev) lp->prev->next = lp->next;
+    else first_list = lp->next;
+    if (lp->next) lp->next->prev = lp->prev;
+    else last_list = lp->prev;
+    lp->next = lp->prev = NULL;
+}
+
+static void link_display_list(lp)
+struct display_list *lp;
+{
+    lp->prev = NULL;
+    lp->next = first_list;
+    if (first_list) first_list->prev = lp;
+    else last_list = lp;
+    first_list = lp;
+}
+
+static void free_display_list(lp)
+struct display_list *lp;
+{
+    if (lp == extrema_list) extrema_list = NULL;
+    g_free(lp->ylist[0]);
+    g_free(lp->ylist);
+    g_free(lp->cmin);
+    g_free(lp->cmax);
+    g_free(lp->sb);
+    g_free(lp->dy);
+    g_free(lp->vscale);
+    g_free(lp->record);
+    g_free(lp);
+}
+
+/* Discard least recently used display lists until the cache holds no more
+   than limit bytes. */
+static void trim_cache(limit)
+size_t limit;
+{
+    struct display_list *lp, *lpp;
+
+    for (lp = last_list; lp && cache_size > limit; lp = lpp) {
+	lpp = lp->prev;
+	if (lp == lp_current || lp == first_list) continue;
+	g_hash_table_remove(list_table, lp);
+	unlink_display_list(lp);
+	cache_size -= lp->size;
+	free_display_list(lp);
+    }
+}
+
+/* Get_display_list() obtains storage for a display list beginning at time t,
+and enters it in the cache.  Since the abscissas depend only on nsamp and the
+canvas width, they are not stored in the list (see abscissas(), above). */
+
+static struct display_list *get_display_list(t)
+long t;
+{
+    int i, len;
+    struct display_list *lp;
+
+    if (list_table == NULL) {
+	list_table = g_hash_table_new(display_list_hash, display_list_equal);
+	cache_limit = (size_t) defaults_get_integer("wave.displaycachesize",
+						    "Wave.DisplayCacheSize",
+						    DEF_DISPLAY_CACHE_SIZE) * 1024;
+    }
+
+    len = (canvas_width > 0) ? canvas_width : 1;
+    lp = g_new0(struct display_list, 1);
+    lp->record = g_strdup(record_key);
+    lp->start = t;
+    lp->nsig = nsig;
+    lp->npoints = nsamp;
+    lp->width = canvas_width;
+    lp->height = canvas_height;
+    lp->vscale = g_memdup(vscale, nsig * sizeof(double));
+    lp->sb = g_new0(int, nsig);
+    lp->dy = g_new0(int, nsig);
+    lp->ylist = g_new(gint16 *, nsig);
+    lp->ylist[0] = g_new0(gint16, nsig * len);
+    for (i = 1; i < nsig; i++)
+	lp->ylist[i] = lp->ylist[0] + i * len;
+    lp->size = sizeof(struct display_list) + strlen(record_key) + 1 +
+	nsig * (sizeof(double) + 2 * sizeof(int) + sizeof(gint16 *) +
+		len * sizeof(gint16));
+    lp->xmax = (nsamp > canvas_width) ? canvas_width - 1 : nsamp - 1;
+
+    trim_cache(cache_limit > lp->size ? cache_limit - lp->size : 0);
+    link_display_list(lp);
+    g_hash_table_insert(list_table, lp, lp);
+    cache_size += lp->size;
+    return (lp);
+}
+
+/* Set_trace_offset() sets the y-offset for signal c of a display list so
+that the signal will be vertically centered about the nominal baseline if the
+midrange is near the mean, and stores the offset ordinates in the list.  Its
+arguments are the unscaled ordinates (tp) and their number, and the sum,
+count, minimum and maximum of the valid ordinates (see trace_stats(),
+below). */
+
+static void set_trace_offset(lp, c, tp, npts, ymean, n, ymin, ymax)
+struct display_list *lp;
+int c, *tp, npts, n, ymin, ymax;
+long ymean;
+{
+    int dy;		/* the y-offset */
+    int j;
+    int ymid;		/* the midpoint of the ordinate range */
+    double w;		/* weight assigned to ymean in y-offset calculation */
+    int y;
+    gint16 *yp = lp->ylist[c];
+
+    /* The y-offset is actually a weighted sum of the midrange and the mean,
+       which favors the mean if the two values differ significantly. */
+    ymean /= n;
+    ymid = (ymax + ymin)/2;
+    /* Since ymin <= ymid <= ymax, the next lines imply 0 <= w <= 1 */
+    if (ymid > ymean) /* in this case, ymax must be > ymean */
+	w = (ymid - ymean)/(ymax - ymean);
+    else if (ymid < ymean) /* in this case, ymin must be < ymean */
+	w = (ymean - ymid)/(ymean - ymin);
+    else w = 1.0;
+    dy = -(ymid + ((double)ymean-ymid)*w);
+    for (j = 0; j < npts; j++) {
+	if (tp[j] == WFDB_INVALID_SAMPLE) {
+	    yp[j] = WFDB_INVALID_SAMPLE;
+	    continue;
 	}
-    if (lp->nsig < nsig) {
-	lp->sb = realloc(lp->sb, nsig * sizeof(int));
-	lp->vlist = realloc(lp->vlist, nsig * sizeof(GdkPoint *));
-	for (i = lp->nsig; i < nsig; i++) {
-	    lp->sb[i] = 0;
-	    lp->vlist[i] = NULL;
+	/* The bounds-checking below shouldn't be necessary (the X server
+	   should clip at the canvas boundaries), but Sun's X11/NeWS
+	   server will crash (and may bring the system down with it) if
+	   run on a system with the GX accelerator and if passed
+	   sufficiently out-of-bounds ordinates (maybe abscissas, too --
+	   this hasn't been tested).  This bug is present in both the
+	   original X11/NeWS server and the GFX revision.  It appears that
+	   the bug can be avoided if the maximum distance from the window
+	   edge to the out-of-bounds ordinate is less than about 2000
+	   pixels (although this may be dependent on the window height).
+	   This bug has not been observed with other X servers. */
+	if ((y = tp[j] + dy) < -canvas_height) y = -canvas_height;
+	else if  (y > canvas_height) y = canvas_height;
+	yp[j] = y;
+    }
+    lp->dy[c] = dy;
+    if (dc_coupled[c]) lp->sb[c] = sigbase[c]*vscale[c] + dy;
+}
+
+/* Trace_stats() finds the sum, count, minimum and maximum of the valid
+ordinates in a trace.  For historical reasons, the first valid ordinate is
+counted twice in the sum and the count. */
+
+static void trace_stats(tp, npts, pmean, pn, pmin, pmax)
+int *tp, npts, *pn, *pmin, *pmax;
+long *pmean;
+{
+    int j, n, y, ymin, ymax;
+    long ymean;
+
+    /* Find the first valid sample in the trace, if any. */
+    for (j = 0; j < npts && tp[j] == WFDB_INVALID_SAMPLE; j++)
+	;
+    ymean = ymax = ymin = (j < npts) ? tp[j] : 0;
+    for (n = 1; j < npts; j++) {
+	if ((y = tp[j]) != WFDB_INVALID_SAMPLE) {
+	    if (y > ymax) ymax = y;
+	    else if (y < ymin) ymin = y;
+	    ymean += y;
+	    n++;
 	}
-	lp->nsig = nsig;
     }
+    *pmean = ymean;
+    *pn = n;
+    *pmin = ymin;
+    *pmax = ymax;
+}
 
-    if (canvas_width > vlist_size) vlist_size = canvas_width;
+/* Work_ordinates() returns a buffer for the unscaled ordinates of a display
+list while it is being made, with room for len ordinates of each signal. */
 
-    for (i = 0; i < nsig; i++) {
-	if (lp->vlist[i] == NULL) {
-	    if ((lp->vlist[i] =
-		 (GdkPoint *)calloc(vlist_size, sizeof(GdkPoint)))==NULL) {
-		while (--i >= 0)
-		    free(lp->vlist[i]);
-		free(lp);
-		max_nlists = --nlists;
-		return (get_display_list());
+static int *work_ordinates(len)
+int len;
+{
+    static int *yw, yw_size;
+
+    if (yw_size < nsig * len) {
+	yw_size = nsig * len;
+	yw = g_renew(int, yw, yw_size);
+    }
+    return (yw);
+}
+
+/* Select_extrema() fills in the ordinates (yw, with len ordinates per
+signal) of columns 0 through ncols-1 of a compressed display list, given the
+extrema of each signal in each column (indexed by [signal*canvas_width +
+column]; a column with no valid samples has min > max.)  Of the two extrema,
+the one farther from the midrange of the previous column (or of the column
+itself, if the previous one has no valid samples) is chosen.  Since the
+columns are aligned to the record, the ordinate of each column but the first
+thus depends only on its position in the record, and not on the time at
+which the screen begins (see show_tiles()).  The statistics needed by
+set_trace_offset() are accumulated at the same time, so that the ordinates
+need not be scanned again. */
+
+static void select_extrema(lp, yw, len, ncols, cmin, cmax)
+struct display_list *lp;
+int *yw, len, ncols;
+WFDB_Sample *cmin, *cmax;
+{
+    int c, found, n, x, y, ymin, ymax, *tp;
+    long ymean;
+    WFDB_Sample hi, lo, ref, *mn, *mx;
+
+    for (c = 0; c < nsig; c++) {
+	tp = yw + c*len;
+	mn = cmin + c*canvas_width;
+	mx = cmax + c*canvas_width;
+	ymean = ymin = ymax = 0;
+	n = 1;
+	found = 0;
+	for (x = 0; x < ncols; x++) {
+	    lo = mn[x];
+	    hi = mx[x];
+	    if (lo > hi || sigslot[c] < 0) {
+		tp[x] = -1 << 15;
+		continue;
 	    }
-	}
-	
-	/* If there are more samples to be shown than addressable x-pixels
-	   in the window, the abscissas are simply the integers from 0 to
-	   the canvas width (and some compression will be needed).  If the
-	   largest abscissa is correct, all of the others must also be correct,
-	   and they need not be reset. */
-	if (nsamp > canvas_width) {
-	    x = maxx = canvas_width - 1;
-	    if (lp->vlist[i][x].x != x) {
-		int xx;
-
-		lp->vlist[i][0].x = 0;	/* absolute first abscissa */
-		for (xx = 1; xx <= x; xx++)
-		    lp->vlist[i][xx].x = 1;	/* relative to previous */
+	    if (x > 0 && mn[x-1] <= mx[x-1])
+		ref = mn[x-1] + (mx[x-1] - mn[x-1])/2;
+	    else
+		ref = lo + (hi - lo)/2;
+	    y = tp[x] = ((hi - ref > ref - lo) ? hi : lo)*vscale[c];
+	    if (!found) {
+		ymean = ymin = ymax = y;
+		found = 1;
 	    }
+	    if (y > ymax) ymax = y;
+	    else if (y < ymin) ymin = y;
+	    ymean += y;
+	    n++;
 	}
+	vvalid[c] = found;
+	set_trace_offset(lp, c, tp, ncols, ymean, n, ymin, ymax);
+    }
+}
 
-	/* Otherwise, no compression is needed, and the abscissas must be
-	   distributed across the window (at intervals > 1 pixel).  Again,
-	   if the largest abscissa is correct, all of the others must also
-	   be correct, and no computation is needed. */
-	else {
-	    x = maxx = nsamp - 1;
-	    if (lp->vlist[i][vlist_size-1].x != (int)(x*tscale)) {
-		int xp, xpp;
-
-		lp->vlist[i][0].x = xp = 0;    /* absolute first abscissa */
-		for (x = 1; x < vlist_size; x++) {
-		    xpp = xp;
-		    xp = x*tscale;
-		    lp->vlist[i][x].x = xp - xpp;	/* relative to prev */
-		}
-	    }
+/* Read_columns() merges the extrema of samples jump[xa] through jump[xb]-1
+of a compressed display list into the list's column extrema (see decim.c).  If
+the samples are in the sample cache (sdata is not NULL; see get_samples() in
+sigcache.c), they are taken from there; otherwise they are read (from the
+mapped signal files if possible; see sigmap.c) in blocks of DECIM_BLOCK
+samples, with each signal stored contiguously.  Signals that are
+not read (see select_signals() in init.c) are skipped.  It returns the index
+of the first sample not read (less than jump[xb] at the end of the
+record). */
+
+#define DECIM_BLOCK 4096
+
+static long read_columns(lp, jump, ncols, xa, xb, sdata, stride, navail)
+struct display_list *lp;
+long *jump, stride, navail;
+int ncols, xa, xb;
+WFDB_Sample *sdata;
+{
+    static WFDB_Sample *planes;
+    static int planes_nsig;
+    long i, ia = jump[xa], ib = jump[xb], n;
+    int c, mapped;
+
+    if (sdata) {
+	if (ib > navail) ib = navail;
+	if (ia < ib)
+	    for (c = 0; c < nsig; c++)
+		if (sigslot[c] >= 0)
+		    decim_block(sdata + sigslot[c]*stride + ia, stride, 1,
+				ia, ib - ia, jump, ncols, canvas_width,
+				lp->cmin + c*canvas_width,
+				lp->cmax + c*canvas_width);
+	return (ib);
+    }
+
+    if (planes_nsig < nsigread) {
+	planes_nsig = nsigread;
+	planes = g_renew(WFDB_Sample, planes, planes_nsig * DECIM_BLOCK);
+    }
+    mapped = (read_mapped_samples(lp->start + ia, 0, sigslot, planes,
+				  DECIM_BLOCK) >= 0);
+    if (!mapped && lp->start + ia != strtim("i") &&
+	isigsettime(lp->start + ia) < 0)
+	return (ia);
+    for (i = ia; i < ib; i += n) {
+	if (mapped &&
+	    (n = read_mapped_samples(lp->start + i, MIN(DECIM_BLOCK, ib - i),
+				     sigslot, planes, DECIM_BLOCK)) < 0) {
+	    /* A remote signal file couldn't be read; continue with
+	       getvec(). */
+	    mapped = 0;
+	    if (isigsettime(lp->start + i) < 0)
+		break;
+	}
+	if (!mapped)
+	    for (n = 0; n < DECIM_BLOCK && i + n < ib && getvec(v) > 0; n++)
+		for (c = 0; c < nsig; c++)
+		    if (sigslot[c] >= 0)
+			planes[sigslot[c]*DECIM_BLOCK + n] = v[c];
+	for (c = 0; c < nsig; c++)
+	    if (sigslot[c] >= 0)
+		decim_block(planes + sigslot[c]*DECIM_BLOCK, DECIM_BLOCK, 1,
+			    i, n, jump, ncols, canvas_width,
+			    lp->cmin + c*canvas_width,
+			    lp->cmax + c*canvas_width);
+	if (n < DECIM_BLOCK && i + n < ib) {
+	    i += n;
+	    break;
 	}
     }
-    lp->next = first_list;
-    lp->npoints = nsamp;
-    lp->xmax = maxx;
-    return (first_list = lp);
+    return (i);
+}
+
+/* Overlapping_list() returns the list whose column extrema are kept
+(extrema_list), if it was made from the samples of the same record and
+signals at the same time scale as lp, and overlaps lp; or NULL otherwise.
+The amplitude scales need not match, since the extrema are kept in sample
+units. */
+
+static struct display_list *overlapping_list(lp)
+struct display_list *lp;
+{
+    struct display_list *op = extrema_list;
+
+    if (op && op != lp && op->nsig == lp->nsig &&
+	op->npoints == lp->npoints && op->width == lp->width &&
+	op->start < lp->start + lp->npoints &&
+	lp->start < op->start + op->npoints &&
+	strcmp(op->record, lp->record) == 0)
+	return (op);
+    return (NULL);
+}
+
+/* Drop_extrema() discards the column extrema kept in display list lp. */
+
+static void drop_extrema(lp)
+struct display_list *lp;
+{
+    size_t n = 2 * lp->nsig * lp->width * sizeof(WFDB_Sample);
+
+    g_free(lp->cmin);
+    g_free(lp->cmax);
+    lp->cmin = lp->cmax = NULL;
+    lp->size -= n;
+    cache_size -= n;
+    if (lp == extrema_list) extrema_list = NULL;
+}
+
+/* Sample_columns() finds the extrema of each signal in each column of a
+compressed display list from the samples themselves, and keeps them in the
+list.  Since columns are aligned to the record (see decim_columns()), a column
+lying entirely within an overlapping list (other than the partial columns at
+either end) contains the same samples in both, and its extrema are simply
+copied; after scrolling or recentering by less than a screen, only the newly
+exposed samples need be read.  The extrema of the previous list are then
+discarded, and the cache is trimmed to allow for those of lp.  It returns the
+number of columns for which all samples were available. */
+
+static int sample_columns(lp, sdata, stride, navail)
+struct display_list *lp;
+WFDB_Sample *sdata;
+long stride, navail;
+{
+    int c, dx, ncols, x, x1, x2;
+    long i, *jump;
+    size_t n = nsig * canvas_width;
+    struct display_list *op;
+
+    ncols = decim_columns(lp->start, nsamp, tscale, canvas_width, &jump);
+
+    lp->cmin = g_new(WFDB_Sample, n);
+    lp->cmax = g_new(WFDB_Sample, n);
+    lp->size += 2 * n * sizeof(WFDB_Sample);
+    cache_size += 2 * n * sizeof(WFDB_Sample);
+    for (i = 0; i < n; i++) {
+	lp->cmin[i] = INT_MAX;
+	lp->cmax[i] = INT_MIN;
+    }
+
+    /* Copy columns x1 through x2-1 from an overlapping list, if any.
+       Column x of lp is column x+dx of op. */
+    x1 = x2 = ncols;
+    if ((op = overlapping_list(lp)) != NULL) {
+	dx = (long) (lp->start * tscale) - (long) (op->start * tscale);
+	x1 = MAX(1, 1 - dx);
+	x2 = MIN(ncols - 1, op->ndpts - 1 - dx);
+	if (x1 < x2)
+	    for (c = 0; c < nsig; c++) {
+		memcpy(lp->cmin + c*canvas_width + x1,
+		       op->cmin + c*canvas_width + x1 + dx,
+		       (x2 - x1) * sizeof(WFDB_Sample));
+		memcpy(lp->cmax + c*canvas_width + x1,
+		       op->cmax + c*canvas_width + x1 + dx,
+		       (x2 - x1) * sizeof(WFDB_Sample));
+	    }
+	else
+	    x1 = x2 = ncols;
+    }
+
+    /* Read the samples in the remaining columns. */
+    i = read_columns(lp, jump, ncols, 0, x1, sdata, stride, navail);
+    if (i == jump[x1] && x2 < ncols)
+	i = read_columns(lp, jump, ncols, x2, ncols, sdata, stride, navail);
+
+    if (extrema_list)
+	drop_extrema(extrema_list);
+    extrema_list = lp;
+    trim_cache(cache_limit);
+
+    for (x = 0; x < ncols && jump[x+1] <= i; x++)
+	;
+    return (x);
 }
 
 /* Find_display_list() obtains a display list beginning at the sample number
@@ -329,165 +926,152 @@ vertices of the polylines for each signal. */
 struct display_list *find_display_list(fdl_time)
 long fdl_time;
 {
-    int c, i, j, x, x0, y, ymax, ymin;
-    struct display_list *lp;
-    GdkPoint *tp;
+    int c, i, len, n, ymax, ymin, *tp, *yw;
+    long ymean;
+    long navail, stride;
+    struct display_list key, *lp;
+    WFDB_Sample *cmin, *cmax, *sdata, *sp;
 
     if (fdl_time < 0L) fdl_time = -fdl_time;
     /* If the requested display list is in the cache, return it at once. */
-    for (lp = first_list; lp; lp = lp->next)
-	if (lp->start == fdl_time && lp->npoints == nsamp) return (lp);
-
-    /* Give up if we can't skip to the requested segment, or if we
-       can't read at least one sample. */
-    if ((fdl_time != strtim("i") && isigsettime(fdl_time) < 0) ||
-	getvec(v0) < 0)
-	    return (NULL);
-
-    /* Allocate a new display list; give up if we can't do so.  Note
-       that once the structure has been allocated, we must fill it in
-       with valid data. */
-    if ((lp = get_display_list()) == NULL)
+    if (list_table) {
+	key.record = record_key;
+	key.start = fdl_time;
+	key.nsig = nsig;
+	key.npoints = nsamp;
+	key.width = canvas_width;
+	key.height = canvas_height;
+	key.vscale = vscale;
+	if ((lp = g_hash_table_lookup(list_table, &key))) {
+	    unlink_display_list(lp);
+	    link_display_list(lp);
+	    return (lp);
+	}
+    }
+
+    /* Unless the screen is to be drawn from the min/max summaries, look for
+       the samples in the sample cache (see sigcache.c), which will read them
+       if necessary.  Otherwise, give up if we can't skip to the requested
+       segment, or if we can't read at least one sample. */
+    sdata = NULL;
+    if ((nsamp <= canvas_width || !pyramid_usable(nsamp, canvas_width)) &&
+	(navail = get_samples(fdl_time, nsamp, &sdata, &stride)) > 0) {
+	for (c = 0; c < nsig; c++)
+	    v0[c] = (sigslot[c] >= 0) ? sdata[sigslot[c]*stride] :
+		WFDB_INVALID_SAMPLE;
+    }
+    else if ((fdl_time != strtim("i") && isigsettime(fdl_time) < 0) ||
+	     getvec(v0) < 0)
 	return (NULL);
+    else
+	for (c = 0; c < nsig; c++)
+	    if (sigslot[c] < 0)
+		v0[c] = WFDB_INVALID_SAMPLE;
 
-    /* Record the starting time. */
-    lp->start = fdl_time;
+    /* Allocate a new display list.  Note that once the structure has been
+       allocated, we must fill it in with valid data. */
+    lp = get_display_list(fdl_time);
+    len = (canvas_width > 0) ? canvas_width : 1;
+    yw = work_ordinates(len);
 
     /* Set the starting point for each signal. */
     for (c = 0; c < nsig; c++) {
 	vmin[c] = vmax[c] = v0[c];
 	vvalid[c] = 0;
 	if (v0[c] == WFDB_INVALID_SAMPLE)
-	    lp->vlist[c][0].y = -1 << 15;
+	    yw[c*len] = -1 << 15;
 	else
-	    lp->vlist[c][0].y = v0[c]*vscale[c];
+	    yw[c*len] = v0[c]*vscale[c];
     }
 
     /* If there are more than canvas_width samples to be shown, compress the
-       data. */
+       data.  The columns are aligned to the record (see decim_columns()),
+       and their extrema are found from the min/max summaries of the record
+       if there are many samples per column (see pyramid.c), or
+       otherwise from the samples, reusing those of an overlapping list where
+       possible (see sample_columns(), above).  Select_extrema() then chooses
+       the ordinates and sets the y-offsets. */
     if (nsamp > canvas_width) {
-	for (i = 1, x0 = 0; i < nsamp && getvec(v) > 0; i++) {
-	    for (c = 0, vvalid[c] = 0; c < nsig; c++) {
-		if (v[c] != WFDB_INVALID_SAMPLE) {
-		    if (v[c] > vmax[c]) vmax[c] = v[c];
-		    if (v[c] < vmin[c]) vmin[c] = v[c];
-		    vvalid[c] = 1;
+	if (!sdata && (i = pyramid_columns(fdl_time, nsamp, canvas_width,
+					   tscale, &cmin, &cmax)) > 0)
+	    select_extrema(lp, yw, len, i, cmin, cmax);
+	else {
+	    i = sample_columns(lp, sdata, stride, navail);
+	    select_extrema(lp, yw, len, i, lp->cmin, lp->cmax);
+	}
+    }
+    /* If there are canvas_width or fewer samples to be shown, no compression
+       is necessary. */
+    else {
+	if (sdata) {
+	    for (c = 0; c < nsig; c++) {
+		tp = yw + c*len;
+		if (sigslot[c] < 0) {
+		    for (i = 1; i < navail; i++)
+			tp[i] = -1 << 15;
+		    continue;
 		}
-	    }
-	    if ((x = i*tscale) > x0) {
-		x0 = x;
-		for (c = 0; c < nsig; c++) {
-		    if (vvalid[c]) {
-			if (vmax[c] - v0[c] > v0[c] - vmin[c])
-			    v0[c] = vmin[c] = vmax[c];
-			else
-			    v0[c] = vmax[c] = vmin[c];
-			lp->vlist[c][x0].y = v0[c]*vscale[c];
+		sp = sdata + sigslot[c]*stride;
+		for (i = 1; i < navail; i++) {
+		    if (sp[i] == WFDB_INVALID_SAMPLE)
+			tp[i] = -1 << 15;
+		    else {
+			tp[i] = sp[i]*vscale[c];
+			vvalid[c] = 1;
 		    }
-		    else
-			lp->vlist[c][x0].y = -1 << 15;
 		}
 	    }
+	    i = navail;
 	}
-	i = x0+1;
-    }
-    /* If there are canvas_width or fewer samples to be shown, no compression
-       is necessary. */
-    else
-	for (i = 1; i < nsamp && getvec(v) > 0; i++)
+	else for (i = 1; i < nsamp && getvec(v) > 0; i++)
 	    for (c = 0; c < nsig; c++) {
-		if (v[c] == WFDB_INVALID_SAMPLE)
-		    lp->vlist[c][i].y = -1 << 15;
-		else
-		    lp->vlist[c][i].y = v[c]*vscale[c];
+		if (sigslot[c] < 0 || v[c] == WFDB_INVALID_SAMPLE)
+		    yw[c*len + i] = -1 << 15;
+		else {
+		    yw[c*len + i] = v[c]*vscale[c];
+		    vvalid[c] = 1;
+		}
 	    }
+	for (c = 0; c < nsig; c++) {
+	    if (v0[c] != WFDB_INVALID_SAMPLE) vvalid[c] = 1;
+	    trace_stats(yw + c*len, i, &ymean, &n, &ymin, &ymax);
+	    set_trace_offset(lp, c, yw + c*len, i, ymean, n, ymin, ymax);
+	}
+    }
 
     /* Record the number of displayed points.  This may be less than
        expected at the end of the record. */
     lp->ndpts = i;
-
-    /* Set the y-offset so that the signal will be vertically centered about
-       the nominal baseline if the midrange is near the mean.  The y-offset
-       is actually a weighted sum of the midrange and the mean, which favors
-       the mean if the two values differ significantly. */
-    for (c = 0; c < nsig; c++) {
-	int dy;		/* the y-offset */
-	int n;		/* the number of valid ordinates */
-	int ymid;	/* the midpoint of the ordinate range */
-	long ymean;	/* the mean of the ordinates */
-	double w;	/* weight assigned to ymean in y-offset calculation */
-
-	tp = lp->vlist[c];
-
-	/* Find the first valid sample in the trace, if any. */
-	for (j = 0; j < i && tp[j].y == WFDB_INVALID_SAMPLE; j++)
-	    ;
-	ymean = ymax = ymin = (j < i) ? tp[j].y : 0;
-	for (n = 1; j < i; j++) {
-	    if ((y = tp[j].y) != WFDB_INVALID_SAMPLE) {
-	        if (y > ymax) ymax = y;
-		else if (y < ymin) ymin = y;
-		ymean += y;
-		n++;
-	    }
-	}
-	ymean /= n;
-	ymid = (ymax + ymin)/2;
-	/* Since ymin <= ymid <= ymax, the next lines imply 0 <= w <= 1 */
-	if (ymid > ymean) /* in this case, ymax must be > ymean */
-	    w = (ymid - ymean)/(ymax - ymean);
-	else if (ymid < ymean) /* in this case, ymin must be < ymean */
-	    w = (ymean - ymid)/(ymean - ymin);
-	else w = 1.0;
-	dy = -(ymid + ((double)ymean-ymid)*w);
-	for (j = i-1; j >= 0; j--) {
-	    if (tp[j].y == WFDB_INVALID_SAMPLE) continue;
-	    /* The bounds-checking below shouldn't be necessary (the X server
-	       should clip at the canvas boundaries), but Sun's X11/NeWS
-	       server will crash (and may bring the system down with it) if
-	       run on a system with the GX accelerator and if passed
-	       sufficiently out-of-bounds ordinates (maybe abscissas, too --
-	       this hasn't been tested).  This bug is present in both the
-	       original X11/NeWS server and the GFX revision.  It appears that
-	       the bug can be avoided if the maximum distance from the window
-	       edge to the out-of-bounds ordinate is less than about 2000
-	       pixels (although this may be dependent on the window height).
-	       This bug has not been observed with other X servers. */
-	    if ((tp[j].y += dy) < -canvas_height) tp[j].y = -canvas_height;
-	    else if  (tp[j].y > canvas_height) tp[j].y = canvas_height;
-	    /* Convert all except the first ordinate in each set of contiguous
-	       valid samples to relative ordinates. */
-	    if (j < i-1 && tp[j+1].y != WFDB_INVALID_SAMPLE)
-		tp[j+1].y -= tp[j].y;
-	}
-	if (dc_coupled[c]) lp->sb[c] = sigbase[c]*vscale[c] + dy;
-    }	    
     return (lp);
 }
 
-/* Clear_cache() marks all of the display lists in the cache as invalid.  This
-   function should be executed whenever the gain (vscale) or record is changed,
-   or whenever the canvas width has been increased. */
-void clear_cache()
+/* Prefetch_display_list() builds the display list for a screen beginning at
+   the specified time, without drawing it, so that it will be found in the
+   cache when it is needed.  The per-signal validity flags used by
+   show_display_list() describe the screen currently shown, so they are
+   preserved. */
+void prefetch_display_list(t)
+long t;
 {
-    int i;
-    struct display_list *lp;
+    int c, *vv;
 
-    if (canvas_width > vlist_size) {
-	for (lp = first_list; lp; lp = lp->next) {
-	    for (i = 0; i < lp->nsig && lp->vlist[i] != NULL; i++) {
-		free(lp->vlist[i]);
-		lp->vlist[i] = NULL;
-	    }
-	}
-	vlist_size = 0;
-    }
-    else {
-	for (lp = first_list; lp; lp = lp->next) {
-	    lp->start = -1;
-	    lp->npoints = 0;
-	}
-    }
+    if (t < 0L) t = 0L;
+    if (nsig <= 0) return;
+    vv = g_memdup(vvalid, nsig * sizeof(int));
+    find_display_list(t);
+    for (c = 0; c < nsig; c++)
+	vvalid[c] = vv[c];
+    g_free(vv);
+}
+
+/* Clear_cache() discards display lists in excess of the cache size limit.
+   Since the cache is indexed by record, canvas size and amplitude scales,
+   lists made before a change of record or gain need not be discarded; they
+   will be found again if the same screen is shown with the same settings. */
+void clear_cache()
+{
+    if (list_table)
+	trim_cache(cache_limit);
 }
 
 static void show_signal_names()
@@ -498,13 +1082,13 @@ static void show_signal_names()
     yoff = (nsig > 1) ? (base[1] - base[0])/3 : canvas_height/3;
     if (sig_mode == 0) 
 	for (i = 0; i < nsig; i++)
-	    wave_draw_string(gtk_widget_get_window(wave_view),
+	    wave_draw_string(wave_drawable,
 			     draw_sig, xoff, base[i] - yoff,
 			     signame[i], strlen(signame[i]));
     else if (sig_mode == 1) {
 	for (i = 0; i < siglistlen; i++)
 	    if (0 <= siglist[i] && siglist[i] < nsig)
-		wave_draw_string(gtk_widget_get_window(wave_view),
+		wave_draw_string(wave_drawable,
 				 draw_sig, xoff, base[i] - yoff,
 				 signame[siglist[i]], strlen(signame[siglist[i]]));
     }
@@ -515,7 +1099,7 @@ static void show_signal_names()
 	for (i = j = 0; i < nsig; i++) {
 	    if (vvalid[i]) {
 		base[i] = canvas_height*(2*(j++)+1.)/(2.*nvsig);
-		wave_draw_string(gtk_widget_get_window(wave_view),
+		wave_draw_string(wave_drawable,
 				 draw_sig, xoff, base[i] - yoff,
 				 signame[i], strlen(signame[i]));
 	    }
@@ -526,19 +1110,20 @@ static void show_signal_names()
 static void show_signal_baselines(lp)
 struct display_list *lp;
 {
-    int i, l, xoff, yoff;
+    int i, l, xoff, y, yoff;
 
     yoff = mmy(2);
     for (i = 0; i < nsig; i++) {
 	if (base[i] == -9999) continue;
-	if (dc_coupled[i] && 0 <= lp->sb[i] && lp->sb[i] < canvas_height) {
-	    gdk_draw_line(gtk_widget_get_window(wave_view), draw_ann,
-		      0, lp->sb[i]+base[i], canvas_width, lp->sb[i]+base[i]);
+	y = lp->sb[i] + yshift[i];
+	if (dc_coupled[i] && 0 <= y && y < canvas_height) {
+	    gdk_draw_line(wave_drawable, draw_ann,
+		      0, y+base[i], canvas_width, y+base[i]);
 	    if (blabel[i]) {
 		l = strlen(blabel[i]);
 		xoff = canvas_width - wave_text_width(blabel[i], l) - mmx(2);
-		wave_draw_string(gtk_widget_get_window(wave_view), draw_sig,
-				 xoff, lp->sb[i]+base[i] - yoff, blabel[i], l);
+		wave_draw_string(wave_drawable, draw_sig,
+				 xoff, y+base[i] - yoff, blabel[i], l);
 	    }
 	}
     }
@@ -549,15 +1134,15 @@ struct display_list *lp;
 int sigy(i, x)
 int i, x;
 {
-    int ix, j = -1, xx, yy;
+    int ix, j = -1, y;
 
     if (sig_mode != 1) j = i;
     else if (0 <= i && i < siglistlen) j = siglist[i];
-    if (j < 0 || j >= nsig || lp_current->vlist[j] == NULL) return (-1);
+    if (j < 0 || j >= nsig || lp_current->ylist[j] == NULL) return (-1);
     if (nsamp > canvas_width) ix = x;
     else ix = (int)x/tscale;
     if (ix >= lp_current->ndpts) ix = lp_current->ndpts - 1;
-    for (xx = yy = 0; xx < ix; xx++)
-	yy += lp_current->vlist[j][xx].y;
-    return (yy + base[i]);
+    if (ix < 0 || (y = lp_current->ylist[j][ix]) == WFDB_INVALID_SAMPLE)
+	return (-1);
+    return (y + yshift[j] + base[i]);
 }
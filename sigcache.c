@@ -0,0 +1,296 @@
+/*
+ * Metaann
+ *
+ * Copyright (C) 2014 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Sample cache
+
+   Display lists hold only pixel ordinates, so they can't be reused when
+   the amplitude scale or the canvas size changes.  To avoid reading the
+   signals again in that case, the decoded samples are kept here, as
+   spans of consecutive samples for each record.  Within a span, the
+   samples of each signal are stored contiguously.  Only the signals
+   selected for reading (see select_signals() in init.c) are kept, in the
+   order given by sigslot; the record is identified by record_key, so
+   spans read with a different selection are not mixed up.
+
+   Spans of the same record never overlap: when a request overlaps or
+   adjoins existing spans, they are merged into one, and only the samples
+   not already present are read.  No span may be larger than a quarter of
+   the limit set by Wave.SampleCacheSize (in kilobytes); if merging would
+   make it larger, the new span covers only the request, and the spans it
+   overlaps are discarded.  A request for more than a quarter of the limit
+   is not cached at all.  Spans are discarded, least recently used first,
+   when their total size exceeds the limit. */
+
+#include "wave.h"
+#include "gtkwave.h"
+
+#define DEF_SAMPLE_CACHE_SIZE 65536
+
+struct sample_span {
+    struct sample_record *rec;	/* record containing this span */
+    long start;			/* time of first sample */
+    long len;			/* number of samples per signal */
+    WFDB_Sample *data;		/* sample i of signal c is
+				   data[sigslot[c]*len + i] */
+    GList *lru;			/* link in span_lru */
+};
+
+struct sample_record {
+    char *key;			/* record_key (see init.c) */
+    int nsig;			/* number of signals read */
+    long end;			/* end of record, or -1 if not known */
+    GList *spans;		/* spans, sorted by start time */
+};
+
+static GHashTable *record_table;
+static GQueue span_lru = G_QUEUE_INIT;	/* most recently used first */
+static size_t cache_size, cache_limit;
+
+static size_t span_size(const struct sample_span *sp)
+{
+    return (sizeof(struct sample_span)
+	    + sp->len * sp->rec->nsig * sizeof(WFDB_Sample));
+}
+
+static void free_span(struct sample_span *sp)
+{
+    cache_size -= span_size(sp);
+    sp->rec->spans = g_list_remove(sp->rec->spans, sp);
+    g_queue_delete_link(&span_lru, sp->lru);
+    g_free(sp->data);
+    g_free(sp);
+}
+
+static void free_record(gpointer data)
+{
+    struct sample_record *rec = data;
+
+    while (rec->spans)
+	free_span(rec->spans->data);
+    g_free(rec->key);
+    g_free(rec);
+}
+
+static int compare_spans(gconstpointer a, gconstpointer b)
+{
+    const struct sample_span *sa = a, *sb = b;
+    return (sa->start < sb->start ? -1 : sa->start > sb->start);
+}
+
+/* Discard least recently used spans, other than keep, until the cache
+   holds no more than limit bytes. */
+static void trim_sample_cache(size_t limit, struct sample_span *keep)
+{
+    GList *l, *lp;
+
+    for (l = span_lru.tail; l && cache_size > limit; l = lp) {
+	lp = l->prev;
+	if (l->data != keep)
+	    free_span(l->data);
+    }
+}
+
+static struct sample_record *get_record(void)
+{
+    struct sample_record *rec;
+
+    if (!record_table) {
+	record_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+					     NULL, &free_record);
+	cache_limit = (size_t) defaults_get_integer("wave.samplecachesize",
+						    "Wave.SampleCacheSize",
+						    DEF_SAMPLE_CACHE_SIZE) * 1024;
+    }
+
+    if ((rec = g_hash_table_lookup(record_table, record_key)))
+	return (rec);
+
+    rec = g_new0(struct sample_record, 1);
+    rec->key = g_strdup(record_key);
+    rec->nsig = nsigread;
+    rec->end = -1;
+    g_hash_table_insert(record_table, rec->key, rec);
+    return (rec);
+}
+
+/* Read samples t0 through t1-1 into span sp, from the mapped signal files
+   if possible (see sigmap.c).  Returns the time of the first sample not
+   read (less than t1 at the end of the record, or if the samples can't be
+   read); *at_end is set to 1 only if the end of the record was reached. */
+static long read_span(struct sample_span *sp, long t0, long t1, int *at_end)
+{
+    WFDB_Sample *p;
+    long t;
+    int c, r = 1;
+
+    *at_end = 0;
+    p = sp->data + (t0 - sp->start);
+    if ((t = read_mapped_samples(t0, t1 - t0, sigslot, p, sp->len)) >= 0) {
+	*at_end = (t < t1 - t0);
+	return (t0 + t);
+    }
+    if (t0 != strtim("i") && isigsettime(t0) < 0)
+	return (t0);
+    for (t = t0; t < t1 && (r = getvec(v)) > 0; t++, p++)
+	for (c = 0; c < nsig; c++)
+	    if (sigslot[c] >= 0)
+		p[sigslot[c] * sp->len] = v[c];
+    *at_end = (r == -1);	/* -1: end of data; less: error */
+    return (t);
+}
+
+/* Get_samples() finds samples t0 through t0+n-1 of the current record in
+   the cache, reading any that are missing.  On success, it sets *pdata and
+   *pstride so that sample t0+i of signal c is
+   (*pdata)[sigslot[c] * *pstride + i] (for the signals that are read), and
+   returns the number of samples available (which may be less than n
+   at the end of the record.)  It returns 0 if the samples can't be read,
+   or if the request is too large to be cached. */
+long get_samples(long t0, long n, WFDB_Sample **pdata, long *pstride)
+{
+    struct sample_record *rec;
+    struct sample_span *sp, *old;
+    GList *l, *lp, *merge = NULL;
+    long a, b, t, t1, tread, max_len;
+    int c, at_end;
+
+    if (nsigread <= 0 || n <= 0 || t0 < 0)
+	return (0);
+
+    rec = get_record();
+    max_len = cache_limit / 4 / (rec->nsig * sizeof(WFDB_Sample));
+    if (n > max_len)
+	return (0);
+    t1 = t0 + n;
+    if (rec->end >= 0) {
+	if (t1 > rec->end) t1 = rec->end;
+	if (t0 >= t1) return (0);
+    }
+
+    /* Find the spans that overlap or adjoin the requested interval. */
+    a = t0;
+    b = t1;
+    for (l = rec->spans; l; l = l->next) {
+	sp = l->data;
+	if (sp->start <= t0 && sp->start + sp->len >= t1) {
+	    /* The whole interval is already here. */
+	    g_queue_unlink(&span_lru, sp->lru);
+	    g_queue_push_head_link(&span_lru, sp->lru);
+	    *pdata = sp->data + (t0 - sp->start);
+	    *pstride = sp->len;
+	    return (t1 - t0);
+	}
+	if (sp->start <= t1 && sp->start + sp->len >= t0) {
+	    merge = g_list_append(merge, sp);
+	    a = MIN(a, sp->start);
+	    b = MAX(b, sp->start + sp->len);
+	}
+    }
+    if (b - a > max_len) {
+	/* Too large to merge: cover only the request, and discard the
+	   spans it overlaps (after copying what they have.)  Spans that only
+	   adjoin it are kept. */
+	a = t0;
+	b = t1;
+	for (l = merge; l; l = lp) {
+	    lp = l->next;
+	    sp = l->data;
+	    if (sp->start >= t1 || sp->start + sp->len <= t0)
+		merge = g_list_delete_link(merge, l);
+	}
+    }
+
+    /* Make a new span covering all of them, copy the samples we have, and
+       read the rest. */
+    sp = g_new0(struct sample_span, 1);
+    sp->rec = rec;
+    sp->start = a;
+    sp->len = b - a;
+    sp->data = g_new(WFDB_Sample, sp->len * rec->nsig);
+
+    for (t = a, l = merge; t < b; ) {
+	old = l ? l->data : NULL;
+	if (old && old->start <= t) {
+	    /* Copy the part of the old span that lies within [t, b). */
+	    tread = MIN(old->start + old->len, b);
+	    if (tread > t)
+		for (c = 0; c < rec->nsig; c++)
+		    memcpy(sp->data + c * sp->len + (t - a),
+			   old->data + c * old->len + (t - old->start),
+			   (tread - t) * sizeof(WFDB_Sample));
+	    t = MAX(t, tread);
+	    l = l->next;
+	}
+	else {
+	    tread = old ? MIN(old->start, b) : b;
+	    if ((t = read_span(sp, t, tread, &at_end)) < tread) {
+		/* End of record (or unreadable); keep what we have. */
+		if (at_end)
+		    rec->end = t;
+		break;
+	    }
+	}
+    }
+
+    for (l = merge; l; l = l->next)
+	free_span(l->data);
+    g_list_free(merge);
+
+    if (t < b) {
+	/* Shrink the span to the samples actually read. */
+	if (t <= a) {
+	    g_free(sp->data);
+	    g_free(sp);
+	    return (0);
+	}
+	for (c = 1; c < rec->nsig; c++)
+	    memmove(sp->data + c * (t - a), sp->data + c * sp->len,
+		    (t - a) * sizeof(WFDB_Sample));
+	sp->len = t - a;
+	sp->data = g_renew(WFDB_Sample, sp->data, sp->len * rec->nsig);
+	if (t1 > t) t1 = t;
+	if (t0 >= t1) {
+	    g_free(sp->data);
+	    g_free(sp);
+	    return (0);
+	}
+    }
+
+    if (sp->len > max_len) {
+	g_free(sp->data);
+	g_free(sp);
+	return (0);
+    }
+    rec->spans = g_list_insert_sorted(rec->spans, sp, &compare_spans);
+    g_queue_push_head(&span_lru, sp);
+    sp->lru = span_lru.head;
+    cache_size += span_size(sp);
+    trim_sample_cache(cache_limit, sp);
+
+    *pdata = sp->data + (t0 - sp->start);
+    *pstride = sp->len;
+    return (t1 - t0);
+}
+
+/* Clear_sample_cache() discards all cached samples. */
+void clear_sample_cache(void)
+{
+    if (record_table)
+	g_hash_table_remove_all(record_table);
+}
@@ -0,0 +1,434 @@
+/*
+ * Metaann
+ *
+ * Copyright (C) 2014 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Memory-mapped signal files
+
+   Reading samples through getvec() costs a library call (and, for the
+   packed formats, a call per byte) for every frame.  When the header and
+   signal files of the current record are local files, and every signal
+   is stored in one of the common formats (16, 80, 212, 310 or 311) with
+   one sample per frame and no skew, the signal files are instead mapped
+   into memory, and the samples are unpacked directly from them (see
+   unpack.c): the
+   position of any sample can be computed from its time, so there is no
+   need to seek.
+
+   A signal file that is not local may instead be read from a remote
+   directory of the WFDB path through the persistent block cache (see
+   blockcache.c), provided that the header has been copied to the
+   working directory (see select_record() in metaann.c.)
+
+   The header is parsed here, since the byte offsets and skews of the
+   signals are not available from the WFDB library.  Anything else
+   (multi-segment records, other formats, oversampled signals or
+   resampling) is left to getvec(). */
+
+#include "wave.h"
+#include "gtkwave.h"
+#include "blockcache.h"
+
+struct mapped_signal {
+    const guchar *data;		/* start of samples (after the prolog), or
+				   NULL if the file is remote */
+    char *url;			/* URL of a remote file */
+    gint64 offset;		/* length of the prolog of a remote file */
+    gsize length;		/* number of bytes of samples */
+    int fmt;			/* storage format */
+    int nf;			/* number of signals in the group */
+    int pos;			/* position of this signal in the group */
+};
+
+static char map_record[RNLMAX+1];
+static int map_nsig;
+static int map_state;		/* 1: mapped; -1: can't be mapped; 0: unknown */
+static long map_nframes;
+static struct mapped_signal *map_sig;
+static GMappedFile **map_files;
+static int map_nfiles;
+static int map_nsig_header;	/* number of signals in the header */
+
+static void unmap_record(void)
+{
+    int i;
+
+    for (i = 0; i < map_nfiles; i++)
+	if (map_files[i])
+	    g_mapped_file_unref(map_files[i]);
+    for (i = 0; map_sig && i < map_nsig_header; i++)
+	g_free(map_sig[i].url);
+    g_free(map_files);
+    g_free(map_sig);
+    map_files = NULL;
+    map_sig = NULL;
+    map_nfiles = 0;
+    map_nsig_header = 0;
+    map_nframes = 0;
+    map_state = 0;
+}
+
+/* Find the size of the smallest unit of a signal file in format fmt that
+   holds a whole number of samples: *pspu samples in *pbpu bytes. */
+static void format_unit(int fmt, int *pspu, int *pbpu)
+{
+    switch (fmt) {
+    case 80: *pspu = 1; *pbpu = 1; break;
+    case 212: *pspu = 2; *pbpu = 3; break;
+    case 310:
+    case 311: *pspu = 3; *pbpu = 4; break;
+    default: *pspu = 1; *pbpu = 2; break;
+    }
+}
+
+/* Return the number of complete samples in length bytes of format fmt. */
+static long format_samples(int fmt, gsize length)
+{
+    int spu, bpu;
+
+    format_unit(fmt, &spu, &bpu);
+    return (length / bpu * spu);
+}
+
+/* Return the name of the record's header file, if it is a local file. */
+static char *local_header(void)
+{
+    char *fname;
+
+    if (!(fname = wfdbfile("hea", record)) || strstr(fname, "://")
+	|| !g_file_test(fname, G_FILE_TEST_IS_REGULAR))
+	return (NULL);
+    return (g_strdup(fname));
+}
+
+/* Parse the header of the current record and map its signal files.
+   Returns 1 on success, or 0 if getvec() must be used instead. */
+static int map_record_files(void)
+{
+    char *hname, *dname, *rdir, *text, **lines, **fields, *fname, *p, *prev;
+    char *url = NULL;
+    long nsamp = 0, nf, offset, skew;
+    int c, i, n, ns = -1, fmt, spf, ok = 0, first;
+    GMappedFile *mf = NULL;
+    gint64 rlen;
+    gsize length = 0;
+
+    if (getifreq() != sampfreq(NULL) || !(hname = local_header()))
+	return (0);
+    if (!g_file_get_contents(hname, &text, NULL, NULL)) {
+	g_free(hname);
+	return (0);
+    }
+    dname = g_path_get_dirname(hname);
+    rdir = g_path_get_dirname(record);
+    g_free(hname);
+    lines = g_strsplit(text, "\n", -1);
+    g_free(text);
+
+    prev = NULL;
+    first = 0;
+    for (i = c = 0; lines[i]; i++) {
+	g_strstrip(lines[i]);
+	if (lines[i][0] == '#' || lines[i][0] == '\0')
+	    continue;
+	fields = g_strsplit_set(lines[i], " \t", -1);
+	for (n = 0; fields[n]; n++)
+	    ;
+	if (ns < 0) {
+	    /* Record line: name[/nseg] nsig [freq [nsamp ...]] */
+	    if (n < 2 || strchr(fields[0], '/')
+		|| (ns = strtol(fields[1], NULL, 10)) < nsig || ns <= 0) {
+		g_strfreev(fields);
+		break;
+	    }
+	    if (n > 3)
+		nsamp = strtol(fields[3], NULL, 10);
+	    map_sig = g_new0(struct mapped_signal, ns);
+	    map_files = g_new0(GMappedFile *, ns);
+	    map_nsig_header = ns;
+	    g_strfreev(fields);
+	    continue;
+	}
+
+	/* Signal line: fname fmt[xspf][:skew][+offset] ... */
+	if (n < 2) {
+	    g_strfreev(fields);
+	    break;
+	}
+	fmt = strtol(fields[1], &p, 10);
+	spf = 1;
+	skew = offset = 0;
+	if (*p == 'x') spf = strtol(p + 1, &p, 10);
+	if (*p == ':') skew = strtol(p + 1, &p, 10);
+	if (*p == '+') offset = strtol(p + 1, &p, 10);
+	if (spf != 1 || skew != 0 || offset < 0 || strcmp(fields[0], "-") == 0
+	    || (fmt != 16 && fmt != 80 && fmt != 212 && fmt != 310
+		&& fmt != 311)) {
+	    g_strfreev(fields);
+	    break;
+	}
+
+	/* Consecutive signals in the same file form a group.  The file is
+	   mapped if it is local, or else looked up in the remote
+	   directories (relative to the record's directory, as WFDB does.) */
+	if (!prev || strcmp(prev, fields[0]) != 0) {
+	    g_free(prev);
+	    prev = g_strdup(fields[0]);
+	    first = c;
+	    fname = g_build_filename(dname, fields[0], NULL);
+	    mf = g_mapped_file_new(fname, FALSE, NULL);
+	    g_free(fname);
+	    url = NULL;
+	    if (mf) {
+		map_files[map_nfiles++] = mf;
+		rlen = g_mapped_file_get_length(mf);
+	    }
+	    else {
+		fname = (strcmp(rdir, ".") == 0 ? g_strdup(fields[0])
+			 : g_strconcat(rdir, "/", fields[0], NULL));
+		url = cache_find_url(fname);
+		g_free(fname);
+		rlen = url ? cache_url_length(url) : -1;
+	    }
+	    if ((!mf && !url) || rlen < offset) {
+		g_free(url);
+		g_strfreev(fields);
+		break;
+	    }
+	    length = rlen - offset;
+	}
+	else if (fmt != map_sig[first].fmt) {
+	    g_strfreev(fields);
+	    break;
+	}
+	if (mf)
+	    map_sig[c].data = (const guchar *) g_mapped_file_get_contents(mf)
+		+ offset;
+	else {
+	    map_sig[c].url = (c == first ? url : g_strdup(url));
+	    map_sig[c].offset = offset;
+	}
+	map_sig[c].length = length;
+	map_sig[c].fmt = fmt;
+	map_sig[c].pos = c - first;
+	for (n = first; n <= c; n++)
+	    map_sig[n].nf = c - first + 1;
+	g_strfreev(fields);
+	if (++c == ns) {
+	    ok = 1;
+	    break;
+	}
+    }
+    g_free(prev);
+    g_strfreev(lines);
+    g_free(dname);
+    g_free(rdir);
+
+    if (!ok)
+	return (0);
+
+    /* The record ends with the shortest signal file. */
+    map_nframes = -1;
+    for (c = 0; c < ns; c++) {
+	nf = format_samples(map_sig[c].fmt, map_sig[c].length);
+	nf /= map_sig[c].nf;
+	if (map_nframes < 0 || nf < map_nframes)
+	    map_nframes = nf;
+    }
+    if (nsamp > 0 && nsamp < map_nframes)
+	map_nframes = nsamp;
+    return (1);
+}
+
+/* Map the signal files of the current record, if that hasn't been tried
+   already.  Returns 1 if they are mapped. */
+static int map_current_record(void)
+{
+    if (map_state == 0 || map_nsig != nsig || strcmp(map_record, record)) {
+	unmap_record();
+	g_strlcpy(map_record, record, sizeof(map_record));
+	map_nsig = nsig;
+	if (nsig > 0 && map_record_files())
+	    map_state = 1;
+	else {
+	    unmap_record();
+	    map_state = -1;
+	}
+    }
+    return (map_state > 0);
+}
+
+#define UNPACK_FRAMES 1024
+
+/* Unpack samples k through k+n-1 of the signal file holding ms.  A remote
+   file is read through the block cache, from the start of the unit
+   holding sample k.  Returns 0 if the samples can't be read. */
+static int unpack_file(struct mapped_signal *ms, long k, long n,
+		       WFDB_Sample *out)
+{
+    static guchar *bytes;
+    static gsize bytes_size;
+    gint64 u0, u1;
+    gsize count;
+    int spu, bpu;
+
+    if (ms->data)
+	return (unpack_samples(ms->fmt, ms->data, k, n, out));
+
+    format_unit(ms->fmt, &spu, &bpu);
+    u0 = k / spu;
+    u1 = (k + n + spu - 1) / spu;
+    count = (u1 - u0) * bpu;
+    if (bytes_size < count) {
+	bytes_size = count;
+	bytes = g_realloc(bytes, bytes_size);
+    }
+    if (cache_url_read(ms->url, ms->offset + u0 * bpu, count, bytes, NULL)
+	!= (gssize) count)
+	return (0);
+    return (unpack_samples(ms->fmt, bytes, k - u0 * spu, n, out));
+}
+
+/* Read_mapped_samples() decodes samples t0 through t0+n-1 of the record,
+   storing sample t0+i of signal c in data[slot[c]*stride + i] for each
+   signal with slot[c] >= 0 (normally, slot is sigslot, and the signals
+   read are those selected by select_signals() in init.c); if slot is
+   NULL, all signals are decoded, and signal c is stored in
+   data[c*stride + i].  The samples of each group are unpacked
+   together (see unpack.c), UNPACK_FRAMES frames at a time, and then
+   distributed to the signals.  It returns the number of samples decoded
+   (less than n at the end of the record), or -1 if the record's signal
+   files can't be mapped (or a remote file can't be read), in which case
+   the samples must be read using getvec(). */
+long read_mapped_samples(long t0, long n, const int *slot,
+			 WFDB_Sample *data, long stride)
+{
+    static WFDB_Sample *frames;
+    static int frames_size;
+    struct mapped_signal *ms;
+    WFDB_Sample *out, *fp;
+    long i, j, m;
+    int c, g, s, nf;
+
+    if (!map_current_record() || t0 < 0)
+	return (-1);
+
+    if (t0 >= map_nframes)
+	return (0);
+    if (n > map_nframes - t0)
+	n = map_nframes - t0;
+
+    for (g = 0; g < nsig; g += nf) {
+	ms = &map_sig[g];
+	nf = ms->nf;
+
+	/* A group of one signal is unpacked in place. */
+	if (nf == 1) {
+	    if ((!slot || slot[g] >= 0) &&
+		!unpack_file(ms, t0, n, data + (slot ? slot[g] : g) * stride))
+		goto failed;
+	    continue;
+	}
+
+	for (c = g; c < g + nf && c < nsig && slot && slot[c] < 0; c++)
+	    ;
+	if (c == g + nf || c == nsig)
+	    continue;		/* none of this group is needed */
+
+	if (frames_size < nf * UNPACK_FRAMES) {
+	    frames_size = nf * UNPACK_FRAMES;
+	    frames = g_renew(WFDB_Sample, frames, frames_size);
+	}
+	for (i = 0; i < n; i += m) {
+	    m = MIN(n - i, UNPACK_FRAMES);
+	    if (!unpack_file(ms, (t0 + i) * nf, m * nf, frames))
+		goto failed;
+	    for (s = 0; s < nf && g + s < nsig; s++) {
+		c = g + s;
+		if (slot && slot[c] < 0)
+		    continue;
+		out = data + (slot ? slot[c] : c) * stride + i;
+		for (j = 0, fp = frames + s; j < m; j++, fp += nf)
+		    out[j] = *fp;
+	    }
+	}
+    }
+    return (n);
+
+ failed:
+    /* A remote file couldn't be read; use getvec() from now on. */
+    unmap_record();
+    map_state = -1;
+    return (-1);
+}
+
+/* Remote_sample_ranges() finds the byte ranges of remote signal files that
+   read_mapped_samples() would read for samples t0 through t0+n-1 of the
+   selected signals, and that are not yet in the block cache, so that
+   they can be fetched in advance by another thread (see
+   load_signal_data() in metaann.c.)  It returns the number of ranges stored in *pranges, which should be
+   freed using free_remote_ranges(). */
+int remote_sample_ranges(long t0, long n, struct remote_range **pranges)
+{
+    struct mapped_signal *ms;
+    struct remote_range *r = NULL;
+    gint64 u0, u1;
+    int c, g, nf, spu, bpu, nr = 0;
+
+    *pranges = NULL;
+    if (!map_current_record() || n <= 0)
+	return (0);
+    if (t0 < 0) {
+	n += t0;
+	t0 = 0;
+    }
+    if (n > map_nframes - t0)
+	n = map_nframes - t0;
+    if (n <= 0)
+	return (0);
+
+    for (g = 0; g < nsig; g += nf) {
+	ms = &map_sig[g];
+	nf = ms->nf;
+	for (c = g; c < g + nf && c < nsig && sigslot[c] < 0; c++)
+	    ;
+	if (ms->data || c == g + nf || c == nsig)
+	    continue;
+	format_unit(ms->fmt, &spu, &bpu);
+	u0 = t0 * nf / spu;
+	u1 = ((t0 + n) * nf + spu - 1) / spu;
+	if (cache_url_has_range(ms->url, ms->offset + u0 * bpu,
+				(u1 - u0) * bpu))
+	    continue;
+	r = g_renew(struct remote_range, r, nr + 1);
+	r[nr].url = g_strdup(ms->url);
+	r[nr].offset = ms->offset + u0 * bpu;
+	r[nr].count = (u1 - u0) * bpu;
+	nr++;
+    }
+    *pranges = r;
+    return (nr);
+}
+
+void free_remote_ranges(struct remote_range *ranges, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+	g_free(ranges[i].url);
+    g_free(ranges);
+}
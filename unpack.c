@@ -0,0 +1,312 @@
+/*
+ * Metaann
+ *
+ * Copyright (C) 2014 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Sample unpacking
+
+   Unpack_samples() decodes a run of consecutive samples from the bytes
+   of a signal file in one of the formats handled by sigmap.c (16, 80,
+   212, 310 or 311).  For the packed formats, the samples are unpacked
+   several at a time using SSSE3 (212) or SSE4.1 (310 and 311)
+   instructions where available (selected at run time), or a plain C loop
+   otherwise.  The smallest value of each format marks an invalid sample,
+   and is replaced by WFDB_INVALID_SAMPLE in the same pass. */
+
+#include "wave.h"
+#include "gtkwave.h"
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) \
+    && (defined(__i386__) || defined(__x86_64__))
+# define USE_X86_SIMD
+# include <immintrin.h>
+#endif
+
+typedef void (*unpack_func)(const guchar *p, long k, long n, WFDB_Sample *out);
+
+static void unpack_16(const guchar *p, long k, long n, WFDB_Sample *out)
+{
+    long i;
+
+    /* -32768 is WFDB_INVALID_SAMPLE itself. */
+    for (p += 2 * k, i = 0; i < n; i++, p += 2)
+	out[i] = (gint16) (p[0] | p[1] << 8);
+}
+
+static void unpack_80(const guchar *p, long k, long n, WFDB_Sample *out)
+{
+    long i;
+    int x;
+
+    for (p += k, i = 0; i < n; i++, p++) {
+	x = p[0] - 128;
+	out[i] = (x == -128) ? WFDB_INVALID_SAMPLE : x;
+    }
+}
+
+static void unpack_212_scalar(const guchar *p, long k, long n,
+			      WFDB_Sample *out)
+{
+    const guchar *b;
+    long i;
+    int x;
+
+    for (i = 0; i < n; i++, k++) {
+	b = p + 3 * (k >> 1);
+	if (k & 1)
+	    x = b[2] | (b[1] & 0xf0) << 4;
+	else
+	    x = b[0] | (b[1] & 0x0f) << 8;
+	if (x & 0x800) x -= 0x1000;
+	out[i] = (x == -2048) ? WFDB_INVALID_SAMPLE : x;
+    }
+}
+
+static void unpack_310_scalar(const guchar *p, long k, long n,
+			      WFDB_Sample *out)
+{
+    const guchar *b;
+    unsigned w1, w2;
+    long i;
+    int x;
+
+    for (i = 0; i < n; i++, k++) {
+	b = p + 4 * (k / 3);
+	w1 = b[0] | b[1] << 8;
+	w2 = b[2] | b[3] << 8;
+	switch (k % 3) {
+	case 0: x = (w1 >> 1) & 0x3ff; break;
+	case 1: x = (w2 >> 1) & 0x3ff; break;
+	default: x = ((w1 >> 11) & 0x1f) | ((w2 >> 6) & 0x3e0); break;
+	}
+	if (x & 0x200) x -= 0x400;
+	out[i] = (x == -512) ? WFDB_INVALID_SAMPLE : x;
+    }
+}
+
+static void unpack_311_scalar(const guchar *p, long k, long n,
+			      WFDB_Sample *out)
+{
+    const guchar *b;
+    guint32 w;
+    long i;
+    int x;
+
+    for (i = 0; i < n; i++, k++) {
+	b = p + 4 * (k / 3);
+	w = b[0] | b[1] << 8 | b[2] << 16 | (guint32) b[3] << 24;
+	x = (w >> (10 * (k % 3))) & 0x3ff;
+	if (x & 0x200) x -= 0x400;
+	out[i] = (x == -512) ? WFDB_INVALID_SAMPLE : x;
+    }
+}
+
+#ifdef USE_X86_SIMD
+
+/* Format 212 stores two samples in three bytes.  Eight samples (twelve
+   bytes) are unpacked at a time: each pair of bytes holding a sample is
+   shuffled into a 16-bit lane, and the nibbles belonging to the other
+   sample of the pair are masked off.  Since a 16-byte load reads four
+   bytes beyond the twelve used, the vector loop stops four samples short
+   of the end of the run. */
+__attribute__((target("ssse3")))
+static void unpack_212_ssse3(const guchar *p, long k, long n,
+			     WFDB_Sample *out)
+{
+    const __m128i shuf = _mm_setr_epi8(0, 1, 2, 1, 3, 4, 5, 4,
+				       6, 7, 8, 7, 9, 10, 11, 10);
+    const __m128i mlo = _mm_setr_epi16(0x0fff, 0x00ff, 0x0fff, 0x00ff,
+				       0x0fff, 0x00ff, 0x0fff, 0x00ff);
+    const __m128i mhi = _mm_setr_epi16(0, 0x0f00, 0, 0x0f00,
+				       0, 0x0f00, 0, 0x0f00);
+    const __m128i inv = _mm_set1_epi16(-2048);
+    const __m128i invout = _mm_set1_epi16(WFDB_INVALID_SAMPLE);
+    __m128i w, x, bad;
+    long i = 0;
+
+    if (k & 1) {
+	unpack_212_scalar(p, k, 1, out);
+	i = 1;
+    }
+    for (; i + 12 <= n; i += 8) {
+	w = _mm_loadu_si128((const __m128i *) (p + 3 * ((k + i) >> 1)));
+	w = _mm_shuffle_epi8(w, shuf);
+	x = _mm_or_si128(_mm_and_si128(w, mlo),
+			 _mm_and_si128(_mm_srli_epi16(w, 4), mhi));
+	x = _mm_srai_epi16(_mm_slli_epi16(x, 4), 4);
+	bad = _mm_cmpeq_epi16(x, inv);
+	x = _mm_or_si128(_mm_and_si128(bad, invout), _mm_andnot_si128(bad, x));
+	_mm_storeu_si128((__m128i *) (out + i),
+			 _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+	_mm_storeu_si128((__m128i *) (out + i + 4),
+			 _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+    }
+    unpack_212_scalar(p, k + i, n - i, out + i);
+}
+
+/* Formats 310 and 311 store three samples in four bytes.  Twelve samples
+   (sixteen bytes) are unpacked at a time, into three vectors: the 32-bit
+   word holding each sample is shuffled into its lane, and the sample is
+   moved to the top of the lane by a multiplication (SSE4.1 has no
+   variable shifts) and then shifted down arithmetically, which also
+   extends its sign. */
+#define W(j) 4*(j), 4*(j)+1, 4*(j)+2, 4*(j)+3
+
+__attribute__((target("sse4.1")))
+static void unpack_311_sse41(const guchar *p, long k, long n,
+			     WFDB_Sample *out)
+{
+    const __m128i shuf0 = _mm_setr_epi8(W(0), W(0), W(0), W(1));
+    const __m128i shuf1 = _mm_setr_epi8(W(1), W(1), W(2), W(2));
+    const __m128i shuf2 = _mm_setr_epi8(W(2), W(3), W(3), W(3));
+    const __m128i mul0 = _mm_setr_epi32(1 << 22, 1 << 12, 1 << 2, 1 << 22);
+    const __m128i mul1 = _mm_setr_epi32(1 << 12, 1 << 2, 1 << 22, 1 << 12);
+    const __m128i mul2 = _mm_setr_epi32(1 << 2, 1 << 22, 1 << 12, 1 << 2);
+    const __m128i inv = _mm_set1_epi32(-512);
+    const __m128i invout = _mm_set1_epi32(WFDB_INVALID_SAMPLE);
+    __m128i w, x;
+    long i = 0;
+
+    if (k % 3) {
+	i = 3 - k % 3;
+	if (i > n) i = n;
+	unpack_311_scalar(p, k, i, out);
+    }
+    for (; i + 12 <= n; i += 12) {
+	w = _mm_loadu_si128((const __m128i *) (p + 4 * ((k + i) / 3)));
+	x = _mm_srai_epi32(_mm_mullo_epi32(_mm_shuffle_epi8(w, shuf0), mul0),
+			   22);
+	x = _mm_blendv_epi8(x, invout, _mm_cmpeq_epi32(x, inv));
+	_mm_storeu_si128((__m128i *) (out + i), x);
+	x = _mm_srai_epi32(_mm_mullo_epi32(_mm_shuffle_epi8(w, shuf1), mul1),
+			   22);
+	x = _mm_blendv_epi8(x, invout, _mm_cmpeq_epi32(x, inv));
+	_mm_storeu_si128((__m128i *) (out + i + 4), x);
+	x = _mm_srai_epi32(_mm_mullo_epi32(_mm_shuffle_epi8(w, shuf2), mul2),
+			   22);
+	x = _mm_blendv_epi8(x, invout, _mm_cmpeq_epi32(x, inv));
+	_mm_storeu_si128((__m128i *) (out + i + 8), x);
+    }
+    unpack_311_scalar(p, k + i, n - i, out + i);
+}
+
+/* In format 310, the first two samples of each word are bits 1-10 and
+   17-26, which are handled as above; the third is split between bits
+   11-15 and 27-31, and is assembled separately. */
+__attribute__((target("sse4.1")))
+static __m128i unpack_310_vec(__m128i w, __m128i mul, __m128i third)
+{
+    const __m128i inv = _mm_set1_epi32(-512);
+    const __m128i invout = _mm_set1_epi32(WFDB_INVALID_SAMPLE);
+    const __m128i lo5 = _mm_set1_epi32(0x1f);
+    const __m128i hi5 = _mm_set1_epi32(0x3e0);
+    __m128i x, y;
+
+    x = _mm_srai_epi32(_mm_mullo_epi32(w, mul), 22);
+    y = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(w, 11), lo5),
+		     _mm_and_si128(_mm_srli_epi32(w, 22), hi5));
+    y = _mm_srai_epi32(_mm_slli_epi32(y, 22), 22);
+    x = _mm_blendv_epi8(x, y, third);
+    return (_mm_blendv_epi8(x, invout, _mm_cmpeq_epi32(x, inv)));
+}
+
+__attribute__((target("sse4.1")))
+static void unpack_310_sse41(const guchar *p, long k, long n,
+			     WFDB_Sample *out)
+{
+    const __m128i shuf0 = _mm_setr_epi8(W(0), W(0), W(0), W(1));
+    const __m128i shuf1 = _mm_setr_epi8(W(1), W(1), W(2), W(2));
+    const __m128i shuf2 = _mm_setr_epi8(W(2), W(3), W(3), W(3));
+    const __m128i mul0 = _mm_setr_epi32(1 << 21, 1 << 5, 1, 1 << 21);
+    const __m128i mul1 = _mm_setr_epi32(1 << 5, 1, 1 << 21, 1 << 5);
+    const __m128i mul2 = _mm_setr_epi32(1, 1 << 21, 1 << 5, 1);
+    const __m128i third0 = _mm_setr_epi32(0, 0, -1, 0);
+    const __m128i third1 = _mm_setr_epi32(0, -1, 0, 0);
+    const __m128i third2 = _mm_setr_epi32(-1, 0, 0, -1);
+    __m128i w;
+    long i = 0;
+
+    if (k % 3) {
+	i = 3 - k % 3;
+	if (i > n) i = n;
+	unpack_310_scalar(p, k, i, out);
+    }
+    for (; i + 12 <= n; i += 12) {
+	w = _mm_loadu_si128((const __m128i *) (p + 4 * ((k + i) / 3)));
+	_mm_storeu_si128((__m128i *) (out + i),
+			 unpack_310_vec(_mm_shuffle_epi8(w, shuf0),
+					mul0, third0));
+	_mm_storeu_si128((__m128i *) (out + i + 4),
+			 unpack_310_vec(_mm_shuffle_epi8(w, shuf1),
+					mul1, third1));
+	_mm_storeu_si128((__m128i *) (out + i + 8),
+			 unpack_310_vec(_mm_shuffle_epi8(w, shuf2),
+					mul2, third2));
+    }
+    unpack_310_scalar(p, k + i, n - i, out + i);
+}
+
+#undef W
+
+#endif /* USE_X86_SIMD */
+
+static unpack_func get_unpack_func(int fmt)
+{
+    static unpack_func func212, func310, func311;
+
+    if (!func212) {
+	func212 = &unpack_212_scalar;
+	func310 = &unpack_310_scalar;
+	func311 = &unpack_311_scalar;
+#ifdef USE_X86_SIMD
+	if (sizeof(WFDB_Sample) == sizeof(int)) {
+	    __builtin_cpu_init();
+	    if (__builtin_cpu_supports("ssse3"))
+		func212 = &unpack_212_ssse3;
+	    if (__builtin_cpu_supports("sse4.1")) {
+		func310 = &unpack_310_sse41;
+		func311 = &unpack_311_sse41;
+	    }
+	}
+#endif
+    }
+
+    switch (fmt) {
+    case 16: return (&unpack_16);
+    case 80: return (&unpack_80);
+    case 212: return (func212);
+    case 310: return (func310);
+    case 311: return (func311);
+    default: return (NULL);
+    }
+}
+
+/* Unpack_samples() decodes samples k through k+n-1 of a signal file whose
+   samples (following any prolog) begin at p, storing them in out.  All
+   bytes read belong to the requested samples.  Returns 0 if the format is
+   not supported. */
+int unpack_samples(int fmt, const guchar *p, long k, long n,
+		   WFDB_Sample *out)
+{
+    unpack_func unpack = get_unpack_func(fmt);
+
+    if (!unpack)
+	return (0);
+    if (n > 0)
+	(*unpack)(p, k, n, out);
+    return (1);
+}
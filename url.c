@@ -18,16 +18,31 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <glib.h>
 #include <gtk/gtk.h>		/* for gtk_*_version */
 #include <wfdb/wfdb.h>
 #include <curl/curl.h>
 #include "url.h"
 
-#define ERROR_DOMAIN (g_quark_from_static_string("metaann-url"))
+#define ERROR_DOMAIN URL_ERROR
 
-static CURL *curl;
-static char error_buf[CURL_ERROR_SIZE];
+/* Each thread that makes requests has its own libcurl handle (and
+   error buffer), created the first time it is needed. */
+struct url_session {
+    CURL *curl;
+    char error_buf[CURL_ERROR_SIZE];
+};
+
+static void free_session(gpointer data)
+{
+    struct url_session *ses = data;
+
+    curl_easy_cleanup(ses->curl);
+    g_free(ses);
+}
+
+static GPrivate session_key = G_PRIVATE_INIT(free_session);
 
 static size_t append_to_str(void *ptr, size_t size, size_t nmemb,
 			    void *stream)
@@ -37,34 +52,83 @@ static size_t append_to_str(void *ptr, size_t size, size_t nmemb,
     return (size * nmemb);
 }
 
+/* Record the validators and length of the resource from the response
+   headers. */
+static size_t parse_header(void *ptr, size_t size, size_t nmemb,
+			   void *stream)
+{
+    struct url_info *info = stream;
+    char *line, *value;
+
+    line = g_strndup(ptr, size * nmemb);
+    if ((value = strchr(line, ':'))) {
+	*value++ = 0;
+	g_strstrip(value);
+	if (!g_ascii_strcasecmp(line, "ETag")) {
+	    g_free(info->etag);
+	    info->etag = g_strdup(value);
+	}
+	else if (!g_ascii_strcasecmp(line, "Last-Modified")) {
+	    g_free(info->last_modified);
+	    info->last_modified = g_strdup(value);
+	}
+	else if (!g_ascii_strcasecmp(line, "Content-Length")) {
+	    info->length = g_ascii_strtoll(value, NULL, 10);
+	}
+    }
+    g_free(line);
+    return (size * nmemb);
+}
+
+static struct url_session * get_session(void)
+{
+    static gsize initialized;
+    struct url_session *ses;
+    char *s;
+
+    if (g_once_init_enter(&initialized)) {
+	curl_global_init(CURL_GLOBAL_ALL);
+	g_once_init_leave(&initialized, 1);
+    }
+
+    if ((ses = g_private_get(&session_key)))
+	return ses;
+
+    ses = g_new0(struct url_session, 1);
+    ses->curl = curl_easy_init();
+    curl_easy_setopt(ses->curl, CURLOPT_ERRORBUFFER, ses->error_buf);
+
+    s = g_strdup_printf("metaann/%s (libwfdb/%s %s GTK+/%u.%u.%u)",
+			METAANN_VERSION, wfdbversion(), curl_version(),
+			gtk_major_version, gtk_minor_version,
+			gtk_micro_version);
+
+    curl_easy_setopt(ses->curl, CURLOPT_USERAGENT, s);
+    g_free(s);
+
+    curl_easy_setopt(ses->curl, CURLOPT_HTTPAUTH, CURLAUTH_ANY);
+    curl_easy_setopt(ses->curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(ses->curl, CURLOPT_NOSIGNAL, 1L);
+
+    g_private_set(&session_key, ses);
+    return ses;
+}
+
 static char * request(const char *url, const char *postdata,
 		      const char *username, const char *password,
-		      int no_body, int *length, GError **err)
+		      int no_body, const char *range, struct url_info *info,
+		      long *code, int *length, GError **err)
 {
+    struct url_session *ses = get_session();
+    CURL *curl = ses->curl;
     GString *str;
     char *s;
     int status;
+    long http_code = 0;
 
     if (length)
 	*length = 0;
 
-    if (!curl) {
-	curl_global_init(CURL_GLOBAL_ALL);
-	curl = curl_easy_init();
-	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error_buf);
-
-	s = g_strdup_printf("metaann/%s (libwfdb/%s %s GTK+/%u.%u.%u)",
-			    METAANN_VERSION, wfdbversion(), curl_version(),
-			    gtk_major_version, gtk_minor_version,
-			    gtk_micro_version);
-
-	curl_easy_setopt(curl, CURLOPT_USERAGENT, s);
-	g_free(s);
-
-	curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_ANY);
-	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
-    }
-
     curl_easy_setopt(curl, CURLOPT_URL, url);
 
     if (username && password) {
@@ -87,18 +151,38 @@ static char * request(const char *url, const char *postdata,
 	curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
     }
 
+    curl_easy_setopt(curl, CURLOPT_RANGE, range);
+    if (info) {
+	info->etag = info->last_modified = NULL;
+	info->length = -1;
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &parse_header);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, info);
+    }
+    else {
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, NULL);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, NULL);
+    }
+
     str = g_string_new(NULL);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &append_to_str);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, str);
 
-    strcpy(error_buf, "Unknown I/O error");
+    strcpy(ses->error_buf, "Unknown I/O error");
 
     status = curl_easy_perform(curl);
     if (status != 0) {
-	g_set_error(err, ERROR_DOMAIN, 1, "%s", error_buf);
+	/* For an HTTP error, the error code is the HTTP status. */
+	if (status == CURLE_HTTP_RETURNED_ERROR)
+	    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+	g_set_error(err, ERROR_DOMAIN, (http_code ? http_code : 1),
+		    "%s", ses->error_buf);
 	g_string_free(str, TRUE);
+	if (info)
+	    url_info_clear(info);
 	return NULL;
     }
+    if (code)
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, code);
 
     if (length)
 	*length = str->len;
@@ -114,7 +198,8 @@ gboolean url_head(const char *url, const char *username,
     g_return_val_if_fail(url != NULL, FALSE);
     g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
 
-    s = request(url, NULL, username, password, 1, NULL, err);
+    s = request(url, NULL, username, password, 1, NULL, NULL, NULL, NULL,
+		err);
     g_free(s);
     return (s != NULL);
 }
@@ -125,7 +210,8 @@ char * url_get(const char *url, const char *username,
     g_return_val_if_fail(url != NULL, NULL);
     g_return_val_if_fail(err == NULL || *err == NULL, NULL);
 
-    return request(url, NULL, username, password, 0, length, err);
+    return request(url, NULL, username, password, 0, NULL, NULL, NULL,
+		   length, err);
 }
 
 char * url_post(const char *url, const char *postdata,
@@ -135,5 +221,57 @@ char * url_post(const char *url, const char *postdata,
     g_return_val_if_fail(url != NULL, NULL);
     g_return_val_if_fail(err == NULL || *err == NULL, NULL);
 
-    return request(url, postdata, username, password, 0, length, err);
+    return request(url, postdata, username, password, 0, NULL, NULL, NULL,
+		   length, err);
+}
+
+/* Url_stat() obtains the validators (ETag and Last-Modified) and length
+   of a resource, using a HEAD request.  Fields not supplied by the server
+   are set to NULL (or -1 for the length.) */
+gboolean url_stat(const char *url, const char *username,
+		  const char *password, struct url_info *info, GError **err)
+{
+    char *s;
+
+    g_return_val_if_fail(url != NULL, FALSE);
+    g_return_val_if_fail(info != NULL, FALSE);
+    g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+    s = request(url, NULL, username, password, 1, NULL, info, NULL, NULL,
+		err);
+    g_free(s);
+    return (s != NULL);
+}
+
+/* Url_get_range() retrieves count bytes of a resource, beginning at the
+   given offset.  If the server ignores the range and sends the whole
+   resource, *partial is set to FALSE and the whole resource is returned
+   (the caller may wish to keep it); otherwise *partial is set to
+   TRUE. */
+char * url_get_range(const char *url, const char *username,
+		     const char *password, gint64 offset, gint64 count,
+		     gboolean *partial, int *length, GError **err)
+{
+    char *range, *s;
+    long code = 0;
+
+    g_return_val_if_fail(url != NULL, NULL);
+    g_return_val_if_fail(err == NULL || *err == NULL, NULL);
+
+    range = g_strdup_printf("%" G_GINT64_FORMAT "-%" G_GINT64_FORMAT,
+			    offset, offset + count - 1);
+    s = request(url, NULL, username, password, 0, range, NULL, &code,
+		length, err);
+    g_free(range);
+    if (partial)
+	*partial = (code == 206);
+    return s;
+}
+
+void url_info_clear(struct url_info *info)
+{
+    g_free(info->etag);
+    g_free(info->last_modified);
+    info->etag = info->last_modified = NULL;
+    info->length = -1;
 }
@@ -19,6 +19,16 @@
 
 #include <glib.h>
 
+/* Errors are reported in this domain; the code is the HTTP status if
+   the server returned an error, or 1 for any other failure. */
+#define URL_ERROR (g_quark_from_static_string("metaann-url"))
+
+struct url_info {
+    char *etag;			/* ETag, or NULL if none */
+    char *last_modified;	/* Last-Modified, or NULL if none */
+    gint64 length;		/* length, or -1 if not known */
+};
+
 gboolean url_head(const char *url, const char *username,
 		  const char *password, GError **err);
 
@@ -28,3 +38,12 @@ char * url_get(const char *url, const char *username,
 char * url_post(const char *url, const char *postdata,
 		const char *username, const char *password,
 		int *length, GError **err);
+
+gboolean url_stat(const char *url, const char *username,
+		  const char *password, struct url_info *info, GError **err);
+
+char * url_get_range(const char *url, const char *username,
+		     const char *password, gint64 offset, gint64 count,
+		     gboolean *partial, int *length, GError **err);
+
+void url_info_clear(struct url_info *info);
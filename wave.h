@@ -34,9 +34,9 @@ _______________________________________________________________________________
 
 /* WAVE attempts to intuit the user's next display request, and maintains
    a cache of signal display lists that correspond to WAVE's guesses as
-   well as of recently displayed segments.  Reduce this parameter if necessary
-   to conserve memory, but do not reduce it below 2. */
-#define MAX_DISPLAY_LISTS	8
+   well as of recently displayed segments.  This is the default size of the
+   cache, in kilobytes (see Wave.DisplayCacheSize.) */
+#define DEF_DISPLAY_CACHE_SIZE	16384
 
 /* Bits for display mode (passed from main() to initialize_graphics()). */
 #define MODE_MONO	1    /* use monochrome mode even on a color screen */
@@ -157,6 +157,12 @@ COMMON char *helpdir;			/* name of directory containing on-line
 COMMON char log_file_name[LNLMAX+1];	/* name of log file, if any */
 COMMON char description[DSLMAX+1];	/* description from log file */
 COMMON int nsig;			/* number of signals */
+COMMON int *sigslot;			/* position of each signal among those
+					   read, or -1 if it is not read (see
+					   select_signals() in init.c) */
+COMMON int nsigread;			/* number of signals read */
+COMMON char *record_key;		/* record name and signals read, which
+					   identify cached samples and screens */
 COMMON int nann;			/* number of annotators (0 or 1) */
 COMMON char annotator[ANLMAX+1];	/* annotator name */
 COMMON WFDB_Anninfo af;			/* annotator info, passed to annopen */
@@ -257,17 +263,29 @@ COMMON struct WFDB_ann ann_template;
 COMMON struct WFDB_ann search_template;
 COMMON int search_mask;
 
-/* The annotation list is built from `ap' structures; ap_start and ap_end
-   point to the first and last annotations in the list, and annp is a
-   general-use pointer that usually points to an annotation in the current
-   region of interest.  During editing, `attached' points to the annotation
-   that is to be changed, if any. `scope_annp' points to the annotation
-   associated with the waveform most recently drawn in the scope window. */
-struct ap {
-    struct WFDB_ann this;
-    struct ap *previous, *next;
-};
-COMMON struct ap *ap_start, *ap_end, *annp, *attached, *scope_annp;
+/* The annotation list is stored in time order (and, for simultaneous
+   annotations, in order of `chan') as a set of arrays, one for each field of
+   the WFDB_ann structure, each of length n_annots.  Each distinct aux
+   string (preceded by its length byte and followed by a null, as returned by
+   getann) is stored once, in ann_aux_arena; ann_aux_offset[n] is the offset
+   of the nth of the n_aux_strings distinct strings, and ann_aux[i] is the
+   number of the aux string for annotation i, or -1 if it has none
+   (ann_auxp(i) gives a pointer to the string, or NULL.)  ann_cur is the
+   index of a general-use annotation, usually in the current region of
+   interest, or -1.  During editing, `attached' is the index of the
+   annotation that is to be changed, if any (or -1.) */
+COMMON long n_annots;
+COMMON WFDB_Time *ann_time;
+COMMON char *ann_anntyp;
+COMMON signed char *ann_subtyp;
+COMMON unsigned char *ann_chan;
+COMMON signed char *ann_num;
+COMMON long *ann_aux;
+COMMON unsigned char *ann_aux_arena;
+COMMON long *ann_aux_offset, n_aux_strings;
+COMMON long ann_cur, attached;
+#define ann_auxp(i)	(ann_aux[i] < 0 ? NULL : \
+			 ann_aux_arena + ann_aux_offset[ann_aux[i]])
 
 /* Function prototypes for ANSI C and C++ compilers.  If you attempt to compile
    WAVE with a C++ compiler, you will need to change the function definitions
@@ -318,8 +336,13 @@ extern int in_siglist();			/* in signal.c */
 extern void do_disp(void);			/* in signal.c */
 extern void clear_cache(void);			/* in signal.c */
 extern int sigy(int sig, int x);		/* in signal.c */
-extern struct ap *get_ap(void);			/* in annot.c */
 extern int annot_init(void);			/* in annot.c */
+extern long load_annotations(const char *rec,	/* in annot.c */
+			     const char *ann, double afreq, int lazy);
+extern void list_annotation(long i,		/* in annot.c */
+			    struct WFDB_ann *annot);
+extern void prefetch_annotations(long left,	/* in annot.c */
+				 long right);
 extern long next_match(struct WFDB_ann *template,	/* in annot.c */
 		       int mask);
 extern long previous_match(struct WFDB_ann *template,/* in annot.c */
@@ -327,11 +350,15 @@ extern long previous_match(struct WFDB_ann *template,/* in annot.c */
 extern void show_annotations(long start_time,	/* in annot.c */
 			     int duration);
 extern void clear_annotation_display(void);	/* in annot.c */
-extern struct ap *locate_annotation(long time, int chan); /* in annot.c */
+extern long locate_annotation(long time, int chan); /* in annot.c */
+extern long find_annotations(long left,		/* in annot.c */
+			     long right, long *first);
+extern void aggregate_annotations(long left,	/* in annot.c */
+				  int ncols, long *count, char *dominant);
 extern void delete_annotation(long time, int chan); /* in annot.c */
-extern void move_annotation(struct ap *a,	/* in annot.c */
+extern void move_annotation(long i,		/* in annot.c */
 			    long time);
-extern void insert_annotation(struct ap *a);	/* in annot.c */
+extern void insert_annotation(struct WFDB_ann *a); /* in annot.c */
 extern void change_annotations(void);		/* in annot.c */
 extern void check_post_update(void);		/* in annot.c */
 extern int post_changes(void);			/* in annot.c */
@@ -365,8 +392,8 @@ extern void sync_other_wave_processes(void);	/* in xvwave.c */
 extern char *wmstimstr(), *wtimstr();
 extern int record_init(), annot_init(), post_changes(), initialize_graphics(),
     sigy(), in_siglist();
-extern long next_match(), previous_match(), wstrtim();
-extern struct ap *get_ap(), *locate_annotation();
+extern long next_match(), previous_match(), wstrtim(), locate_annotation(),
+    find_annotations(), load_annotations();
 extern void set_baselines(), calibrate(), set_record_item(), set_annot_item(),
     set_start_time(), set_end_time(), set_find_item(), show_search_template(),
     create_mode_popup(), show_mode(),
@@ -376,6 +403,7 @@ extern void set_baselines(), calibrate(), set_record_item(), set_annot_item(),
     set_ann_chan(), set_ann_aux(), bar(), box(),
     restore_cursor(), restore_grid(), show_grid(), sig_highlight(), do_disp(),
     clear_cache(), show_annotations(), clear_annotation_display(),
+    aggregate_annotations(), list_annotation(), prefetch_annotations(),
     delete_annotation(), move_annotation(), insert_annotation(),
     change_annotations(), check_post_update(), set_frame_title(),
     analyze_proc(), reset_start(), reset_stop(), reset_maxsig(),
@@ -29,6 +29,21 @@ static GdkGC *bg_fill;
 
 static int reload_signals, reload_annotations, recalibrate;
 
+/* The wave view is drawn in layers, each kept in an off-screen pixmap.  The
+   signal layer holds the grid (itself kept in a pixmap; see show_grid()) and
+   the signals.  The frame holds a copy of the signal layer, with the times,
+   annotations and highlighted signal drawn over it.  An exposure is handled
+   by copying from the frame, which is redrawn only after
+   wave_view_redraw_overlay() or wave_view_redraw() has been called; the
+   signal layer is redrawn only after wave_view_redraw(). */
+static GdkPixmap *signal_layer, *frame;
+static int layer_width, layer_height;
+static int signal_layer_valid, frame_valid;
+
+/* While a record is being loaded (see load_record() in metaann.c), a
+   message is shown in place of the signals. */
+static char *placeholder;
+
 void set_record_and_annotator(const char *rec, const char *ann)
 {
     char *r, *a;
@@ -56,6 +71,7 @@ void set_record_and_annotator(const char *rec, const char *ann)
 	annotator[0] = '\0';	/* force re-initialization of annotator if
 				   record was changed */
 	savebackup = 1;
+	signal_layer_valid = frame_valid = 0;
     }
 
     /* If a new annotator has been selected, re-initialize. */
@@ -69,6 +85,7 @@ void set_record_and_annotator(const char *rec, const char *ann)
 	    nann = 0;
 	annot_init();
 	savebackup = 1;
+	signal_layer_valid = frame_valid = 0;
     }
 
     reload_signals = reload_annotations = 0;
@@ -76,21 +93,83 @@ void set_record_and_annotator(const char *rec, const char *ann)
     g_free(a);
 }
 
+/* Allocate the layer pixmaps, if they don't exist or if the size of the
+   window has changed. */
+static void alloc_layers(GtkWidget *w)
+{
+    GtkAllocation alloc;
+
+    gtk_widget_get_allocation(w, &alloc);
+    if (signal_layer && alloc.width == layer_width
+	&& alloc.height == layer_height)
+	return;
+
+    if (signal_layer) g_object_unref(signal_layer);
+    if (frame) g_object_unref(frame);
+    layer_width = MAX(alloc.width, 1);
+    layer_height = MAX(alloc.height, 1);
+    signal_layer = gdk_pixmap_new(gtk_widget_get_window(w),
+				  layer_width, layer_height, -1);
+    frame = gdk_pixmap_new(gtk_widget_get_window(w),
+			   layer_width, layer_height, -1);
+    signal_layer_valid = frame_valid = 0;
+}
+
+/* Draw the placeholder message in the middle of the window. */
+static void show_placeholder(GtkWidget *w)
+{
+    GtkAllocation alloc;
+    int len = strlen(placeholder);
+
+    gtk_widget_get_allocation(w, &alloc);
+    wave_drawable = gtk_widget_get_window(w);
+    gdk_draw_rectangle(wave_drawable, bg_fill, TRUE,
+		       0, 0, alloc.width, alloc.height);
+    wave_draw_string(wave_drawable, draw_ann,
+		     (alloc.width - wave_text_width(placeholder, len)) / 2,
+		     alloc.height / 2, placeholder, len);
+}
+
 /* Handle exposures in the signal window. */
 static void repaint(GtkWidget *w, GdkEventExpose *ev, gpointer data)
 {
+    if (placeholder) {
+	show_placeholder(w);
+	return;
+    }
+
     set_record_and_annotator(record, annotator);
 
     if (recalibrate) {
 	if (vscale)
 	    vscale[0] = 0.0;
 	calibrate();
+	signal_layer_valid = frame_valid = 0;
     }
 
     recalibrate = 0;
 
-    restore_grid();
-    do_disp();
+    alloc_layers(w);
+    if (!signal_layer_valid) {
+	wave_drawable = signal_layer;
+	gdk_draw_rectangle(signal_layer, bg_fill, TRUE,
+			   0, 0, layer_width, layer_height);
+	show_signal_layer();
+	signal_layer_valid = 1;
+	frame_valid = 0;
+    }
+    if (!frame_valid) {
+	gdk_draw_drawable(frame, bg_fill, signal_layer, 0, 0, 0, 0,
+			  layer_width, layer_height);
+	wave_drawable = frame;
+	show_overlay_layer();
+	frame_valid = 1;
+    }
+
+    wave_drawable = gtk_widget_get_window(w);
+    gdk_draw_drawable(wave_drawable, bg_fill, frame,
+		      ev->area.x, ev->area.y, ev->area.x, ev->area.y,
+		      ev->area.width, ev->area.height);
     /*restore_cursor();*/
 }
 
@@ -121,6 +200,7 @@ static void resize(GtkWidget *w, GtkAllocation *alloc, gpointer data)
        seems unnecessary. */
     canvas_height = height;
     canvas_height_mv = canvas_height / dmmy(10);
+    signal_layer_valid = frame_valid = 0;
     
     /* Recalibrate based on selected scales, clear the display list cache. */
     if (*record && gtk_widget_get_realized(w)) {
@@ -623,7 +703,38 @@ void wave_view_force_reload()
     reload_signals = reload_annotations = 1;
 }
 
+/* Wave_view_show_placeholder() replaces the signals with the given
+   message, or (if text is NULL) shows them again. */
+void wave_view_show_placeholder(const char *text)
+{
+    if (!text && !placeholder)
+	return;
+    g_free(placeholder);
+    placeholder = g_strdup(text);
+    signal_layer_valid = frame_valid = 0;
+    if (wave_view)
+	gtk_widget_queue_draw(wave_view);
+}
+
 void wave_view_force_recalibrate()
 {
     recalibrate = 1;
 }
+
+/* Wave_view_redraw() causes the entire wave view to be redrawn, and should be
+   called whenever anything it shows has changed. */
+void wave_view_redraw()
+{
+    signal_layer_valid = frame_valid = 0;
+    if (wave_view)
+	gtk_widget_queue_draw(wave_view);
+}
+
+/* Wave_view_redraw_overlay() causes only the times, annotations and
+   highlighting to be redrawn over the existing signal layer. */
+void wave_view_redraw_overlay()
+{
+    frame_valid = 0;
+    if (wave_view)
+	gtk_widget_queue_draw(wave_view);
+}
@@ -23,7 +23,7 @@
 void set_display_start_time(WFDB_Time t)
 {
     display_start_time = MAX(0, t);
-    gtk_widget_queue_draw(wave_view);
+    wave_view_redraw();
 }
 
 static void scroll_back_full(G_GNUC_UNUSED GtkButton *btn,